@@ -0,0 +1,145 @@
+/*
+ * Microbenchmark for the XOR kernels used by the parity generator.
+ *
+ * For every supported kernel, buffer size and number of sources we report
+ * the throughput in GB/s of source data consumed. Every kernel is checked
+ * against the scalar kernel before it is timed. The GF(2^8) multiply-and-add
+ * kernels used for Q parity and the CRC32C used for stripe checksums are
+ * measured the same way.
+ *
+ *   bench-xor [max-sources]
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <time.h>
+
+#include "../common/common.h"
+#include "../common/crc32c.h"
+#include "../common/gf256.h"
+#include "../common/xor_kernels.h"
+
+#define MIN_BENCH_TIME 0.2
+
+static
+double now(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+int main(int argc, char **argv)
+{
+    const size_t sizes[] = { 4*1024, 64*1024, 1024*1024, 10*1024*1024 };
+    const int nsizes = sizeof(sizes)/sizeof(sizes[0]);
+    int max_sources = (argc > 1)? atoi(argv[1]) : 12;
+    if (max_sources < 2 || max_sources > MAX_STORAGE_TARGETS) {
+        fprintf(stderr, "usage: bench-xor [max-sources (2..%d)]\n", MAX_STORAGE_TARGETS);
+        return 1;
+    }
+
+    size_t max_size = sizes[nsizes - 1];
+    uint8_t *data = malloc(max_sources * max_size);
+    uint8_t *dst = malloc(max_size);
+    uint8_t *ref = malloc(max_size);
+    for (size_t i = 0; i < max_sources * max_size; i++)
+        data[i] = (uint8_t)(rand() >> 7);
+
+    printf("selected kernel: %s\n", xor_selected_kernel());
+    printf("kernel   |       size | sources |      GB/s\n");
+    for (int k = 0; k < xor_kernel_count(); k++)
+    {
+        if (!xor_kernel_supported(k)) {
+            printf("%-8s | not supported on this cpu\n", xor_kernel_name(k));
+            continue;
+        }
+        for (int s = 0; s < nsizes; s++)
+        {
+            size_t nbytes = sizes[s];
+            for (int n = 2; n <= max_sources; n++)
+            {
+                const uint8_t *srcs[MAX_STORAGE_TARGETS];
+                for (int j = 0; j < n; j++)
+                    srcs[j] = data + j*nbytes;
+
+                xor_blocks_with(0, ref, nbytes, srcs, n);
+                xor_blocks_with(k, dst, nbytes, srcs, n);
+                if (memcmp(ref, dst, nbytes) != 0) {
+                    printf("%-8s | %10zu | %7d | WRONG RESULT\n", xor_kernel_name(k), nbytes, n);
+                    continue;
+                }
+
+                size_t iters = 0;
+                double t0 = now(), dt = 0.0;
+                do {
+                    xor_blocks_with(k, dst, nbytes, srcs, n);
+                    iters += 1;
+                    dt = now() - t0;
+                } while (dt < MIN_BENCH_TIME);
+
+                printf("%-8s | %10zu | %7d | %9.2f\n",
+                        xor_kernel_name(k), nbytes, n,
+                        1e-9 * (double)iters * nbytes * n / dt);
+            }
+        }
+    }
+
+    printf("\nselected gf kernel: %s\n", gf_selected_kernel());
+    printf("kernel   |       size |      GB/s\n");
+    for (int k = 0; k < gf_kernel_count(); k++)
+    {
+        if (!gf_kernel_supported(k)) {
+            printf("%-8s | not supported on this cpu\n", gf_kernel_name(k));
+            continue;
+        }
+        for (int s = 0; s < nsizes; s++)
+        {
+            size_t nbytes = sizes[s];
+            memcpy(ref, data + nbytes, nbytes);
+            memcpy(dst, data + nbytes, nbytes);
+            gf_mul_region_with(0, ref, data, nbytes, 0x8e, 1);
+            gf_mul_region_with(k, dst, data, nbytes, 0x8e, 1);
+            if (memcmp(ref, dst, nbytes) != 0) {
+                printf("%-8s | %10zu | WRONG RESULT\n", gf_kernel_name(k), nbytes);
+                continue;
+            }
+
+            size_t iters = 0;
+            double t0 = now(), dt = 0.0;
+            do {
+                gf_mul_region_with(k, dst, data, nbytes, 0x8e, 1);
+                iters += 1;
+                dt = now() - t0;
+            } while (dt < MIN_BENCH_TIME);
+
+            printf("%-8s | %10zu | %9.2f\n",
+                    gf_kernel_name(k), nbytes, 1e-9 * (double)iters * nbytes / dt);
+        }
+    }
+
+    printf("\ncrc32c     |       size |      GB/s\n");
+    if (crc32c(0, "123456789", 9) != 0xe3069283)
+        printf("crc32c     | WRONG RESULT\n");
+    for (int s = 0; s < nsizes; s++)
+    {
+        size_t nbytes = sizes[s];
+        volatile uint32_t crc = 0;
+        size_t iters = 0;
+        double t0 = now(), dt = 0.0;
+        do {
+            crc = crc32c(crc, data, nbytes);
+            iters += 1;
+            dt = now() - t0;
+        } while (dt < MIN_BENCH_TIME);
+
+        printf("crc32c     | %10zu | %9.2f\n", nbytes, 1e-9 * (double)iters * nbytes / dt);
+    }
+
+    free(ref);
+    free(dst);
+    free(data);
+    return 0;
+}
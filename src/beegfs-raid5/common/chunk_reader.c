@@ -0,0 +1,302 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>) && defined(__NR_io_uring_setup)
+#include <linux/io_uring.h>
+#define HAVE_IO_URING 1
+#endif
+#endif
+
+#include "common.h"
+#include "chunk_reader.h"
+
+/* Number of blocks read ahead of the block being sent */
+#ifndef CHUNK_READ_DEPTH
+#define CHUNK_READ_DEPTH 4
+#endif
+
+/* Bytes past the blocks being read that the kernel may prefetch */
+#ifndef CHUNK_READAHEAD
+#define CHUNK_READAHEAD (16*1024*1024)
+#endif
+
+/* When non-zero, blocks are dropped from the page cache once sent. That
+ * includes pages some client had cached, so it can be turned off. */
+#ifndef CHUNK_DROP_BEHIND
+#define CHUNK_DROP_BEHIND 1
+#endif
+
+/*
+ * The buffers are shared by every reader of the process, chunk_sender only
+ * ever has one file open. Block b of a file is read in to buffer
+ * b % CHUNK_READ_DEPTH.
+ */
+static uint8_t *buffers[CHUNK_READ_DEPTH];
+static int32_t results[CHUNK_READ_DEPTH];
+static int completed[CHUNK_READ_DEPTH];
+/* 0 until set up, then 1 with io_uring and -1 with blocking reads */
+static int mode = 0;
+
+#ifdef HAVE_IO_URING
+/* liburing is not required, the few parts of it we need are done here */
+static struct {
+    int fd;
+    unsigned *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    int fixed;
+} ring;
+
+static
+int uring_enter(unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    int r;
+    do {
+        r = syscall(__NR_io_uring_enter, ring.fd, to_submit, min_complete, flags, NULL, 0);
+    } while (r < 0 && (errno == EINTR || errno == EAGAIN || errno == EBUSY));
+    return r;
+}
+
+static
+int uring_setup(void)
+{
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    ring.fd = syscall(__NR_io_uring_setup, CHUNK_READ_DEPTH, &p);
+    if (ring.fd < 0)
+        return -1;
+
+    size_t sq_size = p.sq_off.array + p.sq_entries*sizeof(unsigned);
+    size_t cq_size = p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe);
+    int single_mmap = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single_mmap)
+        sq_size = cq_size = MAX(sq_size, cq_size);
+    uint8_t *sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+    uint8_t *cq = single_mmap? sq : mmap(NULL, cq_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_CQ_RING);
+    void *sqes = mmap(NULL, p.sq_entries*sizeof(struct io_uring_sqe),
+            PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+    if (sq == MAP_FAILED || cq == MAP_FAILED || sqes == MAP_FAILED) {
+        close(ring.fd);
+        return -1;
+    }
+    ring.sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    ring.sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    ring.sq_array = (unsigned *)(sq + p.sq_off.array);
+    ring.cq_head = (unsigned *)(cq + p.cq_off.head);
+    ring.cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    ring.cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    ring.sqes = sqes;
+
+    /* Registered buffers save pinning the pages on every read, but they
+     * count against RLIMIT_MEMLOCK. Plain reads work without. */
+    struct iovec iov[CHUNK_READ_DEPTH];
+    for (int i = 0; i < CHUNK_READ_DEPTH; i++) {
+        iov[i].iov_base = buffers[i];
+        iov[i].iov_len = FILE_TRANSFER_BUFFER_SIZE;
+    }
+    ring.fixed = (syscall(__NR_io_uring_register, ring.fd,
+                IORING_REGISTER_BUFFERS, iov, CHUNK_READ_DEPTH) == 0);
+    return 0;
+}
+
+static
+int uring_submit_read(int slot, int fd, uint64_t offset, size_t len)
+{
+    unsigned tail = *ring.sq_tail;
+    unsigned idx = tail & *ring.sq_mask;
+    struct io_uring_sqe *sqe = &ring.sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = ring.fixed? IORING_OP_READ_FIXED : IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->off = offset;
+    sqe->addr = (uintptr_t)buffers[slot];
+    sqe->len = len;
+    sqe->buf_index = ring.fixed? slot : 0;
+    sqe->user_data = slot;
+    ring.sq_array[idx] = idx;
+    completed[slot] = 0;
+    __atomic_store_n(ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+    int r = uring_enter(1, 0, 0);
+    if (r <= 0) {
+        /* Not taken by the kernel, so it must not go with the next enter
+         * in stead of that one's own read */
+        __atomic_store_n(ring.sq_tail, tail, __ATOMIC_RELEASE);
+        return -1;
+    }
+    return r;
+}
+
+static
+void uring_wait(int slot)
+{
+    while (!completed[slot]) {
+        unsigned head = *ring.cq_head;
+        if (head == __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE)) {
+            if (uring_enter(0, 1, IORING_ENTER_GETEVENTS) < 0)
+                abort();
+            continue;
+        }
+        struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+        results[cqe->user_data] = cqe->res;
+        completed[cqe->user_data] = 1;
+        __atomic_store_n(ring.cq_head, head + 1, __ATOMIC_RELEASE);
+    }
+}
+#endif
+
+static
+void setup(void)
+{
+    if (mode != 0)
+        return;
+    for (int i = 0; i < CHUNK_READ_DEPTH; i++)
+        if (posix_memalign((void **)&buffers[i], 4096, FILE_TRANSFER_BUFFER_SIZE) != 0)
+            abort();
+    mode = -1;
+#ifdef HAVE_IO_URING
+    if (uring_setup() == 0)
+        mode = 1;
+#endif
+}
+
+/* Reads the rest of a block after a short read, returns -1 on errors */
+static
+ssize_t read_rest(int fd, uint8_t *buf, uint64_t offset, ssize_t got, size_t want)
+{
+    while (got >= 0 && (size_t)got < want) {
+        ssize_t r = pread(fd, buf + got, want - got, offset + got);
+        if (r < 0)
+            return -1;
+        if (r == 0)
+            break;
+        got += r;
+    }
+    return got;
+}
+
+static
+size_t block_len(const ChunkReader *r, uint64_t block)
+{
+    uint64_t offset = r->start + block*r->block_size;
+    return MIN(r->block_size, r->end - offset);
+}
+
+static
+void drop_behind(const ChunkReader *r, uint64_t offset, uint64_t len)
+{
+#if CHUNK_DROP_BEHIND
+    if (r->fd >= 0 && len > 0)
+        posix_fadvise(r->fd, offset, len, POSIX_FADV_DONTNEED);
+#else
+    (void)r; (void)offset; (void)len;
+#endif
+}
+
+/* Requests prefetch of the window after the last block submitted */
+static
+void advise_ahead(ChunkReader *r)
+{
+    if (r->error)
+        return;
+    uint64_t from = MAX(r->advised, MIN(r->end, r->start + r->submitted*r->block_size));
+    uint64_t to = MIN(r->end, r->start + r->submitted*r->block_size + CHUNK_READAHEAD);
+    if (to > from)
+        posix_fadvise(r->fd, from, to - from, POSIX_FADV_WILLNEED);
+    r->advised = MAX(r->advised, to);
+}
+
+static
+void submit(ChunkReader *r)
+{
+    uint64_t b = r->submitted++;
+    int slot = b % CHUNK_READ_DEPTH;
+    uint64_t offset = r->start + b*r->block_size;
+    size_t want = block_len(r, b);
+#ifdef HAVE_IO_URING
+    if (mode == 1 && uring_submit_read(slot, r->fd, offset, want) >= 0)
+        return;
+#endif
+    results[slot] = read_rest(r->fd, buffers[slot], offset, 0, want);
+    completed[slot] = 1;
+}
+
+void chunk_reader_start(ChunkReader *r, int fd, uint64_t offset, uint64_t nbytes, size_t block_size)
+{
+    setup();
+    r->fd = fd;
+    r->block_size = block_size;
+    r->start = offset;
+    r->end = offset + nbytes;
+    r->nblocks = (block_size == 0)? 0 : (nbytes + block_size - 1) / block_size;
+    r->submitted = 0;
+    r->consumed = 0;
+    r->advised = offset;
+    r->error = (fd < 0);
+    if (mode == 1)
+        while (!r->error && r->submitted < MIN(r->nblocks, CHUNK_READ_DEPTH))
+            submit(r);
+    advise_ahead(r);
+}
+
+const uint8_t *chunk_reader_next(ChunkReader *r)
+{
+    uint64_t b = r->consumed++;
+    int slot = b % CHUNK_READ_DEPTH;
+    uint8_t *buf = buffers[slot];
+
+    /* The previous block has been sent, so its buffer can be refilled and
+     * its pages dropped */
+    if (b > 0)
+        drop_behind(r, r->start + (b - 1)*r->block_size, block_len(r, b - 1));
+    if (mode == 1)
+        while (!r->error && r->submitted < MIN(r->nblocks, b + CHUNK_READ_DEPTH))
+            submit(r);
+    else if (!r->error && r->submitted == b)
+        submit(r);
+    advise_ahead(r);
+
+    ssize_t got = -1;
+    if (b < r->submitted) {
+#ifdef HAVE_IO_URING
+        if (mode == 1)
+            uring_wait(slot);
+#endif
+        got = results[slot];
+        /* Short reads are finished, and failed ones retried, with pread */
+        if (!r->error)
+            got = read_rest(r->fd, buf, r->start + b*r->block_size,
+                    MAX(got, 0), block_len(r, b));
+    }
+    /* Like the blocking reader always did, the first empty or failed read
+     * (e.g. at the end of a chunk shorter than the range) means zeros for
+     * this and every following block */
+    r->error |= (got <= 0);
+    if (r->error)
+        got = 0;
+    memset(buf + got, 0, r->block_size - got);
+    return buf;
+}
+
+void chunk_reader_finish(ChunkReader *r)
+{
+#ifdef HAVE_IO_URING
+    if (mode == 1)
+        for (uint64_t b = r->consumed; b < r->submitted; b++)
+            uring_wait(b % CHUNK_READ_DEPTH);
+#endif
+    r->consumed = r->submitted;
+    drop_behind(r, r->start, r->end - r->start);
+}
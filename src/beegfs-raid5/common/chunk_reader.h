@@ -0,0 +1,41 @@
+#ifndef __chunk_reader__
+#define __chunk_reader__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Sequential reader of a range of a file in blocks of up to
+ * FILE_TRANSFER_BUFFER_SIZE bytes, used by the chunk sender. With io_uring
+ * the next CHUNK_READ_DEPTH blocks are read in to registered buffers while
+ * the caller sends the current one. Without io_uring every block is a
+ * blocking pread.
+ *
+ * To keep the page cache footprint of a pass over all chunks bounded, blocks
+ * are dropped from the cache once they have been sent, and the kernel is
+ * only asked to prefetch a bounded window past the reads in flight.
+ */
+typedef struct {
+    int fd;
+    size_t block_size;
+    uint64_t start;
+    uint64_t nblocks;
+    uint64_t submitted;
+    uint64_t consumed;
+    uint64_t end;
+    uint64_t advised; /* <- Prefetch has been requested up to here */
+    int error;
+} ChunkReader;
+
+/* fd may be negative, every block is then zeros. */
+void chunk_reader_start(ChunkReader *r, int fd, uint64_t offset, uint64_t nbytes, size_t block_size);
+
+/* Next block, zero padded to block_size. Valid until the next call. Once a
+ * read fails, this and every following block is zeros and r->error is set. */
+const uint8_t *chunk_reader_next(ChunkReader *r);
+
+/* Waits for reads still in flight and drops the range from the page cache.
+ * Must be called before closing fd. */
+void chunk_reader_finish(ChunkReader *r);
+
+#endif
@@ -5,34 +5,86 @@
 
 #define MODIFY_EVENT 0
 #define UNLINK_EVENT 1
+/* Set in the event type of feeder records that are followed by the size,
+ * inode and device of the chunk */
+#define EVENT_WITH_STAT 0x100
 
 #define MAX_STORAGE_TARGETS 56
+#define FILE_TRANSFER_BUFFER_SIZE (10*1024*1024)
 #define TEST_BIT(x,i) ((x) & (1ULL << (i)))
 #define GET_P(loc) ((int)((loc) >> 56))
 #define P_MASK UINT64_C(0xFF00000000000000)
 #define L_MASK UINT64_C(0x00FFFFFFFFFFFFFF)
 #define WITH_P(loc, P) (((loc) & L_MASK) | (((P) << 56) & P_MASK))
 #define NO_P UINT64_C(0xFF)
+#define NO_Q NO_P
+#define NO_SIZE UINT64_MAX
 
 typedef struct {
     int64_t timestamp;
     uint64_t locations;
+    uint64_t Q;
 } FileInfo;
 
+/* Records written before Q was introduced only hold timestamp and locations */
+#define FILE_INFO_V1_SIZE (2*sizeof(uint64_t))
+
 typedef struct {
     const char *load_pat;
     const char *save_pat;
     int is_rebuilding;
     int actual_P_st; /* <- Only valid when rebuilding */
+    int actual_Q_st; /* <- Only valid when rebuilding */
+    uint64_t data_locations; /* <- Only valid when rebuilding */
+    int is_scrubbing; /* Compare with the stored parity in stead of writing it */
+    /* When generating, the chunk sizes found in phase 1, in header order. The
+     * sizes are then not exchanged. NULL if they aren't all known. */
+    const uint64_t *chunk_sizes;
 } TaskInfo;
 
 typedef struct { int id, rank; } Target;
 typedef struct {
     int ntargets;
     Target targetIDs[MAX_STORAGE_TARGETS];
+    /* Parity blocks (P and Q) counted on each target by the last parity-gen
+     * run, both new and kept ones. Zero in files from before they were added */
+    uint64_t placed_files[MAX_STORAGE_TARGETS];
+    uint64_t placed_bytes[MAX_STORAGE_TARGETS];
 } RunData;
 
 #define MAX(a,b) ((a) > (b)? (a) : (b))
 #define MIN(a,b) ((a) < (b)? (a) : (b))
 
+static inline
+unsigned simple_hash(const char *p, int len)
+{
+    unsigned h = 5381;
+    for (int i = 0; i < len; i++)
+        h = h + (h << 5) + p[i];
+    return h;
+}
+
+/* The targets that take part in the task: the data targets, P and Q */
+static inline
+uint64_t involved_sts(const FileInfo *fi)
+{
+    if (GET_P(fi->locations) == NO_P)
+        return 0;
+    uint64_t sts = (fi->locations & L_MASK) | (1ULL << GET_P(fi->locations));
+    if (fi->Q != NO_Q)
+        sts |= 1ULL << fi->Q;
+    return sts;
+}
+
+/*
+ * The targets whose DB keeps the entry of a file: the ones involved in it,
+ * and the one whose eater coordinates it in parity-gen. The last one is the
+ * backup, it must know the previous version of every file it coordinates.
+ */
+static inline
+uint64_t db_holders(const char *key, size_t keylen, const FileInfo *fi, int ntargets)
+{
+    return involved_sts(fi) | (1ULL << (simple_hash(key, keylen) % ntargets));
+}
+
 #endif
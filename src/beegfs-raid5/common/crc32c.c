@@ -0,0 +1,163 @@
+#include <stdint.h>
+#include <string.h>
+
+#include <pthread.h>
+#include <immintrin.h>
+
+#include "crc32c.h"
+
+#define POLY 0x82f63b78
+
+/*
+ * The hardware version runs three independent crc32 streams (the instruction
+ * has a latency of three cycles but a throughput of one per cycle) over
+ * LONG or SHORT byte blocks, and combines them by applying an operator that
+ * appends LONG/SHORT zero bytes to a crc. Based on the approach in Mark
+ * Adler's crc32c.c.
+ */
+#define LONG 8192
+#define SHORT 256
+
+static uint32_t crc32c_table[256];
+static uint32_t crc32c_long[4][256];
+static uint32_t crc32c_short[4][256];
+static int have_sse42;
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+static
+uint32_t gf2_matrix_times(const uint32_t *mat, uint32_t vec)
+{
+    uint32_t sum = 0;
+    while (vec) {
+        if (vec & 1)
+            sum ^= *mat;
+        vec >>= 1;
+        mat++;
+    }
+    return sum;
+}
+
+static
+void gf2_matrix_square(uint32_t *square, const uint32_t *mat)
+{
+    for (int n = 0; n < 32; n++)
+        square[n] = gf2_matrix_times(mat, mat[n]);
+}
+
+/* Operator that applies len (a power of two) zero bytes to a crc */
+static
+void zeros_op(uint32_t *even, size_t len)
+{
+    uint32_t odd[32];
+    odd[0] = POLY;
+    uint32_t row = 1;
+    for (int n = 1; n < 32; n++) {
+        odd[n] = row;
+        row <<= 1;
+    }
+    gf2_matrix_square(even, odd);
+    gf2_matrix_square(odd, even);
+    do {
+        gf2_matrix_square(even, odd);
+        len >>= 1;
+        if (len == 0)
+            return;
+        gf2_matrix_square(odd, even);
+        len >>= 1;
+    } while (len);
+    memcpy(even, odd, sizeof(odd));
+}
+
+static
+void zeros_tables(uint32_t zeros[4][256], size_t len)
+{
+    uint32_t op[32];
+    zeros_op(op, len);
+    for (uint32_t n = 0; n < 256; n++) {
+        zeros[0][n] = gf2_matrix_times(op, n);
+        zeros[1][n] = gf2_matrix_times(op, n << 8);
+        zeros[2][n] = gf2_matrix_times(op, n << 16);
+        zeros[3][n] = gf2_matrix_times(op, n << 24);
+    }
+}
+
+static
+uint32_t shift(uint32_t zeros[4][256], uint32_t crc)
+{
+    return zeros[0][crc & 0xff] ^ zeros[1][(crc >> 8) & 0xff]
+        ^ zeros[2][(crc >> 16) & 0xff] ^ zeros[3][crc >> 24];
+}
+
+static
+void init_tables(void)
+{
+    for (uint32_t n = 0; n < 256; n++) {
+        uint32_t crc = n;
+        for (int k = 0; k < 8; k++)
+            crc = (crc & 1)? (crc >> 1) ^ POLY : crc >> 1;
+        crc32c_table[n] = crc;
+    }
+    zeros_tables(crc32c_long, LONG);
+    zeros_tables(crc32c_short, SHORT);
+    __builtin_cpu_init();
+    have_sse42 = __builtin_cpu_supports("sse4.2");
+}
+
+static
+uint32_t crc32c_sw(uint32_t crc, const uint8_t *next, size_t len)
+{
+    uint32_t c = ~crc;
+    while (len--)
+        c = crc32c_table[(c ^ *next++) & 0xff] ^ (c >> 8);
+    return ~c;
+}
+
+static inline __attribute__((always_inline, target("sse4.2")))
+uint64_t crc_u64(uint64_t crc, const uint8_t *p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return _mm_crc32_u64(crc, v);
+}
+
+#define CRC_BLOCKS(BLOCK, ZEROS) \
+    while (len >= BLOCK*3) { \
+        uint64_t crc1 = 0, crc2 = 0; \
+        const uint8_t *end = next + BLOCK; \
+        do { \
+            crc0 = crc_u64(crc0, next); \
+            crc1 = crc_u64(crc1, next + BLOCK); \
+            crc2 = crc_u64(crc2, next + 2*BLOCK); \
+            next += 8; \
+        } while (next < end); \
+        crc0 = shift(ZEROS, (uint32_t)crc0) ^ crc1; \
+        crc0 = shift(ZEROS, (uint32_t)crc0) ^ crc2; \
+        next += 2*BLOCK; \
+        len -= 3*BLOCK; \
+    }
+
+__attribute__((target("sse4.2")))
+static
+uint32_t crc32c_hw(uint32_t crc, const uint8_t *next, size_t len)
+{
+    uint64_t crc0 = ~crc;
+    while (len && ((uintptr_t)next & 7) != 0) {
+        crc0 = _mm_crc32_u8((uint32_t)crc0, *next++);
+        len--;
+    }
+    CRC_BLOCKS(LONG, crc32c_long)
+    CRC_BLOCKS(SHORT, crc32c_short)
+    for (; len >= 8; len -= 8, next += 8)
+        crc0 = crc_u64(crc0, next);
+    while (len--)
+        crc0 = _mm_crc32_u8((uint32_t)crc0, *next++);
+    return ~(uint32_t)crc0;
+}
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len)
+{
+    pthread_once(&crc32c_once, init_tables);
+    if (have_sse42)
+        return crc32c_hw(crc, buf, len);
+    return crc32c_sw(crc, buf, len);
+}
@@ -0,0 +1,12 @@
+#ifndef __crc32c__
+#define __crc32c__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* CRC-32C (Castagnoli). Start with crc = 0, and pass the previous result to
+ * continue a checksum over several buffers. Uses the SSE4.2 crc32 instruction
+ * when the CPU has it. */
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+
+#endif
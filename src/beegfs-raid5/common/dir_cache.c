@@ -0,0 +1,208 @@
+#include <stdint.h>
+#include <string.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include "common.h"
+#include "dir_cache.h"
+
+/* Number of directories kept open */
+#ifndef DIR_CACHE_SIZE
+#define DIR_CACHE_SIZE 256
+#endif
+#define DIR_CACHE_BUCKETS (2*DIR_CACHE_SIZE)
+#define DIR_MAX_PATH 256
+
+typedef struct {
+    char path[DIR_MAX_PATH];
+    size_t len;
+    unsigned hash;
+    int fd;
+    int bucket_next;
+    int lru_prev;   /* <- Towards the most recently used */
+    int lru_next;
+} DirEntry;
+
+static DirEntry entries[DIR_CACHE_SIZE];
+static int buckets[DIR_CACHE_BUCKETS];
+static int lru_first = -1;
+static int lru_last = -1;
+static int nentries = 0;
+static int initialized = 0;
+
+static
+void lru_unlink(int i)
+{
+    DirEntry *e = &entries[i];
+    if (e->lru_prev >= 0)
+        entries[e->lru_prev].lru_next = e->lru_next;
+    else
+        lru_first = e->lru_next;
+    if (e->lru_next >= 0)
+        entries[e->lru_next].lru_prev = e->lru_prev;
+    else
+        lru_last = e->lru_prev;
+}
+
+static
+void lru_push_first(int i)
+{
+    entries[i].lru_prev = -1;
+    entries[i].lru_next = lru_first;
+    if (lru_first >= 0)
+        entries[lru_first].lru_prev = i;
+    lru_first = i;
+    if (lru_last < 0)
+        lru_last = i;
+}
+
+static
+int lookup(const char *dir, size_t len, unsigned hash)
+{
+    for (int i = buckets[hash % DIR_CACHE_BUCKETS]; i >= 0; i = entries[i].bucket_next)
+        if (entries[i].hash == hash && entries[i].len == len
+                && memcmp(entries[i].path, dir, len) == 0)
+            return i;
+    return -1;
+}
+
+/* Closes entry i and takes it out of the cache */
+static
+void evict(int i)
+{
+    int *p = &buckets[entries[i].hash % DIR_CACHE_BUCKETS];
+    while (*p != i)
+        p = &entries[*p].bucket_next;
+    *p = entries[i].bucket_next;
+    lru_unlink(i);
+    close(entries[i].fd);
+    entries[i].fd = -1;
+}
+
+static
+void insert(const char *dir, size_t len, unsigned hash, int fd)
+{
+    int i;
+    if (nentries < DIR_CACHE_SIZE)
+        i = nentries++;
+    else {
+        i = lru_last;
+        evict(i);
+    }
+    DirEntry *e = &entries[i];
+    memcpy(e->path, dir, len);
+    e->len = len;
+    e->hash = hash;
+    e->fd = fd;
+    e->bucket_next = buckets[hash % DIR_CACHE_BUCKETS];
+    buckets[hash % DIR_CACHE_BUCKETS] = i;
+    lru_push_first(i);
+}
+
+static int parent_fd(const char *path, int create, const char **name);
+
+/* The fd of directory `dir` (len bytes, not terminated), owned by the cache */
+static
+int dir_fd(const char *dir, size_t len, int create)
+{
+    if (!initialized) {
+        memset(buckets, -1, sizeof(buckets));
+        initialized = 1;
+    }
+    if (len == 0) {
+        dir = "/";
+        len = 1;
+    }
+    if (len >= DIR_MAX_PATH) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    unsigned hash = simple_hash(dir, len);
+    int i = lookup(dir, len, hash);
+    if (i >= 0) {
+        lru_unlink(i);
+        lru_push_first(i);
+        return entries[i].fd;
+    }
+
+    char tmp[DIR_MAX_PATH];
+    memcpy(tmp, dir, len);
+    tmp[len] = '\0';
+    int fd = open(tmp, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0 && errno == ENOENT && create) {
+        const char *name;
+        int parent = parent_fd(tmp, 1, &name);
+        if (parent == -1)
+            return -1;
+        if (mkdirat(parent, name, S_IRWXU) != 0 && errno != EEXIST)
+            return -1;
+        fd = openat(parent, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    }
+    if (fd < 0)
+        return -1;
+    insert(tmp, len, hash, fd);
+    return fd;
+}
+
+static
+int parent_fd(const char *path, int create, const char **name)
+{
+    const char *slash = strrchr(path, '/');
+    if (slash == NULL) {
+        *name = path;
+        return AT_FDCWD;
+    }
+    *name = slash + 1;
+    return dir_fd(path, slash - path, create);
+}
+
+/* After an ENOENT relative to dirfd: drops dirfd from the cache and returns
+ * non-zero if the directory itself is gone, so the call should be retried */
+static
+int forget_if_removed(const char *path, int dirfd)
+{
+    struct stat st;
+    if (dirfd == AT_FDCWD || fstat(dirfd, &st) != 0 || st.st_nlink > 0)
+        return 0;
+    const char *dir = path;
+    size_t len = strrchr(path, '/') - path;
+    if (len == 0) {
+        dir = "/";
+        len = 1;
+    }
+    int i = lookup(dir, len, simple_hash(dir, len));
+    if (i >= 0)
+        evict(i);
+    return 1;
+}
+
+int dir_cache_open(const char *path, int flags, mode_t mode)
+{
+    for (int attempt = 0; ; attempt++) {
+        const char *name;
+        int dirfd = parent_fd(path, (flags & O_CREAT) != 0, &name);
+        if (dirfd == -1)
+            return -1;
+        int fd = openat(dirfd, name, flags, mode);
+        if (fd >= 0 || errno != ENOENT || attempt > 0
+                || !forget_if_removed(path, dirfd))
+            return fd;
+    }
+}
+
+int dir_cache_unlink(const char *path)
+{
+    for (int attempt = 0; ; attempt++) {
+        const char *name;
+        int dirfd = parent_fd(path, 0, &name);
+        if (dirfd == -1)
+            return -1;
+        int r = unlinkat(dirfd, name, 0);
+        if (r == 0 || errno != ENOENT || attempt > 0
+                || !forget_if_removed(path, dirfd))
+            return r;
+    }
+}
@@ -0,0 +1,20 @@
+#ifndef __dir_cache__
+#define __dir_cache__
+
+#include <sys/types.h>
+
+/*
+ * Per process LRU cache of open directories, keyed by path. Files are opened
+ * with openat() relative to the cached fd of their parent, so the kernel
+ * doesn't walk the whole path for every chunk and parity file, and missing
+ * directories are only created (with mkdirat) when a parent isn't cached.
+ * A cached directory that has since been removed is noticed and reopened.
+ */
+
+/* Like open(2). With O_CREAT, missing parent directories are created. */
+int dir_cache_open(const char *path, int flags, mode_t mode);
+
+/* Like unlink(2) */
+int dir_cache_unlink(const char *path);
+
+#endif
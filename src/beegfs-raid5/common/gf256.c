@@ -0,0 +1,208 @@
+#include <stdint.h>
+#include <string.h>
+
+#include <immintrin.h>
+
+#include "gf256.h"
+
+#define GF_POLY 0x11d
+
+static uint8_t gf_log[256];
+static uint8_t gf_exp[512];
+static int tables_ready = 0;
+
+static
+void init_tables(void)
+{
+    if (tables_ready)
+        return;
+    unsigned x = 1;
+    for (int i = 0; i < 255; i++) {
+        gf_exp[i] = gf_exp[i + 255] = (uint8_t)x;
+        gf_log[x] = (uint8_t)i;
+        x <<= 1;
+        if (x & 0x100)
+            x ^= GF_POLY;
+    }
+    gf_exp[510] = gf_exp[0];
+    gf_exp[511] = gf_exp[1];
+    tables_ready = 1;
+}
+
+uint8_t gf_mul(uint8_t a, uint8_t b)
+{
+    init_tables();
+    if (a == 0 || b == 0)
+        return 0;
+    return gf_exp[gf_log[a] + gf_log[b]];
+}
+
+uint8_t gf_inv(uint8_t a)
+{
+    init_tables();
+    if (a == 0)
+        return 0;
+    return gf_exp[255 - gf_log[a]];
+}
+
+uint8_t gf_exp2(int e)
+{
+    init_tables();
+    return gf_exp[e % 255];
+}
+
+/*
+ * Split tables: c*x = lo[x & 0xf] ^ hi[x >> 4], so the product of 16 (or 32)
+ * bytes is two byte shuffles and an XOR.
+ */
+static
+void split_tables(uint8_t c, uint8_t tbl[32])
+{
+    for (int x = 0; x < 16; x++) {
+        tbl[x] = gf_mul(c, (uint8_t)x);
+        tbl[16 + x] = gf_mul(c, (uint8_t)(x << 4));
+    }
+}
+
+static inline __attribute__((always_inline))
+void mul_tail(uint8_t *dst, const uint8_t *src, size_t i, size_t nbytes, const uint8_t tbl[32], int accumulate)
+{
+    for (; i < nbytes; i++) {
+        uint8_t p = tbl[src[i] & 0xf] ^ tbl[16 + (src[i] >> 4)];
+        dst[i] = accumulate? dst[i] ^ p : p;
+    }
+}
+
+static
+void gf_mul_region_scalar(uint8_t *dst, const uint8_t *src, size_t nbytes, const uint8_t tbl[32], int accumulate)
+{
+    uint8_t row[256];
+    for (int x = 0; x < 256; x++)
+        row[x] = tbl[x & 0xf] ^ tbl[16 + (x >> 4)];
+    if (accumulate)
+        for (size_t i = 0; i < nbytes; i++)
+            dst[i] ^= row[src[i]];
+    else
+        for (size_t i = 0; i < nbytes; i++)
+            dst[i] = row[src[i]];
+}
+
+__attribute__((target("ssse3")))
+static
+void gf_mul_region_ssse3(uint8_t *dst, const uint8_t *src, size_t nbytes, const uint8_t tbl[32], int accumulate)
+{
+    const __m128i lo = _mm_loadu_si128((const __m128i *)tbl);
+    const __m128i hi = _mm_loadu_si128((const __m128i *)(tbl + 16));
+    const __m128i mask = _mm_set1_epi8(0x0f);
+    size_t i = 0;
+    for (; i + 16 <= nbytes; i += 16) {
+        __m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i l = _mm_and_si128(s, mask);
+        __m128i h = _mm_and_si128(_mm_srli_epi64(s, 4), mask);
+        __m128i p = _mm_xor_si128(_mm_shuffle_epi8(lo, l), _mm_shuffle_epi8(hi, h));
+        if (accumulate)
+            p = _mm_xor_si128(p, _mm_loadu_si128((const __m128i *)(dst + i)));
+        _mm_storeu_si128((__m128i *)(dst + i), p);
+    }
+    mul_tail(dst, src, i, nbytes, tbl, accumulate);
+}
+
+__attribute__((target("avx2")))
+static
+void gf_mul_region_avx2(uint8_t *dst, const uint8_t *src, size_t nbytes, const uint8_t tbl[32], int accumulate)
+{
+    const __m256i lo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)tbl));
+    const __m256i hi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)(tbl + 16)));
+    const __m256i mask = _mm256_set1_epi8(0x0f);
+    size_t i = 0;
+    for (; i + 32 <= nbytes; i += 32) {
+        __m256i s = _mm256_loadu_si256((const __m256i *)(src + i));
+        __m256i l = _mm256_and_si256(s, mask);
+        __m256i h = _mm256_and_si256(_mm256_srli_epi64(s, 4), mask);
+        __m256i p = _mm256_xor_si256(_mm256_shuffle_epi8(lo, l), _mm256_shuffle_epi8(hi, h));
+        if (accumulate)
+            p = _mm256_xor_si256(p, _mm256_loadu_si256((const __m256i *)(dst + i)));
+        _mm256_storeu_si256((__m256i *)(dst + i), p);
+    }
+    mul_tail(dst, src, i, nbytes, tbl, accumulate);
+}
+
+typedef void (*GfFunc)(uint8_t *dst, const uint8_t *src, size_t nbytes, const uint8_t tbl[32], int accumulate);
+
+typedef struct {
+    const char *name;
+    int (*supported)(void);
+    GfFunc fn;
+} GfKernel;
+
+static int always_supported(void) { return 1; }
+static int ssse3_supported(void) { return __builtin_cpu_supports("ssse3"); }
+static int avx2_supported(void) { return __builtin_cpu_supports("avx2"); }
+
+/* Ordered from slowest to fastest */
+static const GfKernel kernels[] = {
+    { "scalar", always_supported, gf_mul_region_scalar },
+    { "ssse3", ssse3_supported, gf_mul_region_ssse3 },
+    { "avx2", avx2_supported, gf_mul_region_avx2 },
+};
+#define NKERNELS ((int)(sizeof(kernels)/sizeof(kernels[0])))
+
+static const GfKernel *selected = NULL;
+
+static
+const GfKernel *select_kernel(void)
+{
+    if (selected == NULL) {
+        __builtin_cpu_init();
+        const GfKernel *best = &kernels[0];
+        for (int i = 1; i < NKERNELS; i++)
+            if (kernels[i].supported())
+                best = &kernels[i];
+        selected = best;
+    }
+    return selected;
+}
+
+static
+void run_kernel(const GfKernel *k, uint8_t *dst, const uint8_t *src, size_t nbytes, uint8_t c, int accumulate)
+{
+    if (c == 0) {
+        if (!accumulate)
+            memset(dst, 0, nbytes);
+        return;
+    }
+    uint8_t tbl[32];
+    split_tables(c, tbl);
+    k->fn(dst, src, nbytes, tbl, accumulate);
+}
+
+void gf_mul_region(uint8_t *dst, const uint8_t *src, size_t nbytes, uint8_t c, int accumulate)
+{
+    run_kernel(select_kernel(), dst, src, nbytes, c, accumulate);
+}
+
+const char *gf_selected_kernel(void)
+{
+    return select_kernel()->name;
+}
+
+int gf_kernel_count(void)
+{
+    return NKERNELS;
+}
+
+const char *gf_kernel_name(int kernel)
+{
+    return kernels[kernel].name;
+}
+
+int gf_kernel_supported(int kernel)
+{
+    __builtin_cpu_init();
+    return kernels[kernel].supported();
+}
+
+void gf_mul_region_with(int kernel, uint8_t *dst, const uint8_t *src, size_t nbytes, uint8_t c, int accumulate)
+{
+    run_kernel(&kernels[kernel], dst, src, nbytes, c, accumulate);
+}
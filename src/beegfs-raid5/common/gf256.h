@@ -0,0 +1,31 @@
+#ifndef __gf256__
+#define __gf256__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Arithmetic in GF(2^8) with the RAID-6 polynomial x^8+x^4+x^3+x^2+1 and
+ * generator g = 2. The Q parity of a file is the sum of g^st * D_st over the
+ * chunks D_st, where st is the storage target holding the chunk.
+ */
+
+uint8_t gf_mul(uint8_t a, uint8_t b);
+uint8_t gf_inv(uint8_t a);
+/* g^e */
+uint8_t gf_exp2(int e);
+
+/* dst = c*src, or dst ^= c*src when accumulate is non-zero. The fastest
+ * kernel supported by the CPU is selected on first use. */
+void gf_mul_region(uint8_t *dst, const uint8_t *src, size_t nbytes, uint8_t c, int accumulate);
+
+/* Name of the kernel gf_mul_region uses on this machine. */
+const char *gf_selected_kernel(void);
+
+/* Direct access to every kernel, for benchmarking and verification. */
+int gf_kernel_count(void);
+const char *gf_kernel_name(int kernel);
+int gf_kernel_supported(int kernel);
+void gf_mul_region_with(int kernel, uint8_t *dst, const uint8_t *src, size_t nbytes, uint8_t c, int accumulate);
+
+#endif
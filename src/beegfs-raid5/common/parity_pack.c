@@ -0,0 +1,321 @@
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "common.h"
+#include "dir_cache.h"
+#include "parity_pack.h"
+
+/* A new segment is started once the current one has grown past this */
+#ifndef PACK_SEGMENT_SIZE
+#define PACK_SEGMENT_SIZE (256*1024*1024)
+#endif
+
+/* A segment is compacted once this fraction of it is dead */
+#ifndef PACK_COMPACT_RATIO
+#define PACK_COMPACT_RATIO 0.5
+#endif
+
+#define PACK_MAGIC UINT32_C(0x6b706270) /* "pbpk" */
+#define PACK_MAX_IOV 8
+#define PACK_MAX_PATH 256
+
+/* A segment is a sequence of entries: a PackEntry, the path and the block */
+typedef struct {
+    uint32_t magic;
+    uint32_t keylen;
+    uint64_t length;
+} PackEntry;
+
+/* A meta entry in the DB named "pack<path>", so the key is "~pack<path>" */
+typedef struct {
+    uint64_t offset;    /* <- Of the PackEntry */
+    uint64_t length;    /* <- Of the block */
+    uint32_t segment;
+    uint32_t keylen;
+} PackRef;
+
+/* A meta entry named "pack-segment/<segment>", the key starts with "~" too */
+typedef struct {
+    uint64_t bytes;
+    uint64_t dead;
+} SegmentStats;
+
+enum { STATS_UNLOADED, STATS_DIRTY, STATS_REMOVED };
+
+static char pack_dir[PACK_MAX_PATH];
+static int pack_fd = -1;
+static uint32_t pack_segment;
+static uint64_t pack_size;
+static SegmentStats *stats;
+static uint8_t *stats_state;
+static size_t nstats;
+
+static
+uint64_t entry_size(uint64_t keylen, uint64_t length)
+{
+    return sizeof(PackEntry) + keylen + length;
+}
+
+static
+void segment_path(char *dst, size_t len, const char *dir, uint32_t segment)
+{
+    snprintf(dst, len, "%s/%08u", dir, segment);
+}
+
+static
+void ref_name(char *dst, size_t len, const char *path)
+{
+    snprintf(dst, len, "pack%s", path);
+}
+
+static
+void stats_name(char *dst, size_t len, uint32_t segment)
+{
+    snprintf(dst, len, "pack-segment/%u", segment);
+}
+
+static
+void use_dir(const char *dir)
+{
+    if (strcmp(pack_dir, dir) == 0)
+        return;
+    if (pack_fd >= 0)
+        close(pack_fd);
+    pack_fd = -1;
+    strncpy(pack_dir, dir, sizeof(pack_dir) - 1);
+}
+
+static
+SegmentStats *segment_stats(const PersistentDB *pdb, uint32_t segment)
+{
+    if (segment >= nstats) {
+        size_t n = MAX(segment + 1, nstats*2);
+        stats = realloc(stats, n*sizeof(SegmentStats));
+        stats_state = realloc(stats_state, n);
+        memset(stats_state + nstats, STATS_UNLOADED, n - nstats);
+        nstats = n;
+    }
+    if (stats_state[segment] == STATS_UNLOADED) {
+        char name[64];
+        stats_name(name, sizeof(name), segment);
+        if (!pdb_get_meta(pdb, name, &stats[segment], sizeof(SegmentStats)))
+            memset(&stats[segment], 0, sizeof(SegmentStats));
+    }
+    /* Every segment looked at is saved by pack_compact */
+    stats_state[segment] = STATS_DIRTY;
+    return &stats[segment];
+}
+
+static
+int open_segment(PersistentDB *pdb)
+{
+    /* Compaction may have moved blocks here from a segment it removes */
+    if (pack_fd >= 0) {
+        fdatasync(pack_fd);
+        close(pack_fd);
+    }
+    mkdir(pack_dir, S_IRWXU);
+    uint32_t segment = 0;
+    pdb_get_meta(pdb, "pack-next-segment", &segment, sizeof(segment));
+    char tmp[PACK_MAX_PATH + 16];
+    for (;; segment++) {
+        segment_path(tmp, sizeof(tmp), pack_dir, segment);
+        pack_fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+        if (pack_fd >= 0 || errno != EEXIST)
+            break;
+    }
+    if (pack_fd < 0) {
+        printf("could not create parity pack '%s': '%s'\n", tmp, strerror(errno));
+        return -1;
+    }
+    pack_segment = segment;
+    pack_size = 0;
+    segment += 1;
+    pdb_set_meta(pdb, "pack-next-segment", &segment, sizeof(segment));
+    memset(segment_stats(pdb, pack_segment), 0, sizeof(SegmentStats));
+    return 0;
+}
+
+int pack_append(
+        PersistentDB *pdb,
+        const char *dir,
+        const char *path,
+        const struct iovec *iov,
+        int iovcnt)
+{
+    assert(iovcnt <= PACK_MAX_IOV);
+    use_dir(dir);
+    size_t keylen = strlen(path);
+    if (keylen >= PACK_MAX_PATH)
+        return -1;
+    if (pack_fd < 0 || pack_size >= PACK_SEGMENT_SIZE)
+        if (open_segment(pdb) < 0)
+            return -1;
+
+    PackRef ref = { pack_size, 0, pack_segment, keylen };
+    for (int i = 0; i < iovcnt; i++)
+        ref.length += iov[i].iov_len;
+    PackEntry entry = { PACK_MAGIC, keylen, ref.length };
+    struct iovec all[2 + PACK_MAX_IOV] = {
+        { &entry, sizeof(entry) },
+        { (void *)path, keylen },
+    };
+    memcpy(all + 2, iov, iovcnt*sizeof(struct iovec));
+    const uint64_t size = entry_size(keylen, ref.length);
+    if (pwritev(pack_fd, all, 2 + iovcnt, pack_size) != (ssize_t)size)
+        return -1;
+    pack_size += size;
+    segment_stats(pdb, pack_segment)->bytes += size;
+
+    char name[PACK_MAX_PATH + 8];
+    ref_name(name, sizeof(name), path);
+    PackRef old;
+    int had_block = pdb_get_meta(pdb, name, &old, sizeof(old));
+    if (had_block)
+        segment_stats(pdb, old.segment)->dead += entry_size(old.keylen, old.length);
+    pdb_set_meta(pdb, name, &ref, sizeof(ref));
+    return !had_block;
+}
+
+int pack_open(
+        const PersistentDB *pdb,
+        const char *dir,
+        const char *path,
+        uint64_t *offset,
+        uint64_t *length)
+{
+    char name[PACK_MAX_PATH + 16];
+    PackRef ref;
+    ref_name(name, sizeof(name), path);
+    if (!pdb_get_meta(pdb, name, &ref, sizeof(ref)))
+        return -1;
+    segment_path(name, sizeof(name), dir, ref.segment);
+    int fd = dir_cache_open(name, O_RDONLY, 0);
+    if (fd < 0)
+        return -1;
+
+    /* The mapping may be stale, or the DB may have come from another target */
+    PackEntry entry;
+    char key[PACK_MAX_PATH];
+    size_t keylen = strlen(path);
+    if (ref.keylen != keylen || keylen >= PACK_MAX_PATH
+            || pread(fd, &entry, sizeof(entry), ref.offset) != sizeof(entry)
+            || entry.magic != PACK_MAGIC
+            || entry.keylen != keylen
+            || entry.length != ref.length
+            || pread(fd, key, keylen, ref.offset + sizeof(entry)) != (ssize_t)keylen
+            || memcmp(key, path, keylen) != 0) {
+        close(fd);
+        return -1;
+    }
+    *offset = ref.offset + sizeof(entry) + keylen;
+    *length = ref.length;
+    return fd;
+}
+
+void pack_forget(PersistentDB *pdb, const char *dir, const char *path)
+{
+    use_dir(dir);
+    char name[PACK_MAX_PATH + 8];
+    PackRef ref;
+    ref_name(name, sizeof(name), path);
+    if (!pdb_get_meta(pdb, name, &ref, sizeof(ref)))
+        return;
+    segment_stats(pdb, ref.segment)->dead += entry_size(ref.keylen, ref.length);
+    pdb_del_meta(pdb, name);
+}
+
+/* Appends the live entries of a segment to the current one and removes it */
+static
+void compact_segment(PersistentDB *pdb, uint32_t segment)
+{
+    char tmp[PACK_MAX_PATH + 16];
+    segment_path(tmp, sizeof(tmp), pack_dir, segment);
+    int fd = open(tmp, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        if (errno == ENOENT)
+            stats_state[segment] = STATS_REMOVED;
+        if (fd >= 0)
+            close(fd);
+        return;
+    }
+
+    uint8_t *buf = NULL;
+    size_t buf_size = 0;
+    uint64_t offset = 0;
+    int failed = 0;
+    while (!failed && offset < (uint64_t)st.st_size) {
+        PackEntry entry;
+        if (pread(fd, &entry, sizeof(entry), offset) != sizeof(entry)
+                || entry.magic != PACK_MAGIC
+                || entry.keylen >= PACK_MAX_PATH) {
+            failed = 1;
+            break;
+        }
+        const uint64_t size = entry_size(entry.keylen, entry.length);
+        if (buf_size < size) {
+            buf_size = MAX(size, buf_size*2);
+            buf = realloc(buf, buf_size);
+        }
+        if (pread(fd, buf, size, offset) != (ssize_t)size) {
+            failed = 1;
+            break;
+        }
+        char path[PACK_MAX_PATH];
+        memcpy(path, buf + sizeof(entry), entry.keylen);
+        path[entry.keylen] = '\0';
+        char name[PACK_MAX_PATH + 8];
+        PackRef ref;
+        ref_name(name, sizeof(name), path);
+        if (pdb_get_meta(pdb, name, &ref, sizeof(ref))
+                && ref.segment == segment && ref.offset == offset) {
+            struct iovec iov = { buf + sizeof(entry) + entry.keylen, entry.length };
+            failed = (pack_append(pdb, pack_dir, path, &iov, 1) < 0);
+        }
+        offset += size;
+    }
+    free(buf);
+    close(fd);
+    /* A segment that can't be read to the end is kept, it may still hold
+     * live blocks */
+    if (failed)
+        return;
+    /* The moved blocks and their new refs must be on disk before the only
+     * other copy is gone */
+    if (pack_fd >= 0)
+        fdatasync(pack_fd);
+    pdb_sync(pdb);
+    unlink(tmp);
+    stats_state[segment] = STATS_REMOVED;
+}
+
+void pack_compact(PersistentDB *pdb)
+{
+    for (size_t s = 0; s < nstats; s++) {
+        if (stats_state[s] == STATS_UNLOADED || stats_state[s] == STATS_REMOVED)
+            continue;
+        if (pack_fd >= 0 && s == pack_segment)
+            continue;
+        if (stats[s].dead > 0 && stats[s].dead >= stats[s].bytes*PACK_COMPACT_RATIO)
+            compact_segment(pdb, s);
+    }
+    for (size_t s = 0; s < nstats; s++) {
+        char name[64];
+        stats_name(name, sizeof(name), s);
+        if (stats_state[s] == STATS_DIRTY)
+            pdb_set_meta(pdb, name, &stats[s], sizeof(SegmentStats));
+        else if (stats_state[s] == STATS_REMOVED)
+            pdb_del_meta(pdb, name);
+        stats_state[s] = STATS_UNLOADED;
+    }
+}
@@ -0,0 +1,48 @@
+#ifndef __parity_pack__
+#define __parity_pack__
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <sys/uio.h>
+
+#include "persistent_db.h"
+
+/*
+ * Parity packs. The parity blocks of small files are appended to large
+ * segment files in the pack directory of a target, in stead of each getting a
+ * parity file (and a mkdir, a creat and an inode) of its own. The persistent
+ * DB maps the path of a file to the segment, offset and length of its block.
+ * Every entry in a segment repeats the path, so a stale mapping is noticed.
+ *
+ * Blocks that are superseded or forgotten are counted as dead bytes of their
+ * segment, and pack_compact() moves the live blocks out of segments that are
+ * mostly dead.
+ */
+
+/* Appends the block made up of iov to the pack and maps path to it. Returns
+ * -1 on error, 0 if it replaces a block in the pack, and 1 if path had no
+ * block in the pack (so a parity file may exist for it). */
+int pack_append(
+        PersistentDB *pdb,
+        const char *dir,
+        const char *path,
+        const struct iovec *iov,
+        int iovcnt);
+
+/* Opens the segment that holds the block of path, or returns -1. */
+int pack_open(
+        const PersistentDB *pdb,
+        const char *dir,
+        const char *path,
+        uint64_t *offset,
+        uint64_t *length);
+
+/* Drops the block of path from the pack, if it has one. */
+void pack_forget(PersistentDB *pdb, const char *dir, const char *path);
+
+/* Compacts the segments written to or forgotten from in this process, and
+ * saves their statistics. */
+void pack_compact(PersistentDB *pdb);
+
+#endif
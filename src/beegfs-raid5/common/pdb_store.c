@@ -0,0 +1,791 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "common.h"
+#include "pdb_store.h"
+
+/* Every this many keys one is stored whole and indexed */
+#ifndef STORE_RESTART_INTERVAL
+#define STORE_RESTART_INTERVAL 16
+#endif
+
+/* store_cursor_get steps this far forward before it seeks instead */
+#ifndef STORE_CURSOR_STEPS
+#define STORE_CURSOR_STEPS 64
+#endif
+
+#define STORE_MAX_KEY UINT16_MAX
+#define STORE_MAX_PATH 512
+#define STORE_ARENA_BLOCK (1024*1024)
+
+/*
+ * The files of generation g in the directory, next to CURRENT, which holds g:
+ *  <g>.keys  - A KeyHeader and the rest of the key, for every key
+ *  <g>.index - The offset in .keys of every STORE_RESTART_INTERVAL'th key,
+ *              which is stored whole
+ *  <g>.vals  - STORE_VALUE_SIZE bytes for every key
+ *  <g>.lens  - The length of every value, one byte each
+ *  <g>.delta - DeltaRecords, the updates made to the base since. A group of
+ *              them is logged after a DeltaRecord with len DELTA_GROUP and
+ *              keylen the size of the group.
+ */
+typedef struct {
+    uint16_t shared;    /* <- Bytes in common with the previous key */
+    uint16_t unshared;
+} KeyHeader;
+
+typedef struct {
+    uint32_t keylen;
+    int32_t len;        /* <- Of the value that follows the key, -1 for a delete */
+} DeltaRecord;
+#define DELTA_GROUP (-2)
+
+struct StoreGroup {
+    uint8_t *records;   /* <- DeltaRecords as they are logged */
+    size_t bytes;
+    size_t alloc;
+};
+
+typedef struct {
+    const uint8_t *keys;
+    const uint64_t *index;
+    const uint8_t *vals;
+    const uint8_t *lens;
+    size_t sizes[4];    /* <- Of the mappings above */
+    size_t nrestarts;
+    size_t n;
+} Base;
+
+/* Walks the keys of the base in order */
+typedef struct {
+    const Base *base;
+    size_t entry;       /* <- Of the key in `key`, n past the end */
+    size_t next_off;    /* <- Of the entry after it in .keys */
+    size_t keylen;
+    char key[STORE_MAX_KEY + 1];
+} Reader;
+
+typedef struct {
+    const char *key;    /* <- Terminated, in the arena */
+    uint32_t keylen;
+    uint32_t hash;
+    int len;            /* <- -1 for a deleted key */
+    uint8_t val[STORE_VALUE_SIZE];
+} DeltaEntry;
+
+typedef struct ArenaBlock ArenaBlock;
+struct ArenaBlock {
+    ArenaBlock *prev;
+    size_t used;
+    size_t size;
+    char data[];
+};
+
+struct PdbStore {
+    char dir[STORE_MAX_PATH/2];
+    unsigned generation;
+    Base base;
+    /* The delta, an open addressing table of indices + 1 in to entries */
+    uint32_t *slots;
+    size_t nslots;
+    DeltaEntry *entries;
+    size_t nentries;
+    size_t entries_alloc;
+    ArenaBlock *arena;
+    int log_fd;
+    /* The base is never written to, the delta is */
+    pthread_mutex_t lock;
+    Reader get_reader;
+};
+
+struct StoreCursor {
+    PdbStore *s;
+    int positioned;
+    Reader r;
+};
+
+static
+void file_path(char *dst, const PdbStore *s, unsigned generation, const char *ext)
+{
+    snprintf(dst, STORE_MAX_PATH, "%s/%06u.%s", s->dir, generation, ext);
+}
+
+static
+int compare_key(const char *a, size_t alen, const char *b, size_t blen)
+{
+    int c = memcmp(a, b, MIN(alen, blen));
+    if (c != 0)
+        return c;
+    return (alen > blen) - (alen < blen);
+}
+
+static
+const void *map_file(const char *path, size_t *size)
+{
+    *size = 0;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    struct stat st;
+    void *res = NULL;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        res = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (res == MAP_FAILED)
+            res = NULL;
+        else
+            *size = st.st_size;
+    }
+    close(fd);
+    return res;
+}
+
+static
+void map_base(PdbStore *s)
+{
+    char path[STORE_MAX_PATH];
+    Base *b = &s->base;
+    file_path(path, s, s->generation, "keys");
+    b->keys = map_file(path, &b->sizes[0]);
+    file_path(path, s, s->generation, "index");
+    b->index = map_file(path, &b->sizes[1]);
+    file_path(path, s, s->generation, "vals");
+    b->vals = map_file(path, &b->sizes[2]);
+    file_path(path, s, s->generation, "lens");
+    b->lens = map_file(path, &b->sizes[3]);
+    b->n = b->sizes[3];
+    b->nrestarts = b->sizes[1]/sizeof(uint64_t);
+    if (b->keys == NULL || b->sizes[2] != b->n*STORE_VALUE_SIZE
+            || b->nrestarts != (b->n + STORE_RESTART_INTERVAL - 1)/STORE_RESTART_INTERVAL) {
+        if (b->n > 0)
+            printf("the store in '%s' is damaged, it is read as empty\n", s->dir);
+        b->n = 0;
+    }
+}
+
+static
+void unmap_base(PdbStore *s)
+{
+    Base *b = &s->base;
+    const void *maps[4] = { b->keys, b->index, b->vals, b->lens };
+    for (int i = 0; i < 4; i++)
+        if (maps[i] != NULL)
+            munmap((void *)maps[i], b->sizes[i]);
+    memset(b, 0, sizeof(Base));
+}
+
+/* Reads the entry at off, whose key shares a prefix with the one in r */
+static
+int reader_load(Reader *r, size_t entry, size_t off)
+{
+    const Base *b = r->base;
+    if (entry >= b->n) {
+        r->entry = b->n;
+        return 0;
+    }
+    KeyHeader h;
+    memcpy(&h, b->keys + off, sizeof(h));
+    memcpy(r->key + h.shared, b->keys + off + sizeof(h), h.unshared);
+    r->keylen = h.shared + h.unshared;
+    r->key[r->keylen] = '\0';
+    r->entry = entry;
+    r->next_off = off + sizeof(h) + h.unshared;
+    return 1;
+}
+
+static
+int reader_next(Reader *r)
+{
+    return reader_load(r, r->entry + 1, r->next_off);
+}
+
+/* Moves to the first key that doesn't come before key */
+static
+void reader_seek(Reader *r, const char *key, size_t keylen)
+{
+    const Base *b = r->base;
+    if (b->n == 0) {
+        r->entry = 0;
+        return;
+    }
+    /* The last indexed key that doesn't come after key, or the first one */
+    size_t lo = 0, hi = b->nrestarts;
+    while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo)/2;
+        KeyHeader h;
+        memcpy(&h, b->keys + b->index[mid], sizeof(h));
+        const char *k = (const char *)b->keys + b->index[mid] + sizeof(h);
+        if (compare_key(k, h.unshared, key, keylen) <= 0)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    reader_load(r, lo*STORE_RESTART_INTERVAL, b->index[lo]);
+    while (r->entry < b->n && compare_key(r->key, r->keylen, key, keylen) < 0)
+        reader_next(r);
+}
+
+static
+int reader_value(const Reader *r, void *val)
+{
+    const Base *b = r->base;
+    int len = b->lens[r->entry];
+    memcpy(val, b->vals + r->entry*STORE_VALUE_SIZE, len);
+    return len;
+}
+
+/* The keys a target coordinates all have the same simple_hash modulo the
+ * number of targets, so the bits are mixed before they pick a slot */
+static
+size_t home_slot(const PdbStore *s, uint32_t hash)
+{
+    return ((hash * UINT64_C(0x9e3779b97f4a7c15)) >> 32) & (s->nslots - 1);
+}
+
+/* The slot of the key, or the empty slot where it would go */
+static
+size_t find_slot(const PdbStore *s, const char *key, size_t keylen, uint32_t hash)
+{
+    size_t i = home_slot(s, hash);
+    for (;; i = (i + 1) & (s->nslots - 1)) {
+        if (s->slots[i] == 0)
+            return i;
+        const DeltaEntry *e = &s->entries[s->slots[i] - 1];
+        if (e->hash == hash && e->keylen == keylen && memcmp(e->key, key, keylen) == 0)
+            return i;
+    }
+}
+
+static
+void grow_slots(PdbStore *s)
+{
+    free(s->slots);
+    s->nslots *= 2;
+    s->slots = calloc(s->nslots, sizeof(uint32_t));
+    for (size_t e = 0; e < s->nentries; e++) {
+        size_t i = home_slot(s, s->entries[e].hash);
+        while (s->slots[i] != 0)
+            i = (i + 1) & (s->nslots - 1);
+        s->slots[i] = e + 1;
+    }
+}
+
+static
+const char *intern(PdbStore *s, const char *key, size_t keylen)
+{
+    ArenaBlock *b = s->arena;
+    if (b == NULL || b->used + keylen + 1 > b->size) {
+        size_t size = MAX((size_t)STORE_ARENA_BLOCK, keylen + 1);
+        b = malloc(sizeof(ArenaBlock) + size);
+        b->prev = s->arena;
+        b->used = 0;
+        b->size = size;
+        s->arena = b;
+    }
+    char *res = b->data + b->used;
+    memcpy(res, key, keylen);
+    res[keylen] = '\0';
+    b->used += keylen + 1;
+    return res;
+}
+
+static
+const DeltaEntry *delta_get(const PdbStore *s, const char *key, size_t keylen)
+{
+    size_t i = find_slot(s, key, keylen, simple_hash(key, keylen));
+    return (s->slots[i] == 0)? NULL : &s->entries[s->slots[i] - 1];
+}
+
+static
+void delta_set(PdbStore *s, const char *key, size_t keylen, const void *val, int len)
+{
+    const uint32_t hash = simple_hash(key, keylen);
+    size_t i = find_slot(s, key, keylen, hash);
+    if (s->slots[i] == 0) {
+        /* Keep the load below 0.7 */
+        if (10*(s->nentries + 1) > 7*s->nslots) {
+            grow_slots(s);
+            i = find_slot(s, key, keylen, hash);
+        }
+        if (s->nentries == s->entries_alloc) {
+            s->entries_alloc = MAX(1024, 2*s->entries_alloc);
+            s->entries = realloc(s->entries, s->entries_alloc*sizeof(DeltaEntry));
+        }
+        DeltaEntry *e = &s->entries[s->nentries++];
+        e->key = intern(s, key, keylen);
+        e->keylen = keylen;
+        e->hash = hash;
+        s->slots[i] = s->nentries;
+    }
+    DeltaEntry *e = &s->entries[s->slots[i] - 1];
+    e->len = len;
+    memset(e->val, 0, sizeof(e->val));
+    if (len > 0)
+        memcpy(e->val, val, len);
+}
+
+static
+void free_delta(PdbStore *s)
+{
+    while (s->arena != NULL) {
+        ArenaBlock *prev = s->arena->prev;
+        free(s->arena);
+        s->arena = prev;
+    }
+    free(s->slots);
+    free(s->entries);
+    s->slots = NULL;
+    s->entries = NULL;
+    s->nslots = s->nentries = s->entries_alloc = 0;
+}
+
+/* Applies the records of a group, which have been checked */
+static
+void apply_group(PdbStore *s, const uint8_t *records, size_t bytes)
+{
+    for (size_t offset = 0; offset < bytes;) {
+        DeltaRecord r;
+        memcpy(&r, records + offset, sizeof(r));
+        const char *key = (const char *)records + offset + sizeof(r);
+        delta_set(s, key, r.keylen, key + r.keylen, r.len);
+        offset += sizeof(r) + r.keylen + MAX(r.len, 0);
+    }
+}
+
+/* Returns non-zero if the records fill exactly `bytes` */
+static
+int group_is_whole(const uint8_t *records, size_t bytes)
+{
+    size_t offset = 0;
+    while (offset + sizeof(DeltaRecord) <= bytes) {
+        DeltaRecord r;
+        memcpy(&r, records + offset, sizeof(r));
+        if (r.keylen > STORE_MAX_KEY || r.len > STORE_VALUE_SIZE || r.len < -1)
+            return 0;
+        offset += sizeof(r) + r.keylen + MAX(r.len, 0);
+    }
+    return offset == bytes;
+}
+
+/* Reads back the updates of a run that didn't get to store_close, and
+ * returns the length of the log up to the end of the last whole record.
+ * A group that isn't whole is left out entirely. */
+static
+long replay_log(PdbStore *s, FILE *f)
+{
+    DeltaRecord r;
+    char key[STORE_MAX_KEY];
+    uint8_t val[STORE_VALUE_SIZE];
+    uint8_t *group = NULL;
+    long good = 0;
+    while (fread(&r, sizeof(r), 1, f) == 1) {
+        if (r.len == DELTA_GROUP) {
+            group = realloc(group, MAX(r.keylen, 1));
+            if (fread(group, 1, r.keylen, f) != r.keylen || !group_is_whole(group, r.keylen))
+                break;
+            apply_group(s, group, r.keylen);
+        }
+        else if (r.keylen > STORE_MAX_KEY || r.len > STORE_VALUE_SIZE || r.len < -1
+                || fread(key, 1, r.keylen, f) != r.keylen
+                || (r.len > 0 && fread(val, 1, r.len, f) != (size_t)r.len))
+            break;
+        else
+            delta_set(s, key, r.keylen, val, r.len);
+        good = ftell(f);
+    }
+    free(group);
+    return good;
+}
+
+/* A record goes out in one write, so the log is whole if the process dies
+ * and only the tail can be torn if the machine does */
+static
+void log_update(PdbStore *s, const char *key, size_t keylen, const void *val, int len)
+{
+    DeltaRecord r = { keylen, len };
+    struct iovec iov[3] = {
+        { &r, sizeof(r) },
+        { (void *)key, keylen },
+        { (void *)val, (len > 0)? len : 0 },
+    };
+    const ssize_t want = sizeof(r) + keylen + iov[2].iov_len;
+    if (writev(s->log_fd, iov, 3) != want)
+        fprintf(stderr, "could not log to the store in '%s': '%s'\n", s->dir, strerror(errno));
+}
+
+PdbStore *store_open(const char *dir)
+{
+    if (strlen(dir) >= STORE_MAX_PATH/2)
+        return NULL;
+    mkdir(dir, S_IRWXU);
+    PdbStore *s = calloc(1, sizeof(PdbStore));
+    strcpy(s->dir, dir);
+    char path[STORE_MAX_PATH];
+    snprintf(path, sizeof(path), "%s/CURRENT", dir);
+    FILE *f = fopen(path, "r");
+    if (f != NULL) {
+        if (fscanf(f, "%u", &s->generation) != 1)
+            s->generation = 0;
+        fclose(f);
+    }
+    map_base(s);
+    s->get_reader.base = &s->base;
+    s->nslots = 1024;
+    s->slots = calloc(s->nslots, sizeof(uint32_t));
+
+    file_path(path, s, s->generation, "delta");
+    f = fopen(path, "r");
+    if (f != NULL) {
+        /* Records added after a torn one could never be read back */
+        long good = replay_log(s, f);
+        fclose(f);
+        if (truncate(path, good) != 0)
+            printf("could not truncate '%s': '%s'\n", path, strerror(errno));
+    }
+    s->log_fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0666);
+    if (s->log_fd < 0) {
+        printf("could not open '%s': '%s'\n", path, strerror(errno));
+        unmap_base(s);
+        free_delta(s);
+        free(s);
+        return NULL;
+    }
+    pthread_mutex_init(&s->lock, NULL);
+    return s;
+}
+
+int store_put(PdbStore *s, const char *key, size_t keylen, const void *val, size_t len)
+{
+    if (keylen > STORE_MAX_KEY || len > STORE_VALUE_SIZE)
+        return -1;
+    pthread_mutex_lock(&s->lock);
+    delta_set(s, key, keylen, val, len);
+    log_update(s, key, keylen, val, len);
+    pthread_mutex_unlock(&s->lock);
+    return 0;
+}
+
+void store_del(PdbStore *s, const char *key, size_t keylen)
+{
+    if (keylen > STORE_MAX_KEY)
+        return;
+    pthread_mutex_lock(&s->lock);
+    delta_set(s, key, keylen, NULL, -1);
+    log_update(s, key, keylen, NULL, -1);
+    pthread_mutex_unlock(&s->lock);
+}
+
+StoreGroup *store_group_new(void)
+{
+    return calloc(1, sizeof(StoreGroup));
+}
+
+void store_group_free(StoreGroup *g)
+{
+    free(g->records);
+    free(g);
+}
+
+/* A negative len is a delete */
+static
+int group_add(StoreGroup *g, const char *key, size_t keylen, const void *val, int len)
+{
+    if (keylen > STORE_MAX_KEY || len > STORE_VALUE_SIZE)
+        return -1;
+    const size_t size = sizeof(DeltaRecord) + keylen + MAX(len, 0);
+    if (g->bytes + size > g->alloc) {
+        g->alloc = MAX(g->bytes + size, 2*g->alloc);
+        g->records = realloc(g->records, g->alloc);
+    }
+    DeltaRecord r = { keylen, len };
+    uint8_t *p = g->records + g->bytes;
+    memcpy(p, &r, sizeof(r));
+    memcpy(p + sizeof(r), key, keylen);
+    if (len > 0)
+        memcpy(p + sizeof(r) + keylen, val, len);
+    g->bytes += size;
+    return 0;
+}
+
+int store_group_put(StoreGroup *g, const char *key, size_t keylen, const void *val, size_t len)
+{
+    return group_add(g, key, keylen, val, len);
+}
+
+void store_group_del(StoreGroup *g, const char *key, size_t keylen)
+{
+    group_add(g, key, keylen, NULL, -1);
+}
+
+void store_group_apply(PdbStore *s, StoreGroup *g)
+{
+    if (g->bytes == 0)
+        return;
+    DeltaRecord r = { g->bytes, DELTA_GROUP };
+    struct iovec iov[2] = {
+        { &r, sizeof(r) },
+        { g->records, g->bytes },
+    };
+    pthread_mutex_lock(&s->lock);
+    apply_group(s, g->records, g->bytes);
+    if (writev(s->log_fd, iov, 2) != (ssize_t)(sizeof(r) + g->bytes))
+        fprintf(stderr, "could not log to the store in '%s': '%s'\n", s->dir, strerror(errno));
+    pthread_mutex_unlock(&s->lock);
+    g->bytes = 0;
+}
+
+int store_get(PdbStore *s, const char *key, size_t keylen, void *val)
+{
+    int len = -1;
+    pthread_mutex_lock(&s->lock);
+    const DeltaEntry *e = delta_get(s, key, keylen);
+    if (e != NULL) {
+        len = e->len;
+        if (len > 0)
+            memcpy(val, e->val, len);
+    }
+    else {
+        Reader *r = &s->get_reader;
+        reader_seek(r, key, keylen);
+        if (r->entry < s->base.n && compare_key(r->key, r->keylen, key, keylen) == 0)
+            len = reader_value(r, val);
+    }
+    pthread_mutex_unlock(&s->lock);
+    return len;
+}
+
+static
+int by_key(const void *a, const void *b)
+{
+    const DeltaEntry *x = a, *y = b;
+    return compare_key(x->key, x->keylen, y->key, y->keylen);
+}
+
+/* A sorted copy of the delta. The keys stay in the arena until store_close. */
+static
+DeltaEntry *sorted_delta(PdbStore *s, size_t *n)
+{
+    pthread_mutex_lock(&s->lock);
+    *n = s->nentries;
+    DeltaEntry *res = malloc(MAX(1, *n)*sizeof(DeltaEntry));
+    memcpy(res, s->entries, *n*sizeof(DeltaEntry));
+    pthread_mutex_unlock(&s->lock);
+    qsort(res, *n, sizeof(DeltaEntry), by_key);
+    return res;
+}
+
+/* Merges the base and the delta in key order, from the first key that
+ * doesn't come before `from`. Deleted keys are skipped. */
+static
+void merge(PdbStore *s, const char *from, size_t fromlen, StoreVisit f, void *arg)
+{
+    size_t ndelta;
+    DeltaEntry *delta = sorted_delta(s, &ndelta);
+    Reader *r = malloc(sizeof(Reader));
+    r->base = &s->base;
+    reader_seek(r, from, fromlen);
+    size_t d = 0, hi = ndelta;
+    while (d < hi) {
+        size_t mid = d + (hi - d)/2;
+        if (compare_key(delta[mid].key, delta[mid].keylen, from, fromlen) < 0)
+            d = mid + 1;
+        else
+            hi = mid;
+    }
+    uint8_t val[STORE_VALUE_SIZE];
+    for (;;) {
+        const int have_base = r->entry < s->base.n;
+        if (!have_base && d == ndelta)
+            break;
+        int c = 1;
+        if (have_base && d < ndelta)
+            c = compare_key(r->key, r->keylen, delta[d].key, delta[d].keylen);
+        else if (have_base)
+            c = -1;
+        int done = 0;
+        if (c < 0) {
+            int len = reader_value(r, val);
+            done = f(arg, r->key, r->keylen, val, len);
+            reader_next(r);
+        }
+        else {
+            if (delta[d].len >= 0)
+                done = f(arg, delta[d].key, delta[d].keylen, delta[d].val, delta[d].len);
+            if (c == 0)
+                reader_next(r);
+            d += 1;
+        }
+        if (done)
+            break;
+    }
+    free(r);
+    free(delta);
+}
+
+void store_iterate(PdbStore *s, const char *from, size_t fromlen, StoreVisit f, void *arg)
+{
+    merge(s, from, fromlen, f, arg);
+}
+
+/* Writes a new base, see the top of the file */
+typedef struct {
+    FILE *keys, *index, *vals, *lens;
+    uint64_t keys_off;
+    size_t n;
+    size_t prevlen;
+    char prev[STORE_MAX_KEY];
+} Writer;
+
+static
+int write_entry(void *arg, const char *key, size_t keylen, const void *val, size_t len)
+{
+    Writer *w = arg;
+    size_t shared = 0;
+    if (w->n % STORE_RESTART_INTERVAL == 0)
+        fwrite(&w->keys_off, sizeof(uint64_t), 1, w->index);
+    else
+        while (shared < MIN(w->prevlen, keylen) && w->prev[shared] == key[shared])
+            shared += 1;
+    KeyHeader h = { shared, keylen - shared };
+    fwrite(&h, sizeof(h), 1, w->keys);
+    fwrite(key + shared, 1, h.unshared, w->keys);
+    w->keys_off += sizeof(h) + h.unshared;
+    uint8_t slot[STORE_VALUE_SIZE] = {0};
+    memcpy(slot, val, len);
+    fwrite(slot, 1, sizeof(slot), w->vals);
+    uint8_t l = len;
+    fwrite(&l, 1, 1, w->lens);
+    memcpy(w->prev, key, keylen);
+    w->prevlen = keylen;
+    w->n += 1;
+    return 0;
+}
+
+static
+int close_file(FILE *f)
+{
+    if (f == NULL)
+        return -1;
+    int failed = (fflush(f) != 0 || ferror(f) || fsync(fileno(f)) != 0);
+    return (fclose(f) != 0 || failed)? -1 : 0;
+}
+
+/* Merges the delta in to generation + 1 and makes it current. If anything
+ * fails the old base and the delta log are kept. */
+static
+int write_generation(PdbStore *s)
+{
+    static const char *exts[] = { "keys", "index", "vals", "lens" };
+    const unsigned next = s->generation + 1;
+    char path[STORE_MAX_PATH];
+    Writer *w = calloc(1, sizeof(Writer));
+    FILE **files[] = { &w->keys, &w->index, &w->vals, &w->lens };
+    for (int i = 0; i < 4; i++) {
+        file_path(path, s, next, exts[i]);
+        *files[i] = fopen(path, "w");
+    }
+    int failed = 0;
+    if (w->keys != NULL && w->index != NULL && w->vals != NULL && w->lens != NULL)
+        merge(s, "", 0, write_entry, w);
+    for (int i = 0; i < 4; i++)
+        failed |= close_file(*files[i]);
+    free(w);
+
+    char tmp[STORE_MAX_PATH];
+    snprintf(tmp, sizeof(tmp), "%s/CURRENT.tmp", s->dir);
+    FILE *f = failed? NULL : fopen(tmp, "w");
+    if (f != NULL)
+        fprintf(f, "%u\n", next);
+    if (failed || close_file(f) != 0) {
+        printf("could not write the store in '%s'\n", s->dir);
+        for (int i = 0; i < 4; i++) {
+            file_path(path, s, next, exts[i]);
+            unlink(path);
+        }
+        return -1;
+    }
+    snprintf(path, sizeof(path), "%s/CURRENT", s->dir);
+    rename(tmp, path);
+    return 0;
+}
+
+void store_sync(PdbStore *s)
+{
+    if (fdatasync(s->log_fd) != 0)
+        fprintf(stderr, "could not sync the store in '%s': '%s'\n", s->dir, strerror(errno));
+}
+
+void store_close(PdbStore *s)
+{
+    close(s->log_fd);
+    if (s->nentries > 0 && write_generation(s) == 0) {
+        static const char *exts[] = { "keys", "index", "vals", "lens", "delta" };
+        char path[STORE_MAX_PATH];
+        for (int i = 0; i < 5; i++) {
+            file_path(path, s, s->generation, exts[i]);
+            unlink(path);
+        }
+    }
+    unmap_base(s);
+    free_delta(s);
+    pthread_mutex_destroy(&s->lock);
+    free(s);
+}
+
+StoreCursor *store_cursor_open(PdbStore *s)
+{
+    StoreCursor *c = malloc(sizeof(StoreCursor));
+    c->s = s;
+    c->positioned = 0;
+    c->r.base = &s->base;
+    return c;
+}
+
+void store_cursor_close(StoreCursor *c)
+{
+    free(c);
+}
+
+int store_cursor_get(StoreCursor *c, const char *key, size_t keylen, void *val)
+{
+    PdbStore *s = c->s;
+    pthread_mutex_lock(&s->lock);
+    const DeltaEntry *e = delta_get(s, key, keylen);
+    int len = -1;
+    if (e != NULL) {
+        len = e->len;
+        if (len > 0)
+            memcpy(val, e->val, len);
+    }
+    pthread_mutex_unlock(&s->lock);
+    if (e != NULL)
+        return len;
+
+    Reader *r = &c->r;
+    int cmp = -1;
+    if (c->positioned) {
+        /* The next key is usually close by, the values are read in order */
+        for (int i = 0; i < STORE_CURSOR_STEPS && r->entry < s->base.n; i++) {
+            cmp = compare_key(r->key, r->keylen, key, keylen);
+            if (cmp >= 0)
+                break;
+            reader_next(r);
+        }
+    }
+    if (!c->positioned || (cmp < 0 && r->entry < s->base.n)) {
+        reader_seek(r, key, keylen);
+        c->positioned = 1;
+    }
+    if (r->entry >= s->base.n || compare_key(r->key, r->keylen, key, keylen) != 0)
+        return -1;
+    return reader_value(r, val);
+}
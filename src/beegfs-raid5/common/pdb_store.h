@@ -0,0 +1,57 @@
+#ifndef __pdb_store__
+#define __pdb_store__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * A sorted store for values of at most STORE_VALUE_SIZE bytes, the size of a
+ * FileInfo. It is read much more than it is written, and mostly in key order.
+ *
+ * The base is written once, at the end of a run, and is mmap'd: the keys in
+ * order with the prefix they share with the previous key left out, a sparse
+ * index of every STORE_RESTART_INTERVAL'th key for binary search, and the
+ * values in fixed width columns. Updates go to a delta, a hash table that is
+ * also logged to disk, and are merged in to a new base by store_close.
+ */
+#define STORE_VALUE_SIZE 24
+
+typedef struct PdbStore PdbStore;
+typedef struct StoreCursor StoreCursor;
+typedef struct StoreGroup StoreGroup;
+/* Returns non-zero to stop */
+typedef int (*StoreVisit)(void *arg, const char *key, size_t keylen, const void *val, size_t len);
+
+/* NULL if the directory can't be used */
+PdbStore *store_open(const char *dir);
+void store_close(PdbStore *s);
+/* Returns -1 if the key or the value is too large */
+int store_put(PdbStore *s, const char *key, size_t keylen, const void *val, size_t len);
+void store_del(PdbStore *s, const char *key, size_t keylen);
+/*
+ * Updates that are applied and logged together, so that after a crash
+ * either all of them are there or none. store_group_apply empties the group
+ * for the next ones.
+ */
+StoreGroup *store_group_new(void);
+void store_group_free(StoreGroup *g);
+/* Returns -1 if the key or the value is too large */
+int store_group_put(StoreGroup *g, const char *key, size_t keylen, const void *val, size_t len);
+void store_group_del(StoreGroup *g, const char *key, size_t keylen);
+void store_group_apply(PdbStore *s, StoreGroup *g);
+
+/* Returns once the updates so far are on disk */
+void store_sync(PdbStore *s);
+/* Copies the value to val and returns its length, -1 if there is none */
+int store_get(PdbStore *s, const char *key, size_t keylen, void *val);
+/* Visits the keys in order from the first one that doesn't come before
+ * `from`, with the delta as it was when it was called. The keys passed to f
+ * are terminated. */
+void store_iterate(PdbStore *s, const char *from, size_t fromlen, StoreVisit f, void *arg);
+
+/* Like store_get, for keys given in increasing order */
+StoreCursor *store_cursor_open(PdbStore *s);
+void store_cursor_close(StoreCursor *c);
+int store_cursor_get(StoreCursor *c, const char *key, size_t keylen, void *val);
+
+#endif
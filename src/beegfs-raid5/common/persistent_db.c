@@ -3,10 +3,30 @@
 #include <stdio.h>
 #include <memory.h>
 #include <assert.h>
+#include <pthread.h>
 
 #include <leveldb/c.h>
 
 #include "persistent_db.h"
+#include "pdb_store.h"
+
+/* pdb_cursor_get steps this far forward before it seeks instead */
+#ifndef PDB_CURSOR_STEPS
+#define PDB_CURSOR_STEPS 16
+#endif
+
+/* A batch is handed to the commit thread once it holds this many updates or
+ * bytes */
+#ifndef PDB_BATCH_COUNT
+#define PDB_BATCH_COUNT 4096
+#endif
+#ifndef PDB_BATCH_BYTES
+#define PDB_BATCH_BYTES (4*1024*1024)
+#endif
+
+/* Where each kind of DB is kept */
+#define PDB_LEVELDB_DIR "/tmp/persistent-db"
+#define PDB_STORE_DIR "/tmp/persistent-db-store"
 
 struct PersistentDB {
     leveldb_options_t *options;
@@ -14,10 +34,24 @@ struct PersistentDB {
     leveldb_readoptions_t *ropts;
     leveldb_writeoptions_t *wopts;
     leveldb_t *db;
+    PdbStore *store;    /* <- Used in stead of LevelDB if not NULL */
 };
 
 PersistentDB* pdb_init()
 {
+    const char *kind = getenv("BP_PARITY_DB");
+    if (kind != NULL && strcmp(kind, "store") == 0) {
+        PdbStore *store = store_open(PDB_STORE_DIR);
+        if (store == NULL)
+            return NULL;
+        PersistentDB *res = calloc(1, sizeof(PersistentDB));
+        res->store = store;
+        return res;
+    }
+    if (kind != NULL && strcmp(kind, "leveldb") != 0) {
+        fprintf(stderr, "BP_PARITY_DB must be 'leveldb' or 'store', not '%s'\n", kind);
+        return NULL;
+    }
     leveldb_cache_t *cache = leveldb_cache_create_lru(100*1024*1024);
     leveldb_options_t *db_options = leveldb_options_create();
     leveldb_options_set_create_if_missing(db_options, 1);
@@ -30,7 +64,7 @@ PersistentDB* pdb_init()
     leveldb_writeoptions_t *write_options = leveldb_writeoptions_create();
     leveldb_writeoptions_set_sync(write_options, 0);
     char *errmsg = NULL;
-    leveldb_t *db = leveldb_open(db_options, "/tmp/persistent-db", &errmsg);
+    leveldb_t *db = leveldb_open(db_options, PDB_LEVELDB_DIR, &errmsg);
     if (errmsg != NULL) {
         fprintf(stderr, "%s\n", errmsg);
         return NULL;
@@ -47,6 +81,11 @@ PersistentDB* pdb_init()
 
 void pdb_term(PersistentDB *pdb)
 {
+    if (pdb->store != NULL) {
+        store_close(pdb->store);
+        free(pdb);
+        return;
+    }
     leveldb_options_destroy(pdb->options);
     leveldb_cache_destroy(pdb->cache);
     leveldb_readoptions_destroy(pdb->ropts);
@@ -58,6 +97,10 @@ void pdb_term(PersistentDB *pdb)
 
 void pdb_set(PersistentDB *pdb, const char *key, size_t keylen, const FileInfo *val)
 {
+    if (pdb->store != NULL) {
+        store_put(pdb->store, key, keylen, val, sizeof(FileInfo));
+        return;
+    }
     char *errmsg = NULL;
     leveldb_put(
             pdb->db,
@@ -70,6 +113,10 @@ void pdb_set(PersistentDB *pdb, const char *key, size_t keylen, const FileInfo *
 
 void pdb_del(PersistentDB *pdb, const char *key, size_t keylen)
 {
+    if (pdb->store != NULL) {
+        store_del(pdb->store, key, keylen);
+        return;
+    }
     char *errmsg = NULL;
     leveldb_delete(
             pdb->db,
@@ -79,8 +126,24 @@ void pdb_del(PersistentDB *pdb, const char *key, size_t keylen)
     leveldb_free(errmsg);
 }
 
+/* Values from before Q was added are shorter */
+static
+int copy_file_info(FileInfo *val, const void *stored, size_t len)
+{
+    if (len != sizeof(FileInfo) && len != FILE_INFO_V1_SIZE)
+        return 0;
+    val->Q = NO_Q;
+    memcpy(val, stored, len);
+    return 1;
+}
+
 int pdb_get(const PersistentDB *pdb, const char *key, size_t keylen, FileInfo *val)
 {
+    if (pdb->store != NULL) {
+        uint8_t stored[STORE_VALUE_SIZE];
+        int len = store_get(pdb->store, key, keylen, stored);
+        return len >= 0 && copy_file_info(val, stored, len);
+    }
     size_t fi_len;
     char *errmsg = NULL;
     FileInfo *pfi = (FileInfo *)leveldb_get(
@@ -92,29 +155,499 @@ int pdb_get(const PersistentDB *pdb, const char *key, size_t keylen, FileInfo *v
     leveldb_free(errmsg);
     if (pfi == NULL)
         return 0;
-    assert(fi_len == sizeof(FileInfo));
+    assert(fi_len == sizeof(FileInfo) || fi_len == FILE_INFO_V1_SIZE);
+    val->Q = NO_Q;
     memcpy(val, pfi, fi_len);
     leveldb_free(pfi);
     return 1;
 }
 
-void pdb_iterate(const PersistentDB *pdb, ProcessFileInfos f)
+/*
+ * Updates are added to `filling` while the commit thread writes `full`. The
+ * two writebatches trade places, so at most one is waiting to be written.
+ * A file's entry and its postings always go in the same writebatch, or with
+ * the store in the same group.
+ */
+struct PDBBatch {
+    PersistentDB *pdb;
+    leveldb_writebatch_t *filling;
+    size_t count;
+    size_t bytes;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    leveldb_writebatch_t *full;     /* <- NULL while the thread is idle */
+    leveldb_writebatch_t *spare;
+    int done;
+    pthread_t thread;
+    char *posting;      /* <- Room for the posting keys */
+    size_t posting_alloc;
+    StoreGroup *group;  /* <- Used in stead of the writebatches with the store */
+};
+
+static
+void *commit_thread(void *arg)
 {
-    int is_done = 0;
-    char tmp_key[200];
+    PDBBatch *b = arg;
+    pthread_mutex_lock(&b->lock);
+    for (;;) {
+        while (b->full == NULL && !b->done)
+            pthread_cond_wait(&b->cond, &b->lock);
+        if (b->full == NULL)
+            break;
+        leveldb_writebatch_t *wb = b->full;
+        pthread_mutex_unlock(&b->lock);
+        char *errmsg = NULL;
+        leveldb_write(b->pdb->db, b->pdb->wopts, wb, &errmsg);
+        if (errmsg != NULL)
+            fprintf(stderr, "%s\n", errmsg);
+        leveldb_free(errmsg);
+        leveldb_writebatch_clear(wb);
+        pthread_mutex_lock(&b->lock);
+        b->spare = wb;
+        b->full = NULL;
+        pthread_cond_broadcast(&b->cond);
+    }
+    pthread_mutex_unlock(&b->lock);
+    return NULL;
+}
+
+/* Waits for the thread to finish the previous batch and gives it this one */
+static
+void hand_off(PDBBatch *b)
+{
+    pthread_mutex_lock(&b->lock);
+    while (b->full != NULL)
+        pthread_cond_wait(&b->cond, &b->lock);
+    b->full = b->filling;
+    b->filling = b->spare;
+    b->spare = NULL;
+    pthread_cond_broadcast(&b->cond);
+    pthread_mutex_unlock(&b->lock);
+    b->count = 0;
+    b->bytes = 0;
+}
+
+PDBBatch *pdb_batch_begin(PersistentDB *pdb)
+{
+    PDBBatch *b = calloc(1, sizeof(PDBBatch));
+    b->pdb = pdb;
+    /* The store only adds to its delta, there is no need for a thread */
+    if (pdb->store != NULL) {
+        b->group = store_group_new();
+        return b;
+    }
+    b->filling = leveldb_writebatch_create();
+    b->spare = leveldb_writebatch_create();
+    pthread_mutex_init(&b->lock, NULL);
+    pthread_cond_init(&b->cond, NULL);
+    pthread_create(&b->thread, NULL, commit_thread, b);
+    return b;
+}
+
+/* Deletes the key if len is negative */
+static
+void batch_write(PDBBatch *b, const char *key, size_t keylen, const void *val, int len)
+{
+    if (b->pdb->store != NULL) {
+        if (len < 0)
+            store_group_del(b->group, key, keylen);
+        else if (store_group_put(b->group, key, keylen, val, len) < 0)
+            fprintf(stderr, "'%.*s' is too large for the store\n", (int)keylen, key);
+        return;
+    }
+    if (len < 0)
+        leveldb_writebatch_delete(b->filling, key, keylen);
+    else
+        leveldb_writebatch_put(b->filling, key, keylen, val, len);
+    b->count += 1;
+    b->bytes += keylen + MAX(len, 0);
+}
+
+/* Called once all the updates of a file have been added */
+static
+void file_added(PDBBatch *b)
+{
+    if (b->pdb->store != NULL)
+        store_group_apply(b->pdb->store, b->group);
+    else if (b->count >= PDB_BATCH_COUNT || b->bytes >= PDB_BATCH_BYTES)
+        hand_off(b);
+}
+
+/*
+ * Every file entry has a posting, a key with no value, for each of the
+ * targets that keep it: PDB_META_PREFIX, 't', the target as two digits and
+ * then the path. So the files a target shares with this DB are found without
+ * reading the others.
+ */
+#define POSTING_PREFIX_LEN 4
+
+static
+size_t posting_prefix(char *dst, int st)
+{
+    return snprintf(dst, POSTING_PREFIX_LEN + 1, "%ct%02d", PDB_META_PREFIX, st);
+}
+
+static
+void batch_postings(PDBBatch *b, const char *key, size_t keylen,
+        uint64_t listed, uint64_t was_listed)
+{
+    const uint64_t changed = listed | was_listed;
+    if (changed == 0)
+        return;
+    if (POSTING_PREFIX_LEN + keylen > b->posting_alloc) {
+        b->posting_alloc = MAX(POSTING_PREFIX_LEN + keylen, 2*b->posting_alloc);
+        b->posting = realloc(b->posting, b->posting_alloc);
+    }
+    memcpy(b->posting + POSTING_PREFIX_LEN, key, keylen);
+    for (int st = 0; st < MAX_STORAGE_TARGETS; st++) {
+        if (!TEST_BIT(changed, st))
+            continue;
+        char prefix[POSTING_PREFIX_LEN + 1];
+        posting_prefix(prefix, st);
+        memcpy(b->posting, prefix, POSTING_PREFIX_LEN);
+        batch_write(b, b->posting, POSTING_PREFIX_LEN + keylen, "",
+                TEST_BIT(listed, st)? 0 : -1);
+    }
+}
+
+void pdb_batch_put(PDBBatch *b, const char *key, size_t keylen, const FileInfo *val,
+        uint64_t listed, uint64_t was_listed)
+{
+    batch_write(b, key, keylen, val, sizeof(FileInfo));
+    batch_postings(b, key, keylen, listed, was_listed);
+    file_added(b);
+}
+
+void pdb_batch_del(PDBBatch *b, const char *key, size_t keylen, uint64_t was_listed)
+{
+    batch_write(b, key, keylen, NULL, -1);
+    batch_postings(b, key, keylen, 0, was_listed);
+    file_added(b);
+}
+
+void pdb_batch_commit(PDBBatch *b)
+{
+    free(b->posting);
+    if (b->pdb->store != NULL) {
+        store_group_free(b->group);
+        store_sync(b->pdb->store);
+        free(b);
+        return;
+    }
+    if (b->count > 0)
+        hand_off(b);
+    pthread_mutex_lock(&b->lock);
+    b->done = 1;
+    pthread_cond_broadcast(&b->cond);
+    pthread_mutex_unlock(&b->lock);
+    pthread_join(b->thread, NULL);
+    leveldb_writebatch_destroy(b->filling);
+    leveldb_writebatch_destroy(b->spare);
+    pthread_mutex_destroy(&b->lock);
+    pthread_cond_destroy(&b->cond);
+    free(b);
+}
+
+void pdb_sync(PersistentDB *pdb)
+{
+    if (pdb->store != NULL) {
+        store_sync(pdb->store);
+        return;
+    }
+    /* A synced write syncs the LevelDB log, with every write before it */
+    leveldb_writeoptions_t *wopts = leveldb_writeoptions_create();
+    leveldb_writeoptions_set_sync(wopts, 1);
+    leveldb_writebatch_t *wb = leveldb_writebatch_create();
+    char *errmsg = NULL;
+    leveldb_write(pdb->db, wopts, wb, &errmsg);
+    if (errmsg != NULL)
+        fprintf(stderr, "%s\n", errmsg);
+    leveldb_free(errmsg);
+    leveldb_writebatch_destroy(wb);
+    leveldb_writeoptions_destroy(wopts);
+}
+
+struct PDBCursor {
+    leveldb_readoptions_t *ropts;
+    leveldb_iterator_t *iter;
+    int positioned;
+    StoreCursor *store;
+};
+
+PDBCursor *pdb_cursor_open(const PersistentDB *pdb)
+{
+    PDBCursor *c = calloc(1, sizeof(PDBCursor));
+    if (pdb->store != NULL) {
+        c->store = store_cursor_open(pdb->store);
+        return c;
+    }
+    c->ropts = leveldb_readoptions_create();
+    /* A single pass would only push the hot blocks out of the cache */
+    leveldb_readoptions_set_fill_cache(c->ropts, 0);
+    c->iter = leveldb_create_iterator(pdb->db, c->ropts);
+    return c;
+}
+
+void pdb_cursor_close(PDBCursor *c)
+{
+    if (c->store != NULL) {
+        store_cursor_close(c->store);
+        free(c);
+        return;
+    }
+    leveldb_iter_destroy(c->iter);
+    leveldb_readoptions_destroy(c->ropts);
+    free(c);
+}
+
+static
+int compare_key(const char *a, size_t alen, const char *b, size_t blen)
+{
+    int c = memcmp(a, b, MIN(alen, blen));
+    if (c != 0)
+        return c;
+    return (alen > blen) - (alen < blen);
+}
+
+int pdb_cursor_get(PDBCursor *c, const char *key, size_t keylen, FileInfo *val)
+{
+    if (c->store != NULL) {
+        uint8_t stored[STORE_VALUE_SIZE];
+        int len = store_cursor_get(c->store, key, keylen, stored);
+        return len >= 0 && copy_file_info(val, stored, len);
+    }
+    leveldb_iterator_t *iter = c->iter;
+    const char *k = NULL;
+    size_t klen = 0;
+    int cmp = -1;
+    if (c->positioned) {
+        /* The next key is usually close by, often in the same block */
+        for (int i = 0; i < PDB_CURSOR_STEPS && leveldb_iter_valid(iter); i++) {
+            k = leveldb_iter_key(iter, &klen);
+            cmp = compare_key(k, klen, key, keylen);
+            if (cmp >= 0)
+                break;
+            leveldb_iter_next(iter);
+        }
+    }
+    if (!c->positioned || (cmp < 0 && leveldb_iter_valid(iter))) {
+        leveldb_iter_seek(iter, key, keylen);
+        c->positioned = 1;
+        cmp = 1;
+        if (leveldb_iter_valid(iter)) {
+            k = leveldb_iter_key(iter, &klen);
+            cmp = compare_key(k, klen, key, keylen);
+        }
+    }
+    if (cmp != 0 || !leveldb_iter_valid(iter))
+        return 0;
+    size_t vallen;
+    const char *v = leveldb_iter_value(iter, &vallen);
+    return copy_file_info(val, v, vallen);
+}
+
+/* Visits the keys in order from `from` until f returns non-zero. The keys
+ * passed to f are terminated. */
+static
+void iterate_from(const PersistentDB *pdb, const char *from, size_t fromlen,
+        StoreVisit f, void *arg)
+{
+    if (pdb->store != NULL) {
+        store_iterate(pdb->store, from, fromlen, f, arg);
+        return;
+    }
+    char *tmp_key = NULL;
+    size_t tmp_alloc = 0;
     leveldb_iterator_t *iter = leveldb_create_iterator(pdb->db, pdb->ropts);
-    leveldb_iter_seek_to_first(iter);
+    leveldb_iter_seek(iter, from, fromlen);
+    int is_done = 0;
     while (!is_done && leveldb_iter_valid(iter)) {
         size_t keylen;
         const char *key = leveldb_iter_key(iter, &keylen);
+        if (keylen + 1 > tmp_alloc) {
+            tmp_alloc = MAX(keylen + 1, 2*tmp_alloc);
+            tmp_key = realloc(tmp_key, tmp_alloc);
+        }
         memcpy(tmp_key, key, keylen);
         tmp_key[keylen] = '\0';
         size_t vallen;
         const char *val = leveldb_iter_value(iter, &vallen);
-        if (vallen == sizeof(FileInfo))
-            is_done = f(tmp_key, keylen, (const FileInfo*)val);
+        is_done = f(arg, tmp_key, keylen, val, vallen);
         leveldb_iter_next(iter);
     }
     leveldb_iter_destroy(iter);
+    free(tmp_key);
+}
+
+static
+int visit_file(void *arg, const char *key, size_t keylen, const void *val, size_t len)
+{
+    ProcessFileInfos f = *(ProcessFileInfos *)arg;
+    if (keylen > 0 && key[0] == PDB_META_PREFIX)
+        return 1;
+    FileInfo fi;
+    if (!copy_file_info(&fi, val, len))
+        return 0;
+    return f(key, keylen, &fi);
+}
+
+void pdb_iterate(const PersistentDB *pdb, ProcessFileInfos f)
+{
+    iterate_from(pdb, "", 0, visit_file, &f);
+}
+
+void pdb_iterate_from(const PersistentDB *pdb, const char *from, size_t fromlen,
+        ProcessFileInfos f)
+{
+    iterate_from(pdb, from, fromlen, visit_file, &f);
+}
+
+/* The paths listed under one posting prefix */
+typedef struct {
+    char prefix[POSTING_PREFIX_LEN + 1];
+    char *paths;        /* <- Terminated, one after the other */
+    size_t bytes;
+    size_t alloc;
+    size_t npaths;
+} Postings;
+
+static
+int collect_posting(void *arg, const char *key, size_t keylen, const void *val, size_t len)
+{
+    (void)val;
+    (void)len;
+    Postings *p = arg;
+    if (keylen < POSTING_PREFIX_LEN || memcmp(key, p->prefix, POSTING_PREFIX_LEN) != 0)
+        return 1;
+    const size_t pathlen = keylen - POSTING_PREFIX_LEN;
+    if (p->bytes + pathlen + 1 > p->alloc) {
+        p->alloc = MAX(p->bytes + pathlen + 1, 2*p->alloc);
+        p->paths = realloc(p->paths, p->alloc);
+    }
+    memcpy(p->paths + p->bytes, key + POSTING_PREFIX_LEN, pathlen + 1);
+    p->bytes += pathlen + 1;
+    p->npaths += 1;
+    return 0;
+}
+
+static
+int by_path(const void *a, const void *b)
+{
+    return strcmp(*(const char **)a, *(const char **)b);
+}
+
+void pdb_iterate_targets(const PersistentDB *pdb, uint64_t sts, ProcessFileInfos f)
+{
+    /* The postings of every target, then the entries in key order */
+    Postings p = { "", NULL, 0, 0, 0 };
+    for (int st = 0; st < MAX_STORAGE_TARGETS; st++) {
+        if (!TEST_BIT(sts, st))
+            continue;
+        posting_prefix(p.prefix, st);
+        iterate_from(pdb, p.prefix, POSTING_PREFIX_LEN, collect_posting, &p);
+    }
+    const char **paths = malloc(MAX(1, p.npaths)*sizeof(char *));
+    for (size_t i = 0, offset = 0; i < p.npaths; i++) {
+        paths[i] = p.paths + offset;
+        offset += strlen(paths[i]) + 1;
+    }
+    qsort(paths, p.npaths, sizeof(char *), by_path);
+    PDBCursor *c = pdb_cursor_open(pdb);
+    for (size_t i = 0; i < p.npaths; i++) {
+        if (i > 0 && strcmp(paths[i - 1], paths[i]) == 0)
+            continue;
+        FileInfo fi;
+        const size_t keylen = strlen(paths[i]);
+        if (!pdb_cursor_get(c, paths[i], keylen, &fi))
+            continue;
+        if (f(paths[i], keylen, &fi))
+            break;
+    }
+    pdb_cursor_close(c);
+    free(paths);
+    free(p.paths);
+}
+
+typedef struct {
+    PDBBatch *batch;
+    int ntargets;
+} IndexBuild;
+
+static
+int index_file(void *arg, const char *key, size_t keylen, const void *val, size_t len)
+{
+    IndexBuild *ib = arg;
+    if (keylen > 0 && key[0] == PDB_META_PREFIX)
+        return 1;
+    FileInfo fi;
+    if (copy_file_info(&fi, val, len)) {
+        batch_postings(ib->batch, key, keylen, db_holders(key, keylen, &fi, ib->ntargets), 0);
+        file_added(ib->batch);
+    }
+    return 0;
+}
+
+void pdb_index_init(PersistentDB *pdb, int ntargets)
+{
+    uint32_t version;
+    if (pdb_get_meta(pdb, "postings", &version, sizeof(version)))
+        return;
+    IndexBuild ib = { pdb_batch_begin(pdb), ntargets };
+    iterate_from(pdb, "", 0, index_file, &ib);
+    pdb_batch_commit(ib.batch);
+    version = 1;
+    pdb_set_meta(pdb, "postings", &version, sizeof(version));
+}
+
+static
+size_t meta_key(char *dst, size_t len, const char *name)
+{
+    return snprintf(dst, len, "%c%s", PDB_META_PREFIX, name);
+}
+
+void pdb_set_meta(PersistentDB *pdb, const char *name, const void *val, size_t size)
+{
+    char key[300];
+    size_t keylen = meta_key(key, sizeof(key), name);
+    if (pdb->store != NULL) {
+        if (store_put(pdb->store, key, keylen, val, size) < 0)
+            fprintf(stderr, "'%s' is too large for the store\n", name);
+        return;
+    }
+    char *errmsg = NULL;
+    leveldb_put(pdb->db, pdb->wopts, key, keylen, val, size, &errmsg);
+    leveldb_free(errmsg);
+}
+
+void pdb_del_meta(PersistentDB *pdb, const char *name)
+{
+    char key[300];
+    size_t keylen = meta_key(key, sizeof(key), name);
+    pdb_del(pdb, key, keylen);
+}
+
+int pdb_get_meta(const PersistentDB *pdb, const char *name, void *val, size_t size)
+{
+    char key[300];
+    size_t keylen = meta_key(key, sizeof(key), name);
+    if (pdb->store != NULL) {
+        uint8_t stored[STORE_VALUE_SIZE];
+        int len = store_get(pdb->store, key, keylen, stored);
+        if (len != (int)size)
+            return 0;
+        memcpy(val, stored, size);
+        return 1;
+    }
+    size_t len;
+    char *errmsg = NULL;
+    char *stored = leveldb_get(pdb->db, pdb->ropts, key, keylen, &len, &errmsg);
+    leveldb_free(errmsg);
+    if (stored == NULL)
+        return 0;
+    int found = (len == size);
+    if (found)
+        memcpy(val, stored, size);
+    leveldb_free(stored);
+    return found;
 }
 
@@ -8,11 +8,65 @@
 typedef struct PersistentDB PersistentDB;
 typedef int (*ProcessFileInfos)(const char *key, size_t keylen, const FileInfo* info);
 
+/*
+ * The DB is LevelDB, or with BP_PARITY_DB=store in the environment the store
+ * in pdb_store.h. They are kept in different directories.
+ */
 PersistentDB* pdb_init();
 void pdb_term(PersistentDB *pdb);
 void pdb_set(PersistentDB *pdb, const char *key, size_t keylen, const FileInfo *val);
+/* Leaves the index alone, see pdb_iterate_targets */
 void pdb_del(PersistentDB *pdb, const char *key, size_t keylen);
 int pdb_get(const PersistentDB *pdb, const char *key, size_t keylen, FileInfo *val);
 void pdb_iterate(const PersistentDB *pdb, ProcessFileInfos f);
+/* Like pdb_iterate, from the first key that doesn't come before `from` */
+void pdb_iterate_from(const PersistentDB *pdb, const char *from, size_t fromlen,
+        ProcessFileInfos f);
+/* Returns once every update so far is on disk, not just out of the process */
+void pdb_sync(PersistentDB *pdb);
+
+/*
+ * Each file entry is indexed by the targets that keep it, its `listed` set,
+ * see db_holders. pdb_iterate_targets visits, in key order, only the files
+ * that any of the targets in `sts` keeps too. pdb_index_init indexes a DB
+ * written before there was an index, once.
+ */
+void pdb_iterate_targets(const PersistentDB *pdb, uint64_t sts, ProcessFileInfos f);
+void pdb_index_init(PersistentDB *pdb, int ntargets);
+
+/*
+ * Updates that are written by a background thread, in groups of up to
+ * PDB_BATCH_COUNT updates. They are only certain to be visible once
+ * pdb_batch_commit, which frees the batch, has returned.
+ */
+typedef struct PDBBatch PDBBatch;
+PDBBatch *pdb_batch_begin(PersistentDB *pdb);
+/* was_listed is the set the entry was indexed under before, if any */
+void pdb_batch_put(PDBBatch *b, const char *key, size_t keylen, const FileInfo *val,
+        uint64_t listed, uint64_t was_listed);
+void pdb_batch_del(PDBBatch *b, const char *key, size_t keylen, uint64_t was_listed);
+void pdb_batch_commit(PDBBatch *b);
+
+/*
+ * Looks up keys given in increasing order in one forward pass over the DB,
+ * instead of a seek for every key. Updates made while the cursor is open
+ * may or may not be seen.
+ */
+typedef struct PDBCursor PDBCursor;
+PDBCursor *pdb_cursor_open(const PersistentDB *pdb);
+void pdb_cursor_close(PDBCursor *c);
+/* Like pdb_get, key must not come before the previous one */
+int pdb_cursor_get(PDBCursor *c, const char *key, size_t keylen, FileInfo *val);
+
+/*
+ * Entries that are not files, such as the parity pack index. Their keys start
+ * with PDB_META_PREFIX, which sorts after the '/' every path starts with, so
+ * pdb_iterate never sees them.
+ */
+#define PDB_META_PREFIX '~'
+void pdb_set_meta(PersistentDB *pdb, const char *name, const void *val, size_t size);
+void pdb_del_meta(PersistentDB *pdb, const char *name);
+/* Returns non-zero if `name` exists with a value of exactly `size` bytes */
+int pdb_get_meta(const PersistentDB *pdb, const char *name, void *val, size_t size);
 
 #endif
@@ -10,6 +10,7 @@ void pr_add_tmp_to_total(ProgressSample *sample)
     sample->total_nfiles += sample->nfiles;
     sample->total_bytes_read += sample->bytes_read;
     sample->total_bytes_written += sample->bytes_written;
+    sample->total_bytes_direct += sample->bytes_direct;
 }
 
 void pr_clear_tmp(ProgressSample *sample)
@@ -18,6 +19,7 @@ void pr_clear_tmp(ProgressSample *sample)
     sample->nfiles = 0;
     sample->bytes_read = 0;
     sample->bytes_written = 0;
+    sample->bytes_direct = 0;
 }
 
 void pr_report_progress(ProgressSender *s, ProgressSample sample)
@@ -52,8 +54,10 @@ void pr_report_done(ProgressSender *s)
     MPI_Wait(&s->request, &stat);
 }
 
-void pr_receive_loop(int clients)
+void pr_receive_loop(int clients, int show_direct)
 {
+    printf("st - total files   | data read     | data written  | disk I/O        | files/s         | writes%s\n",
+            show_direct? "          | direct" : "");
     int remaining_clients = clients;
     while (remaining_clients > 0)
     {
@@ -65,13 +69,20 @@ void pr_receive_loop(int clients)
             remaining_clients -= 1;
         }
         else {
-            printf("%2d - %7zu files | %9zu MiB | %9zu MiB | %9.2f MiB/s | %9.0f files/s\n",
+            printf("%2d - %7zu files | %9zu MiB | %9zu MiB | %9.2f MiB/s | %9.0f files/s | %9.2f MiB/s",
                     stat.MPI_SOURCE,
                     sample.total_nfiles,
                     sample.total_bytes_read / 1024 / 1024,
                     sample.total_bytes_written / 1024 / 1024,
                     ((double)(sample.bytes_read + sample.bytes_written) / 1024 / 1024) / sample.dt,
-                    sample.nfiles / sample.dt);
+                    sample.nfiles / sample.dt,
+                    ((double)sample.bytes_written / 1024 / 1024) / sample.dt);
+            /* Writes that went through the page cache evict data the clients
+             * are using, so show how much of them did not */
+            if (show_direct)
+                printf(" | %5.1f%%", 100.0 * sample.total_bytes_direct
+                        / MAX(sample.total_bytes_written, 1));
+            printf("\n");
             fflush(stdout);
         }
     }
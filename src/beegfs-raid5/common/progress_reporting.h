@@ -12,14 +12,16 @@ typedef struct {
     size_t nfiles;
     size_t bytes_read;
     size_t bytes_written;
+    size_t bytes_direct; /* <- Part of bytes_written that bypassed the page cache */
 
     double total_time;
     size_t total_nfiles;
     size_t total_bytes_read;
     size_t total_bytes_written;
+    size_t total_bytes_direct;
 } ProgressSample;
 
-#define PROGRESS_SAMPLE_INIT {0.0, 0, 0, 0, 0.0, 0, 0, 0}
+#define PROGRESS_SAMPLE_INIT {0.0, 0, 0, 0, 0, 0.0, 0, 0, 0, 0}
 
 typedef struct {
     MPI_Request request;
@@ -41,7 +43,8 @@ void pr_report_progress(ProgressSender *s, ProgressSample sample);
 void pr_report_done(ProgressSender *s);
 
 /* Starts a blocking loop that receives and prints performance data until all
- * clients report that they are done. */
-void pr_receive_loop(int clients);
+ * clients report that they are done. The share of the writes that bypassed
+ * the page cache is only shown with show_direct. */
+void pr_receive_loop(int clients, int show_direct);
 
 #endif
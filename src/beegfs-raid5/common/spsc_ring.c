@@ -0,0 +1,67 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <errno.h>
+#include <sched.h>
+
+#include "spsc_ring.h"
+
+void spsc_init(SpscRing *r, size_t nelems, size_t elem_size)
+{
+    assert(nelems > 0 && (nelems & (nelems - 1)) == 0);
+    memset(r, 0, sizeof(SpscRing));
+    r->items = malloc(nelems * elem_size);
+    r->elem_size = elem_size;
+    r->mask = nelems - 1;
+    sem_init(&r->avail, 0, 0);
+}
+
+void spsc_term(SpscRing *r)
+{
+    sem_destroy(&r->avail);
+    free(r->items);
+    memset(r, 0, sizeof(SpscRing));
+}
+
+int spsc_try_push(SpscRing *r, const void *elem)
+{
+    size_t tail = r->tail;
+    size_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    if (tail - head > r->mask)
+        return 0;
+    memcpy(r->items + (tail & r->mask)*r->elem_size, elem, r->elem_size);
+    __atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+    sem_post(&r->avail);
+    return 1;
+}
+
+static
+void take(SpscRing *r, void *elem)
+{
+    size_t head = r->head;
+    assert(head != __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE));
+    memcpy(elem, r->items + (head & r->mask)*r->elem_size, r->elem_size);
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+}
+
+int spsc_try_pop(SpscRing *r, void *elem)
+{
+    if (sem_trywait(&r->avail) != 0)
+        return 0;
+    take(r, elem);
+    return 1;
+}
+
+void spsc_push(SpscRing *r, const void *elem)
+{
+    while (!spsc_try_push(r, elem))
+        sched_yield();
+}
+
+void spsc_pop(SpscRing *r, void *elem)
+{
+    while (sem_wait(&r->avail) != 0 && errno == EINTR)
+        ;
+    take(r, elem);
+}
@@ -0,0 +1,36 @@
+#ifndef __spsc_ring__
+#define __spsc_ring__
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <semaphore.h>
+
+/*
+ * Bounded single-producer/single-consumer ring of fixed size elements.
+ * Pushing and popping is lock free; the semaphore only counts the elements so
+ * an idle consumer can sleep in spsc_pop instead of spinning.
+ */
+typedef struct {
+    uint8_t *items;
+    size_t elem_size;
+    size_t mask;
+    size_t head __attribute__((aligned(64))); /* <- Only written by the consumer */
+    size_t tail __attribute__((aligned(64))); /* <- Only written by the producer */
+    sem_t avail;
+} SpscRing;
+
+/* nelems must be a power of two */
+void spsc_init(SpscRing *r, size_t nelems, size_t elem_size);
+void spsc_term(SpscRing *r);
+
+/* Returns zero if the ring is full/empty. */
+int spsc_try_push(SpscRing *r, const void *elem);
+int spsc_try_pop(SpscRing *r, void *elem);
+
+/* Yields while the ring is full. */
+void spsc_push(SpscRing *r, const void *elem);
+/* Sleeps while the ring is empty. */
+void spsc_pop(SpscRing *r, void *elem);
+
+#endif
@@ -1,14 +1,19 @@
+#define _GNU_SOURCE /* O_DIRECT */
 #include <assert.h>
 #include <stdint.h>
 
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <string.h>
+#include <time.h>
 
 #include <mpi.h>
+#include <pthread.h>
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -16,23 +21,39 @@
 
 #include "common.h"
 #include "task_processing.h"
+#include "chunk_reader.h"
+#include "crc32c.h"
+#include "dir_cache.h"
+#include "gf256.h"
+#include "parity_pack.h"
+#include "spsc_ring.h"
+#include "xor_kernels.h"
 
-#define FILE_TRANSFER_BUFFER_SIZE (10*1024*1024)
+/* When non-zero the parity generator XORs each source as soon as it has been
+ * received, rather than waiting for all sources first. */
+#ifndef INCREMENTAL_XOR
+#define INCREMENTAL_XOR 1
+#endif
 
-extern int st2rank[MAX_STORAGE_TARGETS];
+#define DIRECT_ALIGN 4096
 
-/* Replicates a mkdir -p/--parents command for the dir the filename is in */
-static void mkdir_for_file(const char *filename) {
-    char tmp[256];
-    strncpy(tmp, filename, sizeof(tmp));
-    for(char *p = tmp + 1; *p; p++) {
-        if(*p == '/') {
-            *p = 0;
-            mkdir(tmp, S_IRWXU);
-            *p = '/';
-        }
-    }
-}
+/* When non-zero and there is a DB, the parity blocks of batched small files
+ * are appended to the parity pack of the target, see parity_pack.h */
+#ifndef PACK_SMALL_PARITY
+#define PACK_SMALL_PARITY 1
+#endif
+#define PACK_DIR_PAT "         parity-pack"
+
+/* Where the chunk sender sends straight out of a mapping of the file, rather
+ * than reading it in to a buffer first: 0 never, 1 for the parity blocks a
+ * rebuild reads back, 2 for chunk files as well. Chunk files belong to the
+ * clients, and a chunk that is truncated while mapped gets us a SIGBUS. */
+#ifndef MMAP_SENDS
+#define MMAP_SENDS 1
+#endif
+#define MMAP_SENDS_IN_FLIGHT 4
+
+extern int st2rank[MAX_STORAGE_TARGETS];
 
 static
 void send_sync_message_to(int recieving_rank, int msg_size, const uint8_t msg[static msg_size])
@@ -80,18 +101,32 @@ int open_fileid_readonly(const char *id, const char *load_pat)
     }
     char tmp[256];
     path_with_subst(tmp, strlen(id), id, load_pat);
-    int fd = open(tmp, O_RDONLY);
+    int fd = dir_cache_open(tmp, O_RDONLY, 0);
     if (fd <= 0)
         printf("opened '%s' with error = '%s'\n", tmp, strerror(errno));
     if (fd < 0)
         return -errno;
-    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL | POSIX_FADV_WILLNEED);
+    /* Prefetching is left to the readers, the advice values can't be or'ed */
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
     return fd;
 }
 
+int direct_writes(void)
+{
+    static int enabled = -1;
+    if (enabled < 0) {
+        const char *v = getenv("BP_DIRECT_WRITES");
+        enabled = (v != NULL && strcmp(v, "1") == 0);
+    }
+    return enabled;
+}
+
+/* With direct_writes(), *direct_fd is a second descriptor of the file opened
+ * with O_DIRECT, or -1 if the file system doesn't support it. */
 static
-int open_fileid_new_parity(const char *id, ssize_t expected_size, const char *save_pat)
+int open_fileid_new_parity(const char *id, ssize_t expected_size, const char *save_pat, int *direct_fd)
 {
+    *direct_fd = -1;
     if (strncmp("/store0", id, 7) != 0) {
         fputs("ERROR: All input files must start with /store0!"
                 " Writing to /dev/null.\n", stderr);
@@ -99,14 +134,219 @@ int open_fileid_new_parity(const char *id, ssize_t expected_size, const char *sa
     }
     char tmp[256];
     path_with_subst(tmp, strlen(id), id, save_pat);
-    mkdir_for_file(tmp);
-    int fd = creat(tmp, S_IRUSR | S_IWUSR);
+    /* Missing directories are created along the way */
+    int fd = dir_cache_open(tmp, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
     if (fd < 0)
         return -errno;
     posix_fallocate(fd, 0, expected_size);
+    if (direct_writes())
+        *direct_fd = dir_cache_open(tmp, O_WRONLY | O_DIRECT, 0);
+    return fd;
+}
+
+/* The parity pack directory of the target that holds path */
+static
+void pack_dir_for(char dir[static 256], const char *path)
+{
+    path_with_subst(dir, strlen(PACK_DIR_PAT), path, PACK_DIR_PAT);
+}
+
+/* Called when path gets a parity file of its own, or none at all */
+static
+void forget_packed_parity(HostState *hs, const char *path)
+{
+    if (hs->pdb == NULL)
+        return;
+    char dir[256];
+    pack_dir_for(dir, path);
+    pack_forget(hs->pdb, dir, path);
+}
+
+/*
+ * Opens the parity block of path, from the parity pack of the target or its
+ * own file. *base is the offset of the block in the file and *size its size.
+ */
+static
+int open_parity_block(HostState *hs, const char *path, const char *pat, uint64_t *base, uint64_t *size)
+{
+    if (hs->pdb != NULL) {
+        char dir[256];
+        pack_dir_for(dir, path);
+        int fd = pack_open(hs->pdb, dir, path, base, size);
+        if (fd >= 0)
+            return fd;
+    }
+    *base = 0;
+    *size = 0;
+    int fd = open_fileid_readonly(path, pat);
+    struct stat st;
+    if (fd >= 0 && fstat(fd, &st) == 0)
+        *size = st.st_size;
     return fd;
 }
 
+/* Writes all of a small parity block, to the parity pack if there is one.
+ * Returns non-zero if it could not be written. */
+static
+int write_small_parity(
+        HostState *hs,
+        const char *path,
+        const char *save_pat,
+        const struct iovec *iov,
+        int iovcnt,
+        size_t size)
+{
+    char tmp[256];
+    if (PACK_SMALL_PARITY && hs->pdb != NULL && strncmp("/store0", path, 7) == 0) {
+        pack_dir_for(tmp, path);
+        int r = pack_append(hs->pdb, tmp, path, iov, iovcnt);
+        /* A parity file may be left from before the file was packed */
+        if (r == 1) {
+            path_with_subst(tmp, strlen(path), path, save_pat);
+            dir_cache_unlink(tmp);
+        }
+        if (r >= 0)
+            return 0;
+        forget_packed_parity(hs, path);
+    }
+    int direct_fd;
+    int fd = open_fileid_new_parity(path, size, save_pat, &direct_fd);
+    int write_error = (fd < 0);
+    if (!write_error)
+        write_error |= (writev(fd, iov, iovcnt) != (ssize_t)size);
+    if (direct_fd >= 0)
+        close(direct_fd);
+    if (fd >= 0)
+        write_error |= (close(fd) != 0);
+    if (write_error)
+        printf("could not write the parity of '%s'\n", path);
+    return write_error;
+}
+
+/*
+ * Writes len bytes at offset. With a direct_fd the DIRECT_ALIGN aligned
+ * middle of the range bypasses the page cache, and only the partial blocks at
+ * either end go through fd. The caller places buf so that file offsets that
+ * are multiples of DIRECT_ALIGN are aligned in memory as well, see
+ * aligned_for(). Returns the number of bytes written directly, or -1.
+ */
+static
+ssize_t split_pwrite(int fd, int direct_fd, const uint8_t *buf, size_t len, uint64_t offset)
+{
+    if (direct_fd < 0)
+        return (pwrite(fd, buf, len, offset) == (ssize_t)len)? 0 : -1;
+    const uint64_t mask = DIRECT_ALIGN - 1;
+    uint64_t first = MIN(offset + len, (offset + mask) & ~mask);
+    uint64_t last = MAX(first, (offset + len) & ~mask);
+    size_t head = first - offset;
+    size_t middle = last - first;
+    size_t tail = offset + len - last;
+    if (head > 0 && pwrite(fd, buf, head, offset) != (ssize_t)head)
+        return -1;
+    if (middle > 0 && pwrite(direct_fd, buf + head, middle, first) != (ssize_t)middle)
+        return -1;
+    if (tail > 0 && pwrite(fd, buf + head + middle, tail, last) != (ssize_t)tail)
+        return -1;
+    return middle;
+}
+
+/*
+ * Stripe descriptors. Stripes go from the senders to the generator, and Q
+ * stripes on to the Q rank, as messages with tag STRIPE_DATA. A stripe that
+ * is known to be all zeros is sent as an empty message in stead, whose tag
+ * tells why: it lies in a hole of the file, past the end of its data, or it
+ * simply reads as zeros. The generator folds those as zeros without receiving
+ * them, and an output stripe that comes out all zeros is left as a hole.
+ */
+enum { STRIPE_DATA, STRIPE_HOLE, STRIPE_END, STRIPE_ZERO };
+
+static
+int is_zero(const uint8_t *p, size_t n)
+{
+    size_t head = MIN(n, 64);
+    for (size_t i = 0; i < head; i++)
+        if (p[i] != 0)
+            return 0;
+    return n <= head || memcmp(p, p + head, n - head) == 0;
+}
+
+/* The descriptor of the len bytes of fd at pos, where data holds those bytes
+ * zero padded past end (the end of what may be read) */
+static
+int stripe_kind(int fd, uint64_t pos, size_t len, uint64_t end, const uint8_t *data)
+{
+    if (fd < 0 || pos >= end)
+        return STRIPE_END;
+    off_t d = lseek(fd, pos, SEEK_DATA);
+    if ((d < 0 && errno == ENXIO) || (d >= 0 && (uint64_t)d >= MIN(pos + len, end)))
+        return STRIPE_HOLE;
+    return is_zero(data, len)? STRIPE_ZERO : STRIPE_DATA;
+}
+
+static
+void send_stripe(int dst, size_t size, const uint8_t *data, int kind)
+{
+    MPI_Send((void *)data, (kind == STRIPE_DATA)? (int)size : 0, MPI_BYTE,
+            dst, kind, MPI_COMM_WORLD);
+}
+
+/* Leaves a zero range of a new file unwritten. It was preallocated, so it is
+ * punched out again where the file system allows it. */
+static
+void write_hole(int fd, uint64_t offset, size_t len)
+{
+    if (fd >= 0)
+        fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, len);
+}
+
+/* Buffers are kept from file to file rather than allocated for every file */
+typedef struct {
+    uint8_t *ptr;
+    size_t size;
+} PooledBuffer;
+
+static
+uint8_t *pooled_buffer(PooledBuffer *b, size_t size)
+{
+    if (b->size < size) {
+        free(b->ptr);
+        if (posix_memalign((void **)&b->ptr, DIRECT_ALIGN, size) != 0)
+            abort();
+        b->size = size;
+    }
+    return b->ptr;
+}
+
+/* A pooled buffer for up to FILE_TRANSFER_BUFFER_SIZE bytes that will be
+ * written at file offsets of header_size plus a multiple of the stripe size.
+ * The padding for O_DIRECT is only added with direct_writes(). */
+static
+uint8_t *aligned_for(PooledBuffer *b, uint64_t header_size)
+{
+    if (!direct_writes())
+        return pooled_buffer(b, FILE_TRANSFER_BUFFER_SIZE);
+    return pooled_buffer(b, FILE_TRANSFER_BUFFER_SIZE + DIRECT_ALIGN)
+        + header_size % DIRECT_ALIGN;
+}
+
+/* Sleeps as needed to keep the bytes read by this rank under
+ * hs->read_limit per second */
+static
+void throttle_read(HostState *hs, size_t nbytes)
+{
+    if (hs->read_limit <= 0)
+        return;
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    double now = t.tv_sec + t.tv_nsec*1e-9;
+    hs->throttle_until = MAX(hs->throttle_until, now) + nbytes / hs->read_limit;
+    double ahead = hs->throttle_until - now;
+    if (ahead > 0) {
+        struct timespec d = { (time_t)ahead, (long)((ahead - (time_t)ahead)*1e9) };
+        nanosleep(&d, NULL);
+    }
+}
+
 #define P_rank(fi) (st2rank[GET_P((fi)->locations)])
 
 static
@@ -122,26 +362,448 @@ uint64_t div_round_up(uint64_t a, uint64_t b)
     return (a + (b - 1)) / b;
 }
 
+/* Number of chunk sizes stored in the header of a parity block */
 static
-void xor_parity(uint8_t *restrict dst, size_t nbytes, const uint8_t *data, int nsources)
+int header_entries(const FileInfo *task, TaskInfo ti)
 {
-    memcpy(dst, data, nbytes);
-    for (int j = 1; j < nsources; j++)
-    {
-        const uint8_t *src = data + j*nbytes; 
-        size_t i = 0;
-        for (; i + 8 < nbytes; i += 8)
-            *(uint64_t *)(dst + i) ^= *(uint64_t *)(src + i);
-        for (; i < nbytes; i++)
-            dst[i] ^= src[i];
+    if (ti.is_rebuilding)
+        return active_ranks(ti.data_locations);
+    return active_ranks(task->locations);
+}
+
+/* Index of the chunk stored on `st` in the header of a parity block */
+static
+int header_index(TaskInfo ti, int st)
+{
+    uint64_t mask = (1ULL << st) - 1; /* 1's up to st */
+    return active_ranks(ti.data_locations & mask);
+}
+
+/*
+ * A parity file is laid out as
+ *   nheader x uint64                chunk sizes, in header order
+ *   max_cs bytes                    parity data
+ *   nstripes x nchecksums x uint32  trailer of stripe checksums
+ * Every stripe is MIN(FILE_TRANSFER_BUFFER_SIZE, max_cs) bytes and is zero
+ * padded past the end of a chunk. The checksums of a stripe are the CRC32C of
+ * P, of Q (0 without Q) and of every data chunk in header order. Stripes of
+ * parity that are all zeros are left as holes. P and Q files carry the same
+ * trailer. Files written before the trailer was introduced simply end after
+ * the parity data.
+ */
+#define CRC_P 0
+#define CRC_Q 1
+#define CRC_DATA 2
+
+static
+uint64_t trailer_size(int nheader, uint64_t max_cs)
+{
+    return div_round_up(max_cs, FILE_TRANSFER_BUFFER_SIZE)
+        * (CRC_DATA + nheader) * sizeof(uint32_t);
+}
+
+/*
+ * Opens a stored parity block to scrub it. header_ok tells whether its header
+ * matches the current chunk sizes, and the stored checksums are loaded when
+ * the file has a trailer (otherwise *stored_crcs is NULL).
+ */
+static
+int open_stored_parity(
+        HostState *hs,
+        const char *path,
+        const char *pat,
+        int nheader,
+        const uint64_t chunk_sizes[static nheader],
+        uint64_t max_cs,
+        uint64_t *base,
+        int *header_ok,
+        uint32_t **stored_crcs)
+{
+    uint64_t stored_sizes[MAX_STORAGE_TARGETS];
+    uint64_t header_size = nheader*sizeof(uint64_t);
+    uint64_t crc_bytes = trailer_size(nheader, max_cs);
+    uint64_t size;
+    *header_ok = 0;
+    *stored_crcs = NULL;
+    int fd = open_parity_block(hs, path, pat, base, &size);
+    if (fd < 0)
+        return fd;
+    *header_ok = (pread(fd, stored_sizes, header_size, *base) == (ssize_t)header_size
+            && memcmp(stored_sizes, chunk_sizes, header_size) == 0);
+    if (crc_bytes > 0 && size == header_size + max_cs + crc_bytes) {
+        *stored_crcs = malloc(crc_bytes);
+        if (pread(fd, *stored_crcs, crc_bytes, *base + header_size + max_cs) != (ssize_t)crc_bytes) {
+            free(*stored_crcs);
+            *stored_crcs = NULL;
+        }
+    }
+    /* The parity data is read from here on */
+    lseek(fd, *base + header_size, SEEK_SET);
+    return fd;
+}
+
+/* The parity block whose header is used when rebuilding */
+static
+int sizes_holder(const FileInfo *task, TaskInfo ti)
+{
+    if (ti.actual_P_st != (int)NO_P && TEST_BIT(task->locations, ti.actual_P_st))
+        return ti.actual_P_st;
+    return ti.actual_Q_st;
+}
+
+/*
+ * Every output of the generator is a linear combination (over GF(2^8)) of
+ * the inputs. When generating, output 0 is P (all ones) and output 1 is Q
+ * (g^st). When rebuilding, the inputs are the surviving chunks plus the
+ * parity blocks in `task->locations`, output 0 is the chunk of the generator
+ * and output 1 is the chunk of the second lost target (task->Q).
+ *
+ *  P' = P ^ sum D_j            = D_a ^ D_b
+ *  Q' = Q ^ sum g^j D_j        = g^a D_a ^ g^b D_b
+ *  D_a = (Q' ^ g^b P') / (g^a ^ g^b),  D_b = P' ^ D_a
+ */
+static
+void output_coefficients(
+        const FileInfo *task,
+        TaskInfo ti,
+        int my_st,
+        int n,
+        const int sts[static n],
+        uint8_t coef[2][MAX_STORAGE_TARGETS])
+{
+    int P_in = ti.is_rebuilding && ti.actual_P_st != (int)NO_P
+        && TEST_BIT(task->locations, ti.actual_P_st);
+    int Q_in = ti.is_rebuilding && ti.actual_Q_st != (int)NO_P
+        && TEST_BIT(task->locations, ti.actual_Q_st);
+    for (int i = 0; i < n; i++) {
+        int st = sts[i];
+        if (!ti.is_rebuilding) {
+            coef[0][i] = 1;
+            coef[1][i] = gf_exp2(st);
+        }
+        else if (!Q_in) {
+            coef[0][i] = 1;
+            coef[1][i] = 0;
+        }
+        else if (!P_in) {
+            uint8_t ga_inv = gf_inv(gf_exp2(my_st));
+            coef[0][i] = (st == ti.actual_Q_st)? ga_inv : gf_mul(gf_exp2(st), ga_inv);
+            coef[1][i] = 0;
+        }
+        else {
+            uint8_t gb = gf_exp2((int)task->Q);
+            uint8_t c = gf_inv(gf_exp2(my_st) ^ gb);
+            if (st == ti.actual_Q_st)
+                coef[0][i] = c;
+            else if (st == ti.actual_P_st)
+                coef[0][i] = gf_mul(c, gb);
+            else
+                coef[0][i] = gf_mul(c, gf_exp2(st) ^ gb);
+            coef[1][i] = (st == ti.actual_Q_st)? c : 1 ^ coef[0][i];
+        }
+    }
+}
+
+/* dst (^)= sum coefs[i]*srcs[i]. Sources with a coefficient of one go through
+ * the XOR kernels in a single pass. */
+static
+void fold_sources(
+        uint8_t *dst,
+        int dst_valid,
+        size_t nbytes,
+        int n,
+        const uint8_t *const srcs[static n],
+        const uint8_t coefs[static n])
+{
+    const uint8_t *ones[MAX_STORAGE_TARGETS + 1];
+    int nones = 0;
+    if (dst_valid)
+        ones[nones++] = dst;
+    for (int i = 0; i < n; i++)
+        if (coefs[i] == 1)
+            ones[nones++] = srcs[i];
+    if (nones > (dst_valid? 1 : 0)) {
+        xor_blocks(dst, nbytes, ones, nones);
+        dst_valid = 1;
+    }
+    for (int i = 0; i < n; i++) {
+        if (coefs[i] == 1)
+            continue;
+        gf_mul_region(dst, srcs[i], nbytes, coefs[i], dst_valid);
+        dst_valid = 1;
     }
 }
 
+/*
+ * The parity generator is a three stage pipeline. The MPI thread (the caller
+ * of process_task) only posts and completes receives and sends. The compute
+ * thread folds received sources in to the output blocks, and the writer
+ * thread writes finished P blocks to disk. The stages are connected by SPSC
+ * rings and work on PIPELINE_DEPTH stripe slots, so the network, the CPU and
+ * the disk are all busy at the same time.
+ */
+#define PIPELINE_DEPTH 3
+#define PIPELINE_RING_SIZE 256
+
+/* How long the MPI thread sleeps waiting for the compute or writer thread
+ * before it checks for MPI messages again */
+#ifndef PIPELINE_POLL_US
+#define PIPELINE_POLL_US 200
+#endif
+
+typedef struct {
+    int nsources;
+    int noutputs;
+    size_t buffer_size;
+    uint64_t max_cs;
+    uint64_t header_size;
+    uint8_t coef[2][MAX_STORAGE_TARGETS];
+    int P_fd;
+    uint64_t base;      /* <- Offset of the parity block in P_fd */
+    int direct_fd;
+    uint64_t direct_bytes;      /* <- Only used by the writer thread */
+    int scrub;          /* Compare P with P_fd in stead of writing it */
+    HostState *hs;      /* <- Only used by the writer thread when scrubbing */
+    uint8_t *scratch;   /* <- Only used by the writer thread */
+    int mismatches;     /* <- Only used by the writer thread */
+    int nchecksums;
+    int crc_index[MAX_STORAGE_TARGETS];
+    int out_crc_index[2];
+    uint32_t *crcs;
+    uint8_t *data[PIPELINE_DEPTH];
+    uint8_t *out[PIPELINE_DEPTH][2];
+    int msg[PIPELINE_DEPTH];
+    uint8_t zero[PIPELINE_DEPTH][MAX_STORAGE_TARGETS]; /* <- Sources sent as descriptors */
+    uint32_t zero_crc;          /* <- Of a stripe of zeros */
+    int zero_out[PIPELINE_DEPTH];       /* <- Every source of the stripe was zeros */
+    int folded[PIPELINE_DEPTH]; /* <- Only used by the compute thread */
+    int valid[PIPELINE_DEPTH];  /* <- Only used by the compute thread */
+    int write_error;            /* <- Only used by the writer thread */
+} StripeJob;
+
+/* src is -1 when every source of the slot has been received */
+typedef struct {
+    StripeJob *job;
+    int slot;
+    int src;
+} StripeEvent;
+
+static SpscRing received_ring;  /* MPI thread -> compute thread */
+static SpscRing computed_ring;  /* compute thread -> writer thread */
+static SpscRing Q_ready_ring;   /* compute thread -> MPI thread */
+static SpscRing written_ring;   /* writer thread -> MPI thread */
+static sem_t pipeline_wake;     /* <- Posted with every push to the MPI thread */
+static int pipeline_started = 0;
+
+/* Sources and outputs are folded and checksummed one block at a time, so the
+ * CRC reads data that the XOR just pulled in to the cache. */
+#define CRC_BLOCK_SIZE (64*1024)
+
+static
+uint32_t crc_of_zeros(size_t n)
+{
+    static const uint8_t zeros[CRC_BLOCK_SIZE];
+    static size_t cached_n = 0;
+    static uint32_t cached = 0;
+    if (n != cached_n) {
+        cached = 0;
+        for (size_t off = 0; off < n; off += CRC_BLOCK_SIZE)
+            cached = crc32c(cached, zeros, MIN(CRC_BLOCK_SIZE, n - off));
+        cached_n = n;
+    }
+    return cached;
+}
+
+static
+void fold_events(const StripeEvent *ev, int n)
+{
+    StripeJob *job = ev[0].job;
+    int slot = ev[0].slot;
+    size_t bs = job->buffer_size;
+    const uint8_t *srcs[MAX_STORAGE_TARGETS];
+    uint8_t c[2][MAX_STORAGE_TARGETS];
+    int idx[MAX_STORAGE_TARGETS];
+    int nsrcs = 0;
+    int nzero = 0;
+    uint32_t *crcs = job->crcs + (size_t)job->msg[slot]*job->nchecksums;
+    for (int i = 0; i < n; i++) {
+        for (int j = MAX(ev[i].src, 0); j < job->nsources; j++) {
+            /* Sources sent as descriptors add nothing to the outputs */
+            if (job->zero[slot][j]) {
+                crcs[job->crc_index[j]] = job->zero_crc;
+                nzero++;
+            }
+            else
+                idx[nsrcs++] = j;
+            if (ev[i].src >= 0)
+                break;
+        }
+    }
+    for (int o = 0; o < job->noutputs; o++)
+        for (int k = 0; k < nsrcs; k++)
+            c[o][k] = job->coef[o][idx[k]];
+
+    const int last = (job->folded[slot] + nsrcs + nzero == job->nsources);
+    const int valid = job->valid[slot];
+    const int crc_outputs = last && (valid || nsrcs > 0);
+    uint32_t src_crc[MAX_STORAGE_TARGETS] = {0};
+    uint32_t out_crc[2] = {0};
+    for (size_t off = 0; (nsrcs > 0 || crc_outputs) && off < bs; off += CRC_BLOCK_SIZE) {
+        size_t len = MIN(CRC_BLOCK_SIZE, bs - off);
+        for (int k = 0; k < nsrcs; k++)
+            srcs[k] = job->data[slot] + idx[k]*bs + off;
+        for (int o = 0; nsrcs > 0 && o < job->noutputs; o++)
+            fold_sources(job->out[slot][o] + off, valid, len, nsrcs, srcs, c[o]);
+        for (int k = 0; k < nsrcs; k++)
+            src_crc[k] = crc32c(src_crc[k], srcs[k], len);
+        for (int o = 0; crc_outputs && o < job->noutputs; o++)
+            out_crc[o] = crc32c(out_crc[o], job->out[slot][o] + off, len);
+    }
+
+    for (int k = 0; k < nsrcs; k++)
+        crcs[job->crc_index[idx[k]]] = src_crc[k];
+    for (int o = 0; last && o < job->noutputs; o++)
+        crcs[job->out_crc_index[o]] = crc_outputs? out_crc[o] : job->zero_crc;
+
+    job->folded[slot] += nsrcs + nzero;
+    job->valid[slot] |= (nsrcs > 0);
+    if (last) {
+        /* The job may be gone as soon as the last event is pushed */
+        job->zero_out[slot] = !job->valid[slot];
+        job->folded[slot] = 0;
+        job->valid[slot] = 0;
+        StripeEvent done = { job, slot, -1 };
+        if (job->noutputs == 2) {
+            spsc_push(&Q_ready_ring, &done);
+            sem_post(&pipeline_wake);
+        }
+        spsc_push(&computed_ring, &done);
+    }
+}
+
+static
+void *compute_thread(void *arg)
+{
+    (void)arg;
+    StripeEvent pending;
+    int have_pending = 0;
+    for (;;) {
+        /* Fold everything that has arrived for a slot in one pass */
+        StripeEvent batch[MAX_STORAGE_TARGETS];
+        int n = 1;
+        if (have_pending)
+            batch[0] = pending;
+        else
+            spsc_pop(&received_ring, &batch[0]);
+        have_pending = 0;
+        while (batch[n-1].src >= 0 && n < batch[0].job->nsources
+                && spsc_try_pop(&received_ring, &pending)) {
+            if (pending.job != batch[0].job || pending.slot != batch[0].slot) {
+                have_pending = 1;
+                break;
+            }
+            batch[n++] = pending;
+        }
+        fold_events(batch, n);
+    }
+    return NULL;
+}
+
+static
+void *writer_thread(void *arg)
+{
+    (void)arg;
+    for (;;) {
+        StripeEvent ev;
+        spsc_pop(&computed_ring, &ev);
+        StripeJob *job = ev.job;
+        uint64_t offset = (uint64_t)job->msg[ev.slot] * job->buffer_size;
+        ssize_t wsize = MIN(job->buffer_size, job->max_cs - offset);
+        if (job->scrub) {
+            throttle_read(job->hs, wsize);
+            uint64_t at = job->base + job->header_size + offset;
+            ssize_t r = pread(job->P_fd, job->scratch, wsize, at);
+            posix_fadvise(job->P_fd, at, wsize, POSIX_FADV_DONTNEED);
+            job->mismatches += (r != wsize || (job->zero_out[ev.slot]
+                        ? !is_zero(job->scratch, wsize)
+                        : memcmp(job->scratch, job->out[ev.slot][0], wsize) != 0));
+        }
+        else if (job->zero_out[ev.slot])
+            write_hole(job->P_fd, job->header_size + offset, wsize);
+        else if (!job->write_error) {
+            ssize_t w = split_pwrite(job->P_fd, job->direct_fd, job->out[ev.slot][0],
+                    wsize, job->header_size + offset);
+            job->write_error |= (w < 0);
+            job->direct_bytes += MAX(w, 0);
+        }
+        spsc_push(&written_ring, &ev);
+        sem_post(&pipeline_wake);
+    }
+    return NULL;
+}
+
+static
+void start_pipeline(void)
+{
+    if (pipeline_started)
+        return;
+    spsc_init(&received_ring, PIPELINE_RING_SIZE, sizeof(StripeEvent));
+    spsc_init(&computed_ring, PIPELINE_RING_SIZE, sizeof(StripeEvent));
+    spsc_init(&Q_ready_ring, PIPELINE_RING_SIZE, sizeof(StripeEvent));
+    spsc_init(&written_ring, PIPELINE_RING_SIZE, sizeof(StripeEvent));
+    sem_init(&pipeline_wake, 0, 0);
+    pthread_t compute, writer;
+    pthread_create(&compute, NULL, compute_thread, NULL);
+    pthread_create(&writer, NULL, writer_thread, NULL);
+    pthread_detach(compute);
+    pthread_detach(writer);
+    pipeline_started = 1;
+}
+
+/* Compares the checksums of every input and every output stripe with the
+ * ones stored in the parity trailer. Returns non-zero on any mismatch. */
+static
+int check_stripes(
+        const char *path,
+        const StripeJob *job,
+        int nstripes,
+        const uint32_t *stored,
+        const int sts[],
+        const char *out_label,
+        int my_st,
+        int Q_st)
+{
+    int mismatch = 0;
+    for (int i = 0; i < job->nsources + job->noutputs; i++) {
+        int is_input = (i < job->nsources);
+        int index = is_input? job->crc_index[i] : job->out_crc_index[i - job->nsources];
+        int nbad = 0;
+        for (int s = 0; s < nstripes; s++) {
+            size_t j = (size_t)s*job->nchecksums + index;
+            nbad += (job->crcs[j] != stored[j]);
+        }
+        if (nbad == 0)
+            continue;
+        if (is_input)
+            printf("%d of %d stripes from target %d of '%s' fail their checksum\n",
+                    nbad, nstripes, sts[i], path);
+        else
+            printf("%d of %d %s stripes for target %d of '%s' fail their checksum\n",
+                    nbad, nstripes, out_label, (i == job->nsources)? my_st : Q_st, path);
+        mismatch = 1;
+    }
+    return mismatch;
+}
+
 /*
  * Roles:
  *  chunk_sender - open file and start sending parts to P-rank
  *  parity_generator:
- *      receives data from chunk sources, calculate and store parity
+ *      receives data from chunk sources, calculate and store parity. Parts
+ *      of Q are sent on to the Q-rank.
+ *  parity_receiver - receives parts of Q from the P-rank and stores them
+ * When scrubbing, the generator and the receiver compare their output with
+ * the stored parity in stead of writing it, and report any difference.
  */
 static
 void parity_generator(const char *path, const FileInfo *task, TaskInfo ti, HostState *hs)
@@ -158,32 +820,42 @@ void parity_generator(const char *path, const FileInfo *task, TaskInfo ti, HostS
     MPI_Waitall(active_source_ranks, source_messages, source_stat); \
     } while(0)
 
-    MPI_Request source_messages[MAX_STORAGE_TARGETS];
+    MPI_Request source_messages[PIPELINE_DEPTH*MAX_STORAGE_TARGETS];
+    MPI_Status recv_stat[PIPELINE_DEPTH*MAX_STORAGE_TARGETS];
     MPI_Status source_stat[MAX_STORAGE_TARGETS];
     const int active_source_ranks = active_ranks(task->locations);
     int ranks[MAX_STORAGE_TARGETS];
+    int sts[MAX_STORAGE_TARGETS];
     for (int i = 0, j = 0; i < MAX_STORAGE_TARGETS; i++)
-        if (TEST_BIT(task->locations, i))
+        if (TEST_BIT(task->locations, i)) {
+            sts[j] = i;
             ranks[j++] = st2rank[i];
+        }
 
     /* If no one has a chunk, it is safe to delete the parity data */
+    if (active_source_ranks == 0 && ti.is_scrubbing)
+        return;
     if (active_source_ranks == 0) {
         char tmp[256];
         path_with_subst(tmp, strlen(path), path, ti.save_pat);
-        unlink(tmp);
+        dir_cache_unlink(tmp);
+        forget_packed_parity(hs, path);
         return;
     }
 
+    const int nheader = header_entries(task, ti);
     uint64_t chunk_sizes[MAX_STORAGE_TARGETS];
-    /* When rebuilding we need the stored chunk sizes from the parity block on
-     * ti.actual_P_st */
+    /* When rebuilding we need the stored chunk sizes from one of the parity
+     * blocks */
     if (ti.is_rebuilding)
     {
         recv_sync_message_from(
-                st2rank[ti.actual_P_st],
-                active_source_ranks*sizeof(uint64_t),
+                st2rank[sizes_holder(task, ti)],
+                nheader*sizeof(uint64_t),
                 chunk_sizes);
     }
+    else if (ti.chunk_sizes != NULL)
+        memcpy(chunk_sizes, ti.chunk_sizes, nheader*sizeof(uint64_t));
     else
     {
         IRECV_ALL(src, chunk_sizes + src, sizeof(uint64_t));
@@ -191,125 +863,556 @@ void parity_generator(const char *path, const FileInfo *task, TaskInfo ti, HostS
     }
 
     uint64_t max_cs = 0;
-    for (int i = 0; i < active_source_ranks; i++)
+    for (int i = 0; i < nheader; i++)
         max_cs = MAX(max_cs, chunk_sizes[i]);
-    SEND_ALL(&max_cs, sizeof(max_cs));
 
-    size_t final_parity_chunk_size = max_cs + active_source_ranks*sizeof(uint64_t);
+    /* The holder follows the sizes with the stored checksums, or nothing if
+     * its parity file predates them */
+    const uint64_t crc_bytes = trailer_size(nheader, max_cs);
+    uint32_t *stored_crcs = NULL;
+    if (ti.is_rebuilding)
+    {
+        MPI_Status stat;
+        int count = 0;
+        stored_crcs = malloc(MAX(crc_bytes, 1));
+        MPI_Recv(stored_crcs, crc_bytes, MPI_BYTE,
+                st2rank[sizes_holder(task, ti)], 0, MPI_COMM_WORLD, &stat);
+        MPI_Get_count(&stat, MPI_BYTE, &count);
+        if (crc_bytes == 0 || (uint64_t)count != crc_bytes) {
+            free(stored_crcs);
+            stored_crcs = NULL;
+        }
+    }
+    if (ti.chunk_sizes == NULL)
+        SEND_ALL(&max_cs, sizeof(max_cs));
+
+    /* The second output is Q, or the second lost chunk when rebuilding */
+    StripeJob job;
+    memset(&job, 0, sizeof(job));
+    job.nsources = active_source_ranks;
+    job.noutputs = (task->Q == NO_Q)? 1 : 2;
+    const int Q_rank = (job.noutputs == 2)? st2rank[task->Q] : -1;
+    if (job.noutputs == 2 && ti.chunk_sizes == NULL)
+        send_sync_message_to(Q_rank, nheader*sizeof(uint64_t), (uint8_t *)chunk_sizes);
+    output_coefficients(task, ti, hs->storage_target, active_source_ranks, sts, job.coef);
+
+    job.nchecksums = CRC_DATA + nheader;
+    for (int i = 0; i < active_source_ranks; i++) {
+        if (!ti.is_rebuilding)
+            job.crc_index[i] = CRC_DATA + i;
+        else if (sts[i] == ti.actual_P_st)
+            job.crc_index[i] = CRC_P;
+        else if (sts[i] == ti.actual_Q_st)
+            job.crc_index[i] = CRC_Q;
+        else
+            job.crc_index[i] = CRC_DATA + header_index(ti, sts[i]);
+    }
+    job.out_crc_index[0] = CRC_P;
+    job.out_crc_index[1] = CRC_Q;
     if (ti.is_rebuilding) {
-        uint64_t loc = task->locations & ~(1 << ti.actual_P_st) & L_MASK;
-        uint64_t my_mask = (1 << hs->storage_target) - 1; /* 1's up to st */
-        int my_index = active_ranks(loc & my_mask);
-        final_parity_chunk_size = chunk_sizes[my_index];
+        job.out_crc_index[0] = CRC_DATA + header_index(ti, hs->storage_target);
+        if (job.noutputs == 2)
+            job.out_crc_index[1] = CRC_DATA + header_index(ti, (int)task->Q);
     }
-    hs->sample->bytes_written += final_parity_chunk_size;
 
-    uint8_t *data_a = malloc(active_source_ranks * FILE_TRANSFER_BUFFER_SIZE);
-    uint8_t *data_b = malloc(active_source_ranks * FILE_TRANSFER_BUFFER_SIZE);
-    uint8_t *P_block = malloc(FILE_TRANSFER_BUFFER_SIZE);
-    uint64_t data_left = max_cs;
-    size_t buffer_size = MIN(FILE_TRANSFER_BUFFER_SIZE, max_cs);
+    size_t final_parity_chunk_size = max_cs + nheader*sizeof(uint64_t);
+    if (ti.is_rebuilding)
+        final_parity_chunk_size = chunk_sizes[header_index(ti, hs->storage_target)];
+
+    static PooledBuffer data_pool[PIPELINE_DEPTH];
+    static PooledBuffer out_pool[PIPELINE_DEPTH][2];
+    static PooledBuffer scratch_pool;
+    int P_fd;
+    int header_ok = 1;
+    job.direct_fd = -1;
+    if (ti.is_scrubbing) {
+        P_fd = open_stored_parity(hs, path, ti.save_pat, nheader, chunk_sizes, max_cs,
+                &job.base, &header_ok, &stored_crcs);
+        hs->sample->bytes_read += final_parity_chunk_size;
+        job.scrub = 1;
+        job.hs = hs;
+        job.scratch = pooled_buffer(&scratch_pool, FILE_TRANSFER_BUFFER_SIZE);
+    }
+    else {
+        P_fd = open_fileid_new_parity(path, max_cs + nheader*8 + crc_bytes, ti.save_pat,
+                &job.direct_fd);
+        if (!ti.is_rebuilding)
+            forget_packed_parity(hs, path);
+        hs->sample->bytes_written += final_parity_chunk_size;
+    }
+    job.write_error = (P_fd < 0);
+    job.P_fd = P_fd;
+    job.max_cs = max_cs;
+    job.buffer_size = MIN(FILE_TRANSFER_BUFFER_SIZE, max_cs);
+    job.zero_crc = crc_of_zeros(job.buffer_size);
     int expected_messages = div_round_up(max_cs, FILE_TRANSFER_BUFFER_SIZE);
-    int P_fd = open_fileid_new_parity(path, max_cs + active_source_ranks*8, ti.save_pat);
-    int P_local_write_error = (P_fd < 0);
+    const int nslots = MIN(PIPELINE_DEPTH, expected_messages);
+    job.crcs = calloc((size_t)expected_messages*job.nchecksums, sizeof(uint32_t));
 
     /* If we are not rebuilding, we store all chunk sizes at the start of the
      * parity file. */
     if (!ti.is_rebuilding)
-        P_local_write_error |= (write(P_fd, chunk_sizes, sizeof(uint64_t)*active_source_ranks) <= 0);
+        job.header_size = sizeof(uint64_t)*nheader;
+    for (int slot = 0; slot < nslots; slot++) {
+        job.data[slot] = pooled_buffer(&data_pool[slot],
+                active_source_ranks * (size_t)job.buffer_size);
+        for (int o = 0; o < job.noutputs; o++)
+            job.out[slot][o] = aligned_for(&out_pool[slot][o], job.header_size);
+    }
+    if (!ti.is_rebuilding && !ti.is_scrubbing)
+        job.write_error |= (write(P_fd, chunk_sizes, job.header_size) <= 0);
 
-    for (int msg_i = 0; msg_i < expected_messages; msg_i++)
+    if (expected_messages > 0)
+        start_pipeline();
+
+    /* A slot is reused when its P block is written and its Q block sent */
+    MPI_Request Q_messages[PIPELINE_DEPTH];
+    int slot_users[PIPELINE_DEPTH];
+    int arrived[PIPELINE_DEPTH] = {0};
+    /* Events the compute and writer threads still owe the MPI thread */
+    int in_threads = 0;
+    int next_msg = 0;
+    int retired = 0;
+    int Q_ready[PIPELINE_DEPTH] = {0};
+    int next_Q_msg = 0;
+#define POST_SLOT(slot) do { \
+    job.msg[slot] = next_msg++; \
+    slot_users[slot] = job.noutputs; \
+    Q_messages[slot] = MPI_REQUEST_NULL; \
+    for (int ii = 0; ii < active_source_ranks; ii++) \
+        MPI_Irecv(job.data[slot] + ii*job.buffer_size, job.buffer_size, MPI_BYTE, \
+                ranks[ii], MPI_ANY_TAG, MPI_COMM_WORLD, \
+                &source_messages[slot*active_source_ranks + ii]); \
+    } while(0)
+#define RELEASE_SLOT(slot) do { \
+    if (--slot_users[slot] == 0) { \
+        retired += 1; \
+        if (next_msg < expected_messages) \
+            POST_SLOT(slot); \
+    } \
+    } while(0)
+
+    for (int slot = 0; slot < nslots; slot++)
+        POST_SLOT(slot);
+    /* With nothing owed by the threads only MPI can make progress, so the
+     * loop blocks in MPI_Waitsome rather than polling */
+    int progress = 1;
+    while (retired < expected_messages)
     {
-        if (msg_i == 0)
-            IRECV_ALL(src, data_a + src*buffer_size, buffer_size);
-        MPI_Waitall(active_source_ranks, source_messages, source_stat);
-        if (msg_i + 1 != expected_messages)
-            IRECV_ALL(src, data_b + src*buffer_size, buffer_size);
-        /* calculate P and write to disk while waiting for next data chunk */
-        xor_parity(P_block, buffer_size, data_a, active_source_ranks);
-        if (!P_local_write_error) {
-            ssize_t wsize = MIN(buffer_size, data_left);
-            ssize_t w = write(P_fd, P_block, wsize);
-            data_left -= wsize;
-            P_local_write_error |= (w <= 0);
+        int block = !progress && in_threads == 0;
+        progress = 0;
+        int ndone;
+        int done[PIPELINE_DEPTH*MAX_STORAGE_TARGETS];
+        if (block)
+            MPI_Waitsome(nslots*active_source_ranks, source_messages, &ndone, done, recv_stat);
+        else
+            MPI_Testsome(nslots*active_source_ranks, source_messages, &ndone, done, recv_stat);
+        for (int k = 0; ndone != MPI_UNDEFINED && k < ndone; k++) {
+            StripeEvent ev = { &job, done[k] / active_source_ranks, done[k] % active_source_ranks };
+            job.zero[ev.slot][ev.src] = (recv_stat[k].MPI_TAG != STRIPE_DATA);
+            int all_in = (++arrived[ev.slot] == active_source_ranks);
+            if (all_in) {
+                arrived[ev.slot] = 0;
+                in_threads += job.noutputs;
+            }
+            /* With INCREMENTAL_XOR, sources are folded in as they land. A
+             * slow sender then only delays its own share of the work. */
+#if INCREMENTAL_XOR
+            spsc_push(&received_ring, &ev);
+#else
+            if (all_in) {
+                ev.src = -1;
+                spsc_push(&received_ring, &ev);
+            }
+#endif
+            progress = 1;
+        }
+        /* Every receive is done, so wait for the Q sends instead */
+        block &= (ndone == MPI_UNDEFINED);
+        StripeEvent ev;
+        while (spsc_try_pop(&Q_ready_ring, &ev)) {
+            Q_ready[ev.slot] = 1;
+            in_threads -= 1;
+            progress = 1;
+        }
+        /* Slots may finish out of order, the Q rank takes stripes in order */
+        for (int slot = 0; slot < nslots; slot++) {
+            if (!Q_ready[slot] || job.msg[slot] != next_Q_msg)
+                continue;
+            int kind = job.zero_out[slot]? STRIPE_ZERO : STRIPE_DATA;
+            MPI_Isend(job.out[slot][1], (kind == STRIPE_DATA)? (int)job.buffer_size : 0,
+                    MPI_BYTE, Q_rank, kind, MPI_COMM_WORLD, &Q_messages[slot]);
+            Q_ready[slot] = 0;
+            next_Q_msg += 1;
+            slot = -1;
+        }
+        if (job.noutputs == 2) {
+            if (block)
+                MPI_Waitsome(nslots, Q_messages, &ndone, done, MPI_STATUSES_IGNORE);
+            else
+                MPI_Testsome(nslots, Q_messages, &ndone, done, MPI_STATUSES_IGNORE);
+            for (int k = 0; ndone != MPI_UNDEFINED && k < ndone; k++) {
+                RELEASE_SLOT(done[k]);
+                progress = 1;
+            }
+        }
+        while (spsc_try_pop(&written_ring, &ev)) {
+            RELEASE_SLOT(ev.slot);
+            in_threads -= 1;
+            progress = 1;
+        }
+        if (!progress && in_threads > 0) {
+            /* Sleep until a thread hands back a slot, but not for so long
+             * that arriving stripes sit unreceived */
+            struct timespec until;
+            clock_gettime(CLOCK_REALTIME, &until);
+            until.tv_nsec += PIPELINE_POLL_US*1000L;
+            until.tv_sec += until.tv_nsec / 1000000000L;
+            until.tv_nsec %= 1000000000L;
+            sem_timedwait(&pipeline_wake, &until);
         }
-        uint8_t *tmp = data_a;
-        data_a = data_b;
-        data_b = tmp;
     }
 
     if (ti.is_rebuilding) {
         ftruncate(P_fd, final_parity_chunk_size);
+        if (stored_crcs != NULL
+                && check_stripes(path, &job, expected_messages, stored_crcs, sts,
+                    "rebuilt", hs->storage_target, (int)task->Q))
+            push_corrupt_path(hs, path);
+    }
+    else if (ti.is_scrubbing) {
+        int mismatch = 0;
+        if (P_fd < 0 || !header_ok) {
+            printf("Parity header of '%s' does not match the chunk sizes\n", path);
+            mismatch = 1;
+        }
+        else if (job.mismatches > 0) {
+            printf("%d of %d P stripes of '%s' do not match the chunks\n",
+                    job.mismatches, expected_messages, path);
+            mismatch = 1;
+        }
+        if (stored_crcs != NULL)
+            mismatch |= check_stripes(path, &job, expected_messages, stored_crcs, sts,
+                    "parity", hs->storage_target, (int)task->Q);
+        if (mismatch)
+            push_corrupt_path(hs, path);
+        if (job.noutputs == 2 && crc_bytes > 0)
+            send_sync_message_to(Q_rank, crc_bytes, (uint8_t *)job.crcs);
+    }
+    else {
+        if (!job.write_error && crc_bytes > 0)
+            job.write_error |= (pwrite(P_fd, job.crcs, crc_bytes,
+                        job.header_size + max_cs) <= 0);
+        if (job.noutputs == 2 && crc_bytes > 0)
+            send_sync_message_to(Q_rank, crc_bytes, (uint8_t *)job.crcs);
     }
 
-    free(P_block);
-    free(data_a);
-    free(data_b);
+    hs->sample->bytes_direct += job.direct_bytes;
+    free(job.crcs);
+    free(stored_crcs);
+    if (job.direct_fd >= 0)
+        close(job.direct_fd);
     close(P_fd);
+#undef RELEASE_SLOT
+#undef POST_SLOT
 #undef SEND_ALL
 #undef IRECV_ALL
 }
 
+static
+void parity_receiver(const char *path, const FileInfo *task, TaskInfo ti, HostState *hs)
+{
+    int coordinator = P_rank(task);
+
+    /* The P-rank will be deleting its parity as well */
+    if (active_ranks(task->locations) == 0 && ti.is_scrubbing)
+        return;
+    if (active_ranks(task->locations) == 0) {
+        char tmp[256];
+        path_with_subst(tmp, strlen(path), path, ti.save_pat);
+        dir_cache_unlink(tmp);
+        forget_packed_parity(hs, path);
+        return;
+    }
+
+    const int nheader = header_entries(task, ti);
+    uint64_t chunk_sizes[MAX_STORAGE_TARGETS];
+    if (ti.chunk_sizes != NULL)
+        memcpy(chunk_sizes, ti.chunk_sizes, nheader*sizeof(uint64_t));
+    else
+        recv_sync_message_from(coordinator, nheader*sizeof(uint64_t), chunk_sizes);
+
+    uint64_t max_cs = 0;
+    for (int i = 0; i < nheader; i++)
+        max_cs = MAX(max_cs, chunk_sizes[i]);
+
+    size_t final_size = max_cs + nheader*sizeof(uint64_t);
+    if (ti.is_rebuilding)
+        final_size = chunk_sizes[header_index(ti, hs->storage_target)];
+
+    static PooledBuffer data_pool;
+    static PooledBuffer stored_pool;
+    const uint64_t header_size = ti.is_rebuilding? 0 : nheader*sizeof(uint64_t);
+    uint8_t *data = aligned_for(&data_pool, header_size);
+    uint64_t data_left = max_cs;
+    size_t buffer_size = MIN(FILE_TRANSFER_BUFFER_SIZE, max_cs);
+    int expected_messages = div_round_up(max_cs, FILE_TRANSFER_BUFFER_SIZE);
+    const uint64_t crc_bytes = trailer_size(nheader, max_cs);
+    int Q_fd;
+    int direct_fd = -1;
+    int header_ok = 1;
+    uint32_t *stored_crcs = NULL;
+    uint8_t *stored = NULL;
+    uint64_t base = 0;
+    int mismatches = 0;
+    if (ti.is_scrubbing) {
+        Q_fd = open_stored_parity(hs, path, ti.save_pat, nheader, chunk_sizes, max_cs,
+                &base, &header_ok, &stored_crcs);
+        stored = pooled_buffer(&stored_pool, FILE_TRANSFER_BUFFER_SIZE);
+        hs->sample->bytes_read += final_size;
+    }
+    else {
+        Q_fd = open_fileid_new_parity(path, max_cs + nheader*8 + crc_bytes, ti.save_pat,
+                &direct_fd);
+        if (!ti.is_rebuilding)
+            forget_packed_parity(hs, path);
+        hs->sample->bytes_written += final_size;
+    }
+    int Q_local_write_error = (Q_fd < 0);
+
+    if (!ti.is_rebuilding && !ti.is_scrubbing)
+        Q_local_write_error |= (write(Q_fd, chunk_sizes, sizeof(uint64_t)*nheader) <= 0);
+
+    for (int msg_i = 0; msg_i < expected_messages; msg_i++)
+    {
+        MPI_Status stat;
+        MPI_Recv(data, buffer_size, MPI_BYTE, coordinator, MPI_ANY_TAG, MPI_COMM_WORLD, &stat);
+        const int zero = (stat.MPI_TAG != STRIPE_DATA);
+        const ssize_t size = MIN(buffer_size, data_left);
+        const uint64_t offset = header_size + (uint64_t)msg_i*buffer_size;
+        data_left -= size;
+        if (ti.is_scrubbing) {
+            throttle_read(hs, size);
+            ssize_t r = (Q_fd < 0)? -1 : read(Q_fd, stored, size);
+            if (Q_fd >= 0)
+                posix_fadvise(Q_fd, base + offset, size, POSIX_FADV_DONTNEED);
+            mismatches += (r != size
+                    || (zero? !is_zero(stored, size) : memcmp(stored, data, size) != 0));
+        }
+        else if (zero)
+            write_hole(Q_fd, offset, size);
+        else if (!Q_local_write_error) {
+            ssize_t w = split_pwrite(Q_fd, direct_fd, data, size, offset);
+            Q_local_write_error |= (w < 0);
+            hs->sample->bytes_direct += MAX(w, 0);
+        }
+    }
+
+    /* The same checksums as in the P file */
+    int crc_mismatches = 0;
+    if (!ti.is_rebuilding && crc_bytes > 0) {
+        uint32_t *crcs = malloc(crc_bytes);
+        recv_sync_message_from(coordinator, crc_bytes, crcs);
+        if (stored_crcs != NULL) {
+            const int per_stripe = CRC_DATA + nheader;
+            for (int i = 0; i < expected_messages; i++)
+                crc_mismatches += (memcmp(crcs + i*per_stripe, stored_crcs + i*per_stripe,
+                            per_stripe*sizeof(uint32_t)) != 0);
+        }
+        else if (!ti.is_scrubbing && !Q_local_write_error)
+            Q_local_write_error |= (pwrite(Q_fd, crcs, crc_bytes, header_size + max_cs) <= 0);
+        free(crcs);
+    }
+
+    if (ti.is_scrubbing) {
+        if (Q_fd < 0 || !header_ok)
+            printf("Q parity header of '%s' does not match the chunk sizes\n", path);
+        else if (mismatches > 0)
+            printf("%d of %d Q stripes of '%s' do not match the chunks\n",
+                    mismatches, expected_messages, path);
+        if (crc_mismatches > 0)
+            printf("%d of %d stripes of '%s' fail their checksum in the Q trailer\n",
+                    crc_mismatches, expected_messages, path);
+        if (Q_fd < 0 || !header_ok || mismatches > 0 || crc_mismatches > 0)
+            push_corrupt_path(hs, path);
+    }
+
+    if (ti.is_rebuilding)
+        ftruncate(Q_fd, final_size);
+
+    free(stored_crcs);
+    if (direct_fd >= 0)
+        close(direct_fd);
+    close(Q_fd);
+}
+
+/*
+ * Sends nbytes of fd from offset, as blocks of block_size, straight out of a
+ * mapping of the file, with up to MMAP_SENDS_IN_FLIGHT sends in flight. The
+ * mapping is unmapped (and the pages dropped from the page cache) behind the
+ * send cursor. Blocks of zeros, and whatever lies past end_of_data, are only
+ * sent as descriptors. Returns non-zero if the file can't be mapped, nothing
+ * has been sent then.
+ */
+static
+int send_mapped(HostState *hs, int fd, uint64_t end_of_data, uint64_t offset,
+        uint64_t nbytes, size_t block_size, int dst)
+{
+    const uint64_t page = sysconf(_SC_PAGESIZE);
+    if (end_of_data <= offset)
+        return -1;
+    const uint64_t mapped_bytes = MIN(nbytes, end_of_data - offset);
+    const uint64_t map_start = offset & ~(page - 1);
+    const size_t map_len = offset + mapped_bytes - map_start;
+    uint8_t *map = mmap(NULL, map_len, PROT_READ, MAP_SHARED, fd, map_start);
+    if (map == MAP_FAILED)
+        return -1;
+    madvise(map, map_len, MADV_SEQUENTIAL);
+    const uint8_t *data = map + (offset - map_start);
+
+    MPI_Request reqs[MMAP_SENDS_IN_FLIGHT];
+    uint64_t ends[MMAP_SENDS_IN_FLIGHT];
+    uint8_t *padded = NULL;
+    uint64_t unmapped = 0;  /* <- Bytes of the mapping that are gone */
+    int nblocks = (nbytes + block_size - 1) / block_size;
+    for (int b = 0; b < nblocks + MMAP_SENDS_IN_FLIGHT; b++) {
+        const int slot = b % MMAP_SENDS_IN_FLIGHT;
+        if (b >= MMAP_SENDS_IN_FLIGHT) {
+            MPI_Wait(&reqs[slot], MPI_STATUS_IGNORE);
+            uint64_t done = MIN(ends[slot], mapped_bytes);
+            uint64_t upto = (done == mapped_bytes)? map_len
+                : ((offset - map_start + done) & ~(page - 1));
+            if (upto > unmapped) {
+                munmap(map + unmapped, upto - unmapped);
+                posix_fadvise(fd, map_start + unmapped, upto - unmapped, POSIX_FADV_DONTNEED);
+                unmapped = upto;
+            }
+        }
+        if (b >= nblocks)
+            continue;
+
+        const uint64_t pos = (uint64_t)b*block_size;
+        const uint8_t *msg = data + pos;
+        throttle_read(hs, MIN(block_size, nbytes - pos));
+        if (pos < mapped_bytes && pos + block_size > mapped_bytes) {
+            /* The last mapped block is partial */
+            padded = calloc(1, block_size);
+            memcpy(padded, data + pos, mapped_bytes - pos);
+            msg = padded;
+        }
+        int kind = stripe_kind(fd, offset + pos, block_size, offset + mapped_bytes, msg);
+        ends[slot] = pos + block_size;
+        MPI_Isend((void *)msg, (kind == STRIPE_DATA)? (int)block_size : 0, MPI_BYTE,
+                dst, kind, MPI_COMM_WORLD, &reqs[slot]);
+    }
+    free(padded);
+    return 0;
+}
+
 static
 void chunk_sender(const char *path, const FileInfo *task, TaskInfo ti, HostState *hs)
 {
     int my_st = hs->storage_target;
     int coordinator = P_rank(task);
-    int ntargets = active_ranks(task->locations);
+    int nheader = header_entries(task, ti);
+    int reads_parity = ti.is_rebuilding
+        && (ti.actual_P_st == my_st || ti.actual_Q_st == my_st);
     int have_had_error = 0;
-    int fd = open_fileid_readonly(path, ti.load_pat);
+    uint64_t base = 0;
     uint64_t fd_size = 0;
+    uint64_t file_size = 0;
+    int fd = reads_parity? open_parity_block(hs, path, ti.load_pat, &base, &file_size)
+        : open_fileid_readonly(path, ti.load_pat);
     if (fd < 0)
         have_had_error = 1;
     else {
         struct stat st;
         fstat(fd, &st);
-        fd_size = st.st_size;
-        if (ti.is_rebuilding && ti.actual_P_st == my_st)
-            fd_size -= ntargets*sizeof(uint64_t);
+        if (!reads_parity)
+            file_size = st.st_size;
+        fd_size = file_size;
+        if (reads_parity)
+            fd_size -= nheader*sizeof(uint64_t);
         if (ti.is_rebuilding
-                && ti.actual_P_st != my_st
+                && !reads_parity
                 && st.st_mtime > task->timestamp)
             push_corrupt_path(hs, path);
+        /* A live file may change after its parity was generated */
+        if (ti.is_scrubbing && st.st_mtime > task->timestamp)
+            printf("'%s' was modified after its parity was generated\n", path);
     }
-    hs->sample->bytes_read += fd_size;
 
-    if (ti.is_rebuilding && ti.actual_P_st == my_st) {
-        uint64_t chunk_sizes[MAX_STORAGE_TARGETS];
-        read(fd, chunk_sizes, ntargets*sizeof(uint64_t));
-        send_sync_message_to(coordinator, ntargets*sizeof(uint64_t), (uint8_t*)chunk_sizes);
+    if (reads_parity && sizes_holder(task, ti) == my_st) {
+        uint64_t chunk_sizes[MAX_STORAGE_TARGETS] = {0};
+        pread(fd, chunk_sizes, nheader*sizeof(uint64_t), base);
+        send_sync_message_to(coordinator, nheader*sizeof(uint64_t), (uint8_t*)chunk_sizes);
+
+        uint64_t max_cs = 0;
+        for (int i = 0; i < nheader; i++)
+            max_cs = MAX(max_cs, chunk_sizes[i]);
+        uint64_t header_size = nheader*sizeof(uint64_t);
+        uint64_t crc_bytes = trailer_size(nheader, max_cs);
+        uint8_t *crcs = malloc(MAX(crc_bytes, 1));
+        if (file_size != header_size + max_cs + crc_bytes
+                || pread(fd, crcs, crc_bytes, base + header_size + max_cs) != (ssize_t)crc_bytes)
+            crc_bytes = 0;
+        send_sync_message_to(coordinator, crc_bytes, crcs);
+        free(crcs);
     }
-    else if (!ti.is_rebuilding)
+    else if (!ti.is_rebuilding && ti.chunk_sizes == NULL)
         send_sync_message_to(coordinator, sizeof(fd_size), (uint8_t *)&fd_size);
 
     uint64_t data_in_fd = 0;
-    recv_sync_message_from(coordinator, sizeof(data_in_fd), &data_in_fd);
+    if (ti.chunk_sizes != NULL) {
+        /* The chunk is sent as it was in phase 1, as the parity header says */
+        fd_size = ti.chunk_sizes[active_ranks(task->locations & ((1ULL << my_st) - 1))];
+        for (int i = 0; i < nheader; i++)
+            data_in_fd = MAX(data_in_fd, ti.chunk_sizes[i]);
+    }
+    else
+        recv_sync_message_from(coordinator, sizeof(data_in_fd), &data_in_fd);
+    if (reads_parity)
+        fd_size = MIN(fd_size, data_in_fd);
+    hs->sample->bytes_read += fd_size;
 
+    /* Nothing past fd_size is read, even if the chunk has grown since */
     size_t buffer_size = MIN(FILE_TRANSFER_BUFFER_SIZE, data_in_fd);
-    uint8_t *data = malloc(FILE_TRANSFER_BUFFER_SIZE);
+    uint64_t start = base + (reads_parity? nheader*sizeof(uint64_t) : 0);
+    const uint64_t to_read = MIN(fd_size, data_in_fd);
+    const uint64_t end = MIN(base + file_size, start + to_read);
+    int map = (MMAP_SENDS >= 2 || (MMAP_SENDS >= 1 && reads_parity));
+    if (map && !have_had_error && data_in_fd > 0
+            && send_mapped(hs, fd, end, start, data_in_fd, buffer_size, coordinator) == 0) {
+        close(fd);
+        return;
+    }
+
+    /* Parts are read ahead while the current one is being sent */
+    ChunkReader reader;
+    chunk_reader_start(&reader, have_had_error? -1 : fd, start, to_read, buffer_size);
 
     size_t read_from_fd = 0;
     while (read_from_fd < data_in_fd)
     {
-        size_t data_left = data_in_fd - read_from_fd;
-        if (!have_had_error) {
-            ssize_t r = read(fd, data, MIN(buffer_size, data_left));
-            have_had_error |= (r <= 0);
-            if (have_had_error)
-                memset(data, 0, buffer_size);
-            if (r > 0 && (size_t)r < buffer_size)
-                memset(data + r, 0, (buffer_size - r));
+        const uint8_t *data = NULL;
+        int kind = STRIPE_END;
+        if (read_from_fd < to_read) {
+            if (!reader.error)
+                throttle_read(hs, MIN(buffer_size, to_read - read_from_fd));
+            data = chunk_reader_next(&reader);
+            kind = stripe_kind(reader.error? -1 : fd, start + read_from_fd, buffer_size, end, data);
         }
         read_from_fd += buffer_size;
-        send_sync_message_to(coordinator, buffer_size, data);
+        send_stripe(coordinator, buffer_size, data, kind);
     }
 
-    free(data);
+    chunk_reader_finish(&reader);
     close(fd);
 }
 
 /* Returns non-zero if we are involved in the task */
-int process_task(HostState *hs, const char *path, const FileInfo *fi, TaskInfo ti)
+static
+int run_task(HostState *hs, const char *path, const FileInfo *fi, TaskInfo ti)
 {
     if (GET_P(fi->locations) == NO_P)
         return 0;
@@ -317,9 +1420,412 @@ int process_task(HostState *hs, const char *path, const FileInfo *fi, TaskInfo t
     int my_st = hs->storage_target;
     if (GET_P(fi->locations) == my_st)
         parity_generator(path, fi, ti, hs);
+    else if (fi->Q != NO_Q && (int)fi->Q == my_st)
+        parity_receiver(path, fi, ti, hs);
     else if (my_st >= 0 && TEST_BIT(fi->locations, my_st))
         chunk_sender(path, fi, ti, hs);
     else
         return 0;
     return 1;
 }
+
+/*
+ * Small-file batching. Every file costs a few synchronous round trips, so
+ * when generating, tasks that share their locations and Q are collected in a
+ * batch and exchanged together: the senders send the chunk sizes of all
+ * files in one message, the P rank answers with the parity size of every
+ * file, and the chunks of all small files are packed in to one message per
+ * sender (and their Q blocks and checksums in to one message for the Q rank).
+ * Files with more than BATCH_SMALL_CHUNK bytes of parity then go through the
+ * normal protocol, in batch order. The parity blocks of the small files are
+ * appended to the parity pack of the target when there is one.
+ *
+ * When every file of a batch has its chunk sizes from phase 1, the ranks
+ * work out the sizes themselves and only the data is exchanged.
+ *
+ * This needs hs->batch_tasks: the members of a batch see its tasks in the
+ * same order and agree on hs->task_seq, so they all flush it at the same
+ * point: when it holds BATCH_MAX_FILES files, when its first file is
+ * BATCH_WINDOW tasks old, or in process_task_flush().
+ */
+#ifndef BATCH_MAX_FILES
+#define BATCH_MAX_FILES 128
+#endif
+#ifndef BATCH_SMALL_CHUNK
+#define BATCH_SMALL_CHUNK (64*1024)
+#endif
+#ifndef BATCH_WINDOW
+#define BATCH_WINDOW 4096
+#endif
+#define BATCH_TABLE_SIZE (4*BATCH_WINDOW)
+
+typedef struct TaskBatch TaskBatch;
+struct TaskBatch {
+    uint64_t locations;
+    uint64_t Q;
+    uint64_t first_seq;
+    TaskInfo ti;
+    TaskBatch *next;
+    TaskBatch *prev;
+    int nfiles;
+    int sizes_known;    /* <- Every file has sizes */
+    FileInfo fi[BATCH_MAX_FILES];
+    char *path[BATCH_MAX_FILES];
+    uint64_t *sizes[BATCH_MAX_FILES];   /* <- ti.chunk_sizes of the file */
+};
+
+/* Open batches by locations and Q, and in the order they were opened */
+static TaskBatch *batch_table[BATCH_TABLE_SIZE];
+static TaskBatch *oldest_batch;
+static TaskBatch *newest_batch;
+
+static
+size_t batch_home(uint64_t locations, uint64_t Q)
+{
+    uint64_t h = (locations ^ (Q * UINT64_C(0x9e3779b97f4a7c15))) * UINT64_C(0xff51afd7ed558ccd);
+    return (h >> 32) & (BATCH_TABLE_SIZE - 1);
+}
+
+static
+size_t find_batch(uint64_t locations, uint64_t Q)
+{
+    size_t i = batch_home(locations, Q);
+    while (batch_table[i] != NULL
+            && (batch_table[i]->locations != locations || batch_table[i]->Q != Q))
+        i = (i + 1) & (BATCH_TABLE_SIZE - 1);
+    return i;
+}
+
+static
+void remove_batch(TaskBatch *b)
+{
+    const size_t mask = BATCH_TABLE_SIZE - 1;
+    size_t hole = find_batch(b->locations, b->Q);
+    batch_table[hole] = NULL;
+    /* Entries further along the probe sequence are moved back in to the hole */
+    for (size_t j = (hole + 1) & mask; batch_table[j] != NULL; j = (j + 1) & mask) {
+        size_t home = batch_home(batch_table[j]->locations, batch_table[j]->Q);
+        if (((j - home) & mask) >= ((j - hole) & mask)) {
+            batch_table[hole] = batch_table[j];
+            batch_table[j] = NULL;
+            hole = j;
+        }
+    }
+    if (b->prev != NULL)
+        b->prev->next = b->next;
+    else
+        oldest_batch = b->next;
+    if (b->next != NULL)
+        b->next->prev = b->prev;
+    else
+        newest_batch = b->prev;
+}
+
+/* sizes[src*n + i] = the size from phase 1 of the chunk of file i on source
+ * src, and max_cs[i] the largest of them */
+static
+void batch_known_sizes(const TaskBatch *b, int nsrc, uint64_t *sizes, uint64_t *max_cs)
+{
+    const int n = b->nfiles;
+    for (int i = 0; i < n; i++) {
+        max_cs[i] = 0;
+        for (int k = 0; k < nsrc; k++) {
+            sizes[k*n + i] = b->sizes[i][k];
+            max_cs[i] = MAX(max_cs[i], b->sizes[i][k]);
+        }
+    }
+}
+
+/* Bytes of parity of the files small enough to be packed */
+static
+uint64_t packed_size(int n, const uint64_t max_cs[static n])
+{
+    uint64_t total = 0;
+    for (int i = 0; i < n; i++)
+        if (max_cs[i] <= BATCH_SMALL_CHUNK)
+            total += max_cs[i];
+    return total;
+}
+
+static
+void batch_sender(const TaskBatch *b, HostState *hs, uint64_t max_cs[static BATCH_MAX_FILES])
+{
+    const int n = b->nfiles;
+    const int coordinator = st2rank[GET_P(b->locations)];
+    const int me = active_ranks(b->locations & ((1ULL << hs->storage_target) - 1));
+    uint64_t sizes[BATCH_MAX_FILES];
+    int fds[BATCH_MAX_FILES];
+    for (int i = 0; i < n; i++) {
+        struct stat st;
+        fds[i] = open_fileid_readonly(b->path[i], b->ti.load_pat);
+        sizes[i] = (fds[i] >= 0 && fstat(fds[i], &st) == 0)? (uint64_t)st.st_size : 0;
+    }
+    if (b->sizes_known) {
+        static uint64_t all_sizes[MAX_STORAGE_TARGETS*BATCH_MAX_FILES];
+        batch_known_sizes(b, active_ranks(b->locations), all_sizes, max_cs);
+        memcpy(sizes, all_sizes + me*n, n*sizeof(uint64_t));
+    }
+    else {
+        send_sync_message_to(coordinator, n*sizeof(uint64_t), (uint8_t *)sizes);
+        recv_sync_message_from(coordinator, n*sizeof(uint64_t), max_cs);
+    }
+
+    static PooledBuffer packed_pool;
+    const uint64_t total = packed_size(n, max_cs);
+    uint8_t *packed = pooled_buffer(&packed_pool, MAX(total, 1));
+    uint64_t offset = 0;
+    for (int i = 0; i < n; i++) {
+        if (max_cs[i] <= BATCH_SMALL_CHUNK) {
+            ssize_t r = (fds[i] < 0)? 0
+                : pread(fds[i], packed + offset, MIN(sizes[i], max_cs[i]), 0);
+            r = MAX(r, 0);
+            memset(packed + offset + r, 0, max_cs[i] - r);
+            offset += max_cs[i];
+            hs->sample->bytes_read += sizes[i];
+        }
+        if (fds[i] >= 0) {
+            posix_fadvise(fds[i], 0, 0, POSIX_FADV_DONTNEED);
+            close(fds[i]);
+        }
+    }
+    if (total > 0)
+        send_sync_message_to(coordinator, total, packed);
+}
+
+static
+void batch_generator(const TaskBatch *b, HostState *hs, uint64_t max_cs[static BATCH_MAX_FILES])
+{
+    const int n = b->nfiles;
+    const int nsrc = active_ranks(b->locations);
+    int ranks[MAX_STORAGE_TARGETS];
+    int sts[MAX_STORAGE_TARGETS];
+    for (int i = 0, j = 0; i < MAX_STORAGE_TARGETS; i++)
+        if (TEST_BIT(b->locations, i)) {
+            sts[j] = i;
+            ranks[j++] = st2rank[i];
+        }
+
+    /* sizes[src*n + i] is the size of the chunk of file i on source src */
+    static uint64_t sizes[MAX_STORAGE_TARGETS*BATCH_MAX_FILES];
+    MPI_Request reqs[MAX_STORAGE_TARGETS];
+    if (b->sizes_known)
+        batch_known_sizes(b, nsrc, sizes, max_cs);
+    else {
+        for (int k = 0; k < nsrc; k++)
+            MPI_Irecv(sizes + k*n, n*sizeof(uint64_t), MPI_BYTE, ranks[k],
+                    0, MPI_COMM_WORLD, &reqs[k]);
+        MPI_Waitall(nsrc, reqs, MPI_STATUSES_IGNORE);
+        for (int i = 0; i < n; i++) {
+            max_cs[i] = 0;
+            for (int k = 0; k < nsrc; k++)
+                max_cs[i] = MAX(max_cs[i], sizes[k*n + i]);
+        }
+        for (int k = 0; k < nsrc; k++)
+            MPI_Isend(max_cs, n*sizeof(uint64_t), MPI_BYTE, ranks[k],
+                    0, MPI_COMM_WORLD, &reqs[k]);
+        MPI_Waitall(nsrc, reqs, MPI_STATUSES_IGNORE);
+    }
+
+    const int with_Q = (b->Q != NO_Q);
+    const int Q_rank = with_Q? st2rank[b->Q] : -1;
+    if (with_Q && !b->sizes_known)
+        send_sync_message_to(Q_rank, nsrc*n*sizeof(uint64_t), (uint8_t *)sizes);
+
+    static PooledBuffer data_pool;
+    static PooledBuffer Q_pool;
+    static PooledBuffer file_pool;
+    const uint64_t total = packed_size(n, max_cs);
+    uint64_t crc_total = 0;
+    for (int i = 0; i < n; i++)
+        if (max_cs[i] <= BATCH_SMALL_CHUNK)
+            crc_total += trailer_size(nsrc, max_cs[i]);
+    uint8_t *data = pooled_buffer(&data_pool, MAX(nsrc*total, 1));
+    if (total > 0) {
+        for (int k = 0; k < nsrc; k++)
+            MPI_Irecv(data + k*total, total, MPI_BYTE, ranks[k],
+                    0, MPI_COMM_WORLD, &reqs[k]);
+        MPI_Waitall(nsrc, reqs, MPI_STATUSES_IGNORE);
+    }
+
+    /* The Q message holds the Q blocks of all small files, then their
+     * trailers. A P file is built in one buffer and written in one go. */
+    uint8_t coef[2][MAX_STORAGE_TARGETS];
+    output_coefficients(&b->fi[0], b->ti, hs->storage_target, nsrc, sts, coef);
+    uint8_t *Q_msg = pooled_buffer(&Q_pool, MAX(total + crc_total, 1));
+    const uint64_t header_size = nsrc*sizeof(uint64_t);
+    uint8_t *file = pooled_buffer(&file_pool,
+            header_size + BATCH_SMALL_CHUNK + trailer_size(nsrc, BATCH_SMALL_CHUNK));
+    uint64_t offset = 0;
+    uint64_t crc_offset = 0;
+    for (int i = 0; i < n; i++) {
+        const uint64_t cs = max_cs[i];
+        if (cs > BATCH_SMALL_CHUNK)
+            continue;
+        const uint8_t *srcs[MAX_STORAGE_TARGETS];
+        for (int k = 0; k < nsrc; k++) {
+            srcs[k] = data + k*total + offset;
+            memcpy(file + k*sizeof(uint64_t), &sizes[k*n + i], sizeof(uint64_t));
+        }
+        uint8_t *P = file + header_size;
+        uint8_t *Q = Q_msg + offset;
+        uint32_t crcs[CRC_DATA + MAX_STORAGE_TARGETS] = {0};
+        const uint64_t crc_bytes = trailer_size(nsrc, cs);
+        if (cs > 0) {
+            fold_sources(P, 0, cs, nsrc, srcs, coef[0]);
+            crcs[CRC_P] = crc32c(0, P, cs);
+            if (with_Q) {
+                fold_sources(Q, 0, cs, nsrc, srcs, coef[1]);
+                crcs[CRC_Q] = crc32c(0, Q, cs);
+            }
+            for (int k = 0; k < nsrc; k++)
+                crcs[CRC_DATA + k] = crc32c(0, srcs[k], cs);
+        }
+        memcpy(P + cs, crcs, crc_bytes);
+        memcpy(Q_msg + total + crc_offset, crcs, crc_bytes);
+
+        struct iovec iov = { file, header_size + cs + crc_bytes };
+        if (!write_small_parity(hs, b->path[i], b->ti.save_pat, &iov, 1, iov.iov_len))
+            hs->sample->bytes_written += header_size + cs;
+        offset += cs;
+        crc_offset += crc_bytes;
+    }
+    if (with_Q && total + crc_total > 0)
+        send_sync_message_to(Q_rank, total + crc_total, Q_msg);
+}
+
+static
+void batch_receiver(const TaskBatch *b, HostState *hs, uint64_t max_cs[static BATCH_MAX_FILES])
+{
+    const int n = b->nfiles;
+    const int nsrc = active_ranks(b->locations);
+    const int coordinator = st2rank[GET_P(b->locations)];
+    static uint64_t sizes[MAX_STORAGE_TARGETS*BATCH_MAX_FILES];
+    if (b->sizes_known)
+        batch_known_sizes(b, nsrc, sizes, max_cs);
+    else
+        recv_sync_message_from(coordinator, nsrc*n*sizeof(uint64_t), sizes);
+    uint64_t crc_total = 0;
+    for (int i = 0; i < n; i++) {
+        max_cs[i] = 0;
+        for (int k = 0; k < nsrc; k++)
+            max_cs[i] = MAX(max_cs[i], sizes[k*n + i]);
+        if (max_cs[i] <= BATCH_SMALL_CHUNK)
+            crc_total += trailer_size(nsrc, max_cs[i]);
+    }
+
+    static PooledBuffer Q_pool;
+    const uint64_t total = packed_size(n, max_cs);
+    uint8_t *Q_msg = pooled_buffer(&Q_pool, MAX(total + crc_total, 1));
+    if (total + crc_total > 0)
+        recv_sync_message_from(coordinator, total + crc_total, Q_msg);
+
+    const uint64_t header_size = nsrc*sizeof(uint64_t);
+    uint64_t offset = 0;
+    uint64_t crc_offset = 0;
+    for (int i = 0; i < n; i++) {
+        const uint64_t cs = max_cs[i];
+        if (cs > BATCH_SMALL_CHUNK)
+            continue;
+        uint64_t header[MAX_STORAGE_TARGETS];
+        for (int k = 0; k < nsrc; k++)
+            header[k] = sizes[k*n + i];
+        const uint64_t crc_bytes = trailer_size(nsrc, cs);
+        struct iovec iov[3] = {
+            { header, header_size },
+            { Q_msg + offset, cs },
+            { Q_msg + total + crc_offset, crc_bytes },
+        };
+        if (!write_small_parity(hs, b->path[i], b->ti.save_pat, iov, 3,
+                    header_size + cs + crc_bytes))
+            hs->sample->bytes_written += header_size + cs;
+        offset += cs;
+        crc_offset += crc_bytes;
+    }
+}
+
+static
+void flush_batch(HostState *hs, TaskBatch *b)
+{
+    remove_batch(b);
+    uint64_t max_cs[BATCH_MAX_FILES];
+    int my_st = hs->storage_target;
+    if (GET_P(b->locations) == my_st)
+        batch_generator(b, hs, max_cs);
+    else if (b->Q != NO_Q && (int)b->Q == my_st)
+        batch_receiver(b, hs, max_cs);
+    else
+        batch_sender(b, hs, max_cs);
+    for (int i = 0; i < b->nfiles; i++) {
+        TaskInfo ti = b->ti;
+        ti.chunk_sizes = b->sizes[i];
+        if (max_cs[i] > BATCH_SMALL_CHUNK)
+            run_task(hs, b->path[i], &b->fi[i], ti);
+        free(b->path[i]);
+        free(b->sizes[i]);
+    }
+    free(b);
+}
+
+/* Returns non-zero if we are involved in the task, which may be deferred to
+ * a later call or to process_task_flush() */
+int process_task(HostState *hs, const char *path, const FileInfo *fi, TaskInfo ti)
+{
+    if (!hs->batch_tasks || ti.is_rebuilding || ti.is_scrubbing || BATCH_MAX_FILES <= 1)
+        return run_task(hs, path, fi, ti);
+
+    const uint64_t seq = hs->task_seq++;
+    while (oldest_batch != NULL && oldest_batch->first_seq + BATCH_WINDOW <= seq)
+        flush_batch(hs, oldest_batch);
+
+    int my_st = hs->storage_target;
+    if (GET_P(fi->locations) == NO_P)
+        return 0;
+    if (GET_P(fi->locations) != my_st
+            && (fi->Q == NO_Q || (int)fi->Q != my_st)
+            && (my_st < 0 || !TEST_BIT(fi->locations, my_st)))
+        return 0;
+    /* Deleting parity needs no exchange */
+    if (active_ranks(fi->locations) == 0)
+        return run_task(hs, path, fi, ti);
+
+    size_t slot = find_batch(fi->locations, fi->Q);
+    TaskBatch *b = batch_table[slot];
+    if (b == NULL) {
+        b = malloc(sizeof(TaskBatch));
+        b->locations = fi->locations;
+        b->Q = fi->Q;
+        b->first_seq = seq;
+        b->ti = ti;
+        b->ti.chunk_sizes = NULL;
+        b->nfiles = 0;
+        b->sizes_known = 1;
+        b->next = NULL;
+        b->prev = newest_batch;
+        if (newest_batch != NULL)
+            newest_batch->next = b;
+        else
+            oldest_batch = b;
+        newest_batch = b;
+        batch_table[slot] = b;
+    }
+    b->fi[b->nfiles] = *fi;
+    b->path[b->nfiles] = strdup(path);
+    b->sizes[b->nfiles] = NULL;
+    if (ti.chunk_sizes != NULL) {
+        size_t bytes = active_ranks(fi->locations)*sizeof(uint64_t);
+        b->sizes[b->nfiles] = memcpy(malloc(bytes), ti.chunk_sizes, bytes);
+    }
+    b->sizes_known &= (ti.chunk_sizes != NULL);
+    b->nfiles += 1;
+    if (b->nfiles == BATCH_MAX_FILES)
+        flush_batch(hs, b);
+    return 1;
+}
+
+void process_task_flush(HostState *hs)
+{
+    while (oldest_batch != NULL)
+        flush_batch(hs, oldest_batch);
+    if (hs->pdb != NULL)
+        pack_compact(hs->pdb);
+}
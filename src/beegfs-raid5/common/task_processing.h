@@ -2,6 +2,7 @@
 #define __task_processing__
 
 #include "common.h"
+#include "persistent_db.h"
 #include "progress_reporting.h"
 
 typedef struct {
@@ -12,6 +13,18 @@ typedef struct {
     size_t corrupt_alloc;
     size_t corrupt_bytes_used;
     size_t corrupt_count;
+    /* Ceiling on the bytes read per second, 0 for none */
+    double read_limit;
+    double throttle_until;
+    /* Set when every rank calls process_task for every task it is involved
+     * in, in the same order. Small files are then batched, see
+     * task_processing.c */
+    int batch_tasks;
+    /* With batch_tasks: the position of the next task in the full list, set
+     * by ranks that are only given some of the tasks */
+    uint64_t task_seq;
+    /* Where the parity packs are indexed, may be NULL */
+    PersistentDB *pdb;
 } HostState;
 
 int process_task(
@@ -20,5 +33,14 @@ int process_task(
         const FileInfo *fi,
         TaskInfo ti);
 
+/* Non-zero when BP_DIRECT_WRITES is 1. Parity files and rebuilt chunks are
+ * then written with O_DIRECT, so they don't push the working set of the
+ * clients out of the page cache. */
+int direct_writes(void);
+
+/* Completes the tasks process_task has deferred and compacts the parity
+ * packs. Every rank must call it after the last task of a worklist. */
+void process_task_flush(HostState *hs);
+
 #endif
 
@@ -0,0 +1,180 @@
+#include <stdint.h>
+#include <string.h>
+
+#include <immintrin.h>
+
+#include "common.h"
+#include "xor_kernels.h"
+
+/*
+ * Every kernel walks the buffers one cache line at a time: the line is loaded
+ * from each source, combined in registers and stored to dst once. The
+ * per-line loop over the sources is unrolled by the compiler for the fixed
+ * fan-ins 2..8, the generic version is only used by xor_blocks when chaining.
+ */
+#define XOR_LINE_SIZE 64
+
+typedef void (*XorFunc)(uint8_t *dst, size_t nbytes, const uint8_t *const *srcs, int nsources);
+
+typedef struct {
+    const char *name;
+    int (*supported)(void);
+    XorFunc fn[XOR_MAX_FANIN + 1];
+} XorKernel;
+
+static inline __attribute__((always_inline))
+void xor_tail(uint8_t *dst, size_t i, size_t nbytes, const uint8_t *const *s, int n)
+{
+    for (; i < nbytes; i++) {
+        uint8_t acc = s[0][i];
+        for (int k = 1; k < n; k++)
+            acc ^= s[k][i];
+        dst[i] = acc;
+    }
+}
+
+#define DEFINE_XOR_KERNELS(NAME, TARGET, VEC, LOAD, STORE, XOR) \
+static inline __attribute__((always_inline)) TARGET \
+void NAME##_lines(uint8_t *dst, size_t nbytes, const uint8_t *const *s, const int n) \
+{ \
+    enum { W = sizeof(VEC), V = XOR_LINE_SIZE / sizeof(VEC) }; \
+    size_t i = 0; \
+    for (; i + XOR_LINE_SIZE <= nbytes; i += XOR_LINE_SIZE) { \
+        VEC acc[V]; \
+        for (int v = 0; v < V; v++) \
+            acc[v] = LOAD(s[0] + i + v*W); \
+        for (int k = 1; k < n; k++) \
+            for (int v = 0; v < V; v++) \
+                acc[v] = XOR(acc[v], LOAD(s[k] + i + v*W)); \
+        for (int v = 0; v < V; v++) \
+            STORE(dst + i + v*W, acc[v]); \
+    } \
+    xor_tail(dst, i, nbytes, s, n); \
+} \
+static TARGET void NAME##_any(uint8_t *d, size_t b, const uint8_t *const *s, int n) \
+{ NAME##_lines(d, b, s, n); } \
+static TARGET void NAME##_2(uint8_t *d, size_t b, const uint8_t *const *s, int n) \
+{ (void)n; NAME##_lines(d, b, s, 2); } \
+static TARGET void NAME##_3(uint8_t *d, size_t b, const uint8_t *const *s, int n) \
+{ (void)n; NAME##_lines(d, b, s, 3); } \
+static TARGET void NAME##_4(uint8_t *d, size_t b, const uint8_t *const *s, int n) \
+{ (void)n; NAME##_lines(d, b, s, 4); } \
+static TARGET void NAME##_5(uint8_t *d, size_t b, const uint8_t *const *s, int n) \
+{ (void)n; NAME##_lines(d, b, s, 5); } \
+static TARGET void NAME##_6(uint8_t *d, size_t b, const uint8_t *const *s, int n) \
+{ (void)n; NAME##_lines(d, b, s, 6); } \
+static TARGET void NAME##_7(uint8_t *d, size_t b, const uint8_t *const *s, int n) \
+{ (void)n; NAME##_lines(d, b, s, 7); } \
+static TARGET void NAME##_8(uint8_t *d, size_t b, const uint8_t *const *s, int n) \
+{ (void)n; NAME##_lines(d, b, s, 8); }
+
+#define KERNEL_FNS(NAME) { \
+    NAME##_any, NAME##_any, NAME##_2, NAME##_3, NAME##_4, \
+    NAME##_5, NAME##_6, NAME##_7, NAME##_8 }
+
+/* Plain 64 bit words, works everywhere */
+static inline __attribute__((always_inline))
+uint64_t load_u64(const uint8_t *p) { uint64_t v; memcpy(&v, p, sizeof(v)); return v; }
+static inline __attribute__((always_inline))
+void store_u64(uint8_t *p, uint64_t v) { memcpy(p, &v, sizeof(v)); }
+#define XOR_U64(a, b) ((a) ^ (b))
+DEFINE_XOR_KERNELS(xor_scalar, , uint64_t, load_u64, store_u64, XOR_U64)
+
+#define TARGET_SSE2 __attribute__((target("sse2")))
+#define LOAD_SSE2(p) _mm_loadu_si128((const __m128i *)(p))
+#define STORE_SSE2(p, v) _mm_storeu_si128((__m128i *)(p), (v))
+DEFINE_XOR_KERNELS(xor_sse2, TARGET_SSE2, __m128i, LOAD_SSE2, STORE_SSE2, _mm_xor_si128)
+
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#define LOAD_AVX2(p) _mm256_loadu_si256((const __m256i *)(p))
+#define STORE_AVX2(p, v) _mm256_storeu_si256((__m256i *)(p), (v))
+DEFINE_XOR_KERNELS(xor_avx2, TARGET_AVX2, __m256i, LOAD_AVX2, STORE_AVX2, _mm256_xor_si256)
+
+#define TARGET_AVX512 __attribute__((target("avx512f")))
+#define LOAD_AVX512(p) _mm512_loadu_si512((const void *)(p))
+#define STORE_AVX512(p, v) _mm512_storeu_si512((void *)(p), (v))
+DEFINE_XOR_KERNELS(xor_avx512, TARGET_AVX512, __m512i, LOAD_AVX512, STORE_AVX512, _mm512_xor_si512)
+
+static int always_supported(void) { return 1; }
+static int sse2_supported(void) { return __builtin_cpu_supports("sse2"); }
+static int avx2_supported(void) { return __builtin_cpu_supports("avx2"); }
+static int avx512_supported(void) { return __builtin_cpu_supports("avx512f"); }
+
+/* Ordered from slowest to fastest */
+static const XorKernel kernels[] = {
+    { "scalar", always_supported, KERNEL_FNS(xor_scalar) },
+    { "sse2", sse2_supported, KERNEL_FNS(xor_sse2) },
+    { "avx2", avx2_supported, KERNEL_FNS(xor_avx2) },
+    { "avx512", avx512_supported, KERNEL_FNS(xor_avx512) },
+};
+#define NKERNELS ((int)(sizeof(kernels)/sizeof(kernels[0])))
+
+static const XorKernel *selected = NULL;
+
+static
+const XorKernel *select_kernel(void)
+{
+    if (selected == NULL) {
+        __builtin_cpu_init();
+        const XorKernel *best = &kernels[0];
+        for (int i = 1; i < NKERNELS; i++)
+            if (kernels[i].supported())
+                best = &kernels[i];
+        selected = best;
+    }
+    return selected;
+}
+
+static
+void run_kernel(const XorKernel *k, uint8_t *dst, size_t nbytes, const uint8_t *const *srcs, int nsources)
+{
+    if (nsources <= 0)
+        return;
+    if (nsources == 1) {
+        if (dst != srcs[0])
+            memmove(dst, srcs[0], nbytes);
+        return;
+    }
+    int done = MIN(nsources, XOR_MAX_FANIN);
+    k->fn[done](dst, nbytes, srcs, done);
+    /* Fold the remaining sources in to dst, XOR_MAX_FANIN-1 at a time */
+    while (done < nsources) {
+        const uint8_t *tmp[XOR_MAX_FANIN];
+        int m = MIN(nsources - done, XOR_MAX_FANIN - 1);
+        tmp[0] = dst;
+        memcpy(tmp + 1, srcs + done, m*sizeof(*srcs));
+        k->fn[m + 1](dst, nbytes, tmp, m + 1);
+        done += m;
+    }
+}
+
+void xor_blocks(uint8_t *dst, size_t nbytes, const uint8_t *const *srcs, int nsources)
+{
+    run_kernel(select_kernel(), dst, nbytes, srcs, nsources);
+}
+
+const char *xor_selected_kernel(void)
+{
+    return select_kernel()->name;
+}
+
+int xor_kernel_count(void)
+{
+    return NKERNELS;
+}
+
+const char *xor_kernel_name(int kernel)
+{
+    return kernels[kernel].name;
+}
+
+int xor_kernel_supported(int kernel)
+{
+    __builtin_cpu_init();
+    return kernels[kernel].supported();
+}
+
+void xor_blocks_with(int kernel, uint8_t *dst, size_t nbytes, const uint8_t *const *srcs, int nsources)
+{
+    run_kernel(&kernels[kernel], dst, nbytes, srcs, nsources);
+}
@@ -0,0 +1,25 @@
+#ifndef __xor_kernels__
+#define __xor_kernels__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Largest number of sources a single kernel pass reads. More sources are
+ * folded in to dst in several passes. */
+#define XOR_MAX_FANIN 8
+
+/* dst = srcs[0] ^ srcs[1] ^ ... ^ srcs[nsources-1]
+ * dst may alias srcs[0], which is how a running parity block is updated. The
+ * fastest kernel supported by the CPU is selected on first use. */
+void xor_blocks(uint8_t *dst, size_t nbytes, const uint8_t *const *srcs, int nsources);
+
+/* Name of the kernel xor_blocks uses on this machine. */
+const char *xor_selected_kernel(void);
+
+/* Direct access to every kernel, for benchmarking and verification. */
+int xor_kernel_count(void);
+const char *xor_kernel_name(int kernel);
+int xor_kernel_supported(int kernel);
+void xor_blocks_with(int kernel, uint8_t *dst, size_t nbytes, const uint8_t *const *srcs, int nsources);
+
+#endif
@@ -1,53 +1,548 @@
 #include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <unistd.h>
 
 #include "file_info_hash.h"
 
-#include "khash.h"
-KHASH_MAP_INIT_STR(fih, FatFileInfo)
+/* Keys are copied in to blocks of this size, which are never moved */
+#ifndef FIH_ARENA_BLOCK
+#define FIH_ARENA_BLOCK (16*1024*1024)
+#endif
+
+/* Once the table takes up more than this it is written out as a sorted run,
+ * 0 to never spill */
+#ifndef FIH_MEMORY_LIMIT
+#define FIH_MEMORY_LIMIT (4ULL*1024*1024*1024)
+#endif
+
+/* Where the runs go. They are unlinked as soon as they are created. */
+#ifndef FIH_SPILL_DIR
+#define FIH_SPILL_DIR "/tmp"
+#endif
+
+/* Each run keeps a file open until the merge is done, so once there are
+ * this many they are merged in to one */
+#ifndef FIH_MAX_RUNS
+#define FIH_MAX_RUNS 64
+#endif
+
+/* The sizes of a file are a list, linked through `next`, in one array */
+typedef struct {
+    uint64_t size;
+    uint32_t next;
+    uint32_t src;
+} SizeEntry;
+
+typedef struct {
+    const char *key;    /* <- Terminated, in the arena */
+    uint32_t keylen;
+    uint32_t hash;
+    FatFileInfo val;
+} Entry;
+
+/* Open addressing with linear probing. The hash is kept in the slot so
+ * neither probing nor growing has to look at the entries. */
+typedef struct {
+    uint32_t hash;
+    uint32_t entry;     /* <- Index + 1, 0 for an empty slot */
+} Slot;
+
+typedef struct ArenaBlock ArenaBlock;
+struct ArenaBlock {
+    ArenaBlock *prev;
+    size_t used;
+    size_t size;
+    char data[];
+};
+
+/*
+ * A run is a file of records sorted by key, each a RunRecord followed by
+ * nsizes RunSizes and the key.
+ */
+typedef struct {
+    uint32_t keylen;
+    uint32_t nsizes;
+    int64_t timestamp;
+    uint64_t modified;
+    uint64_t deleted;
+} RunRecord;
+
+typedef struct {
+    uint64_t size;
+    uint64_t src;
+} RunSize;
+
+/* A run being merged, with its next record read in to head */
+typedef struct {
+    FILE *f;
+    RunRecord head;
+    RunSize *sizes;
+    char *key;
+    size_t key_alloc;
+} Run;
 
 struct FileInfoHash {
-    khash_t(fih) *h;
+    Slot *slots;
+    size_t nslots;      /* <- A power of two */
+    Entry *entries;     /* <- In the order they were added, until fih_next */
+    size_t nentries;
+    size_t entries_alloc;
+    ArenaBlock *arena;
+    size_t arena_bytes;
+    SizeEntry *sizes;   /* <- Entry 0 ends every list */
+    size_t sizes_used;
+    size_t sizes_alloc;
+    size_t peak_bytes;
+    /* fih_next: the next entry, or once runs were spilled, the merge */
+    size_t next;
+    Run *runs;          /* <- Oldest first */
+    size_t nruns;
+    size_t nspilled;
+    size_t *heap;       /* <- Of runs with a head, see run_before */
+    size_t heap_size;
+    int merging;
+    char *key;          /* <- Of the last record from the merge */
+    size_t key_alloc;
 };
 
 FileInfoHash* fih_init()
 {
     FileInfoHash *res = calloc(1, sizeof(FileInfoHash));
-    res->h = kh_init(fih);
+    res->nslots = 1024;
+    res->slots = calloc(res->nslots, sizeof(Slot));
+    res->sizes_used = 1;
     return res;
 }
 
+static
+void free_table(FileInfoHash *fih)
+{
+    while (fih->arena != NULL) {
+        ArenaBlock *prev = fih->arena->prev;
+        free(fih->arena);
+        fih->arena = prev;
+    }
+    free(fih->slots);
+    free(fih->entries);
+    fih->slots = NULL;
+    fih->entries = NULL;
+    fih->nslots = fih->nentries = fih->entries_alloc = fih->arena_bytes = 0;
+}
+
+static
+void close_runs(FileInfoHash *fih)
+{
+    for (size_t i = 0; i < fih->nruns; i++) {
+        fclose(fih->runs[i].f);
+        free(fih->runs[i].sizes);
+        free(fih->runs[i].key);
+    }
+    free(fih->runs);
+    free(fih->heap);
+    fih->runs = NULL;
+    fih->heap = NULL;
+    fih->nruns = fih->heap_size = 0;
+}
+
 void fih_term(FileInfoHash *fih)
 {
-    kh_destroy(fih, fih->h);
+    free_table(fih);
+    close_runs(fih);
+    free(fih->key);
+    free(fih->sizes);
     memset(fih, 0, sizeof(FileInfoHash));
     free(fih);
 }
 
-int fih_add_info(FileInfoHash *fih, char *key, int src, int64_t time, int rm)
+/* The keys on one eater all have the same hash modulo ntargets, so the bits
+ * are mixed before they pick a slot */
+static
+size_t home_slot(const FileInfoHash *fih, uint32_t hash)
+{
+    return ((hash * UINT64_C(0x9e3779b97f4a7c15)) >> 32) & (fih->nslots - 1);
+}
+
+static
+void grow_slots(FileInfoHash *fih)
+{
+    Slot *old = fih->slots;
+    size_t old_n = fih->nslots;
+    fih->nslots *= 2;
+    fih->slots = calloc(fih->nslots, sizeof(Slot));
+    for (size_t i = 0; i < old_n; i++) {
+        if (old[i].entry == 0)
+            continue;
+        size_t j = home_slot(fih, old[i].hash);
+        while (fih->slots[j].entry != 0)
+            j = (j + 1) & (fih->nslots - 1);
+        fih->slots[j] = old[i];
+    }
+    free(old);
+}
+
+static
+const char *intern(FileInfoHash *fih, const char *key, size_t keylen)
 {
-    khash_t(fih) *h = fih->h;
-    int r;
-    khint_t it = kh_put_fih(h, key, &r);
-    FatFileInfo *fi = &kh_val(h, it);
-    if (r == 1)
-        memset(fi, 0, sizeof(FatFileInfo));
+    ArenaBlock *b = fih->arena;
+    if (b == NULL || b->used + keylen + 1 > b->size) {
+        size_t size = MAX((size_t)FIH_ARENA_BLOCK, keylen + 1);
+        b = malloc(sizeof(ArenaBlock) + size);
+        b->prev = fih->arena;
+        b->used = 0;
+        b->size = size;
+        fih->arena = b;
+        fih->arena_bytes += sizeof(ArenaBlock) + size;
+    }
+    char *res = b->data + b->used;
+    memcpy(res, key, keylen);
+    res[keylen] = '\0';
+    b->used += keylen + 1;
+    return res;
+}
+
+/* The slot of the key, or the empty slot where it would go */
+static
+size_t find_slot(const FileInfoHash *fih, const char *key, size_t keylen, uint32_t hash)
+{
+    size_t i = home_slot(fih, hash);
+    for (;; i = (i + 1) & (fih->nslots - 1)) {
+        const Slot *s = &fih->slots[i];
+        if (s->entry == 0)
+            return i;
+        const Entry *e = &fih->entries[s->entry - 1];
+        if (s->hash == hash && e->keylen == keylen
+                && memcmp(e->key, key, keylen) == 0)
+            return i;
+    }
+}
+
+static
+void set_size(FileInfoHash *fih, FatFileInfo *fi, int src, uint64_t size)
+{
+    if (TEST_BIT(fi->sized, src)) {
+        uint32_t i = fi->sizes;
+        while (fih->sizes[i].src != (uint32_t)src)
+            i = fih->sizes[i].next;
+        fih->sizes[i].size = size;
+        return;
+    }
+    if (fih->sizes_used >= fih->sizes_alloc) {
+        fih->sizes_alloc = MAX(1024, fih->sizes_alloc*2);
+        fih->sizes = realloc(fih->sizes, fih->sizes_alloc*sizeof(SizeEntry));
+    }
+    uint32_t i = fih->sizes_used++;
+    fih->sizes[i] = (SizeEntry){ size, fi->sizes, src };
+    fi->sizes = i;
+    fi->sized |= (1ULL << src);
+}
+
+static size_t current_memory(const FileInfoHash *fih);
+static void spill(FileInfoHash *fih);
+static void merge_runs(FileInfoHash *fih);
+
+int fih_add_info(
+        FileInfoHash *fih,
+        const char *key,
+        size_t keylen,
+        uint32_t hash,
+        int src,
+        int64_t time,
+        int rm,
+        uint64_t size)
+{
+    size_t slot = find_slot(fih, key, keylen, hash);
+    const int existed = (fih->slots[slot].entry != 0);
+    if (!existed) {
+        /* Keep the load below 0.7 */
+        if (10*(fih->nentries + 1) > 7*fih->nslots) {
+            grow_slots(fih);
+            slot = find_slot(fih, key, keylen, hash);
+        }
+        if (fih->nentries == fih->entries_alloc) {
+            fih->entries_alloc = MAX(1024, 2*fih->entries_alloc);
+            fih->entries = realloc(fih->entries, fih->entries_alloc*sizeof(Entry));
+        }
+        Entry *e = &fih->entries[fih->nentries++];
+        e->key = intern(fih, key, keylen);
+        e->keylen = keylen;
+        e->hash = hash;
+        memset(&e->val, 0, sizeof(FatFileInfo));
+        fih->slots[slot] = (Slot){ hash, fih->nentries };
+    }
+    FatFileInfo *fi = &fih->entries[fih->slots[slot].entry - 1].val;
     fi->timestamp = MAX(fi->timestamp, time);
     if (rm)
         fi->deleted |= (1ULL << src);
     else
         fi->modified |= (1ULL << src);
-    return (r == 0);
+    if (!rm && size != NO_SIZE)
+        set_size(fih, fi, src, size);
+    if (!existed && FIH_MEMORY_LIMIT > 0 && current_memory(fih) > FIH_MEMORY_LIMIT)
+        spill(fih);
+    return existed;
+}
+
+uint64_t fih_get_size(const FileInfoHash *fih, const FatFileInfo *val, int src)
+{
+    if (!TEST_BIT(val->sized, src))
+        return NO_SIZE;
+    uint32_t i = val->sizes;
+    while (fih->sizes[i].src != (uint32_t)src)
+        i = fih->sizes[i].next;
+    return fih->sizes[i].size;
+}
+
+static
+size_t current_memory(const FileInfoHash *fih)
+{
+    return sizeof(FileInfoHash)
+        + fih->nslots*sizeof(Slot)
+        + fih->entries_alloc*sizeof(Entry)
+        + fih->arena_bytes
+        + fih->sizes_alloc*sizeof(SizeEntry);
+}
+
+size_t fih_memory(const FileInfoHash *fih)
+{
+    return MAX(fih->peak_bytes, current_memory(fih));
+}
+
+size_t fih_runs(const FileInfoHash *fih)
+{
+    return fih->nspilled;
+}
+
+static
+int by_key(const void *a, const void *b)
+{
+    const Entry *x = a, *y = b;
+    int c = memcmp(x->key, y->key, MIN(x->keylen, y->keylen));
+    if (c != 0)
+        return c;
+    return (x->keylen > y->keylen) - (x->keylen < y->keylen);
+}
+
+static
+FILE *new_run(void)
+{
+    char path[] = FIH_SPILL_DIR "/bp-parity-gen-XXXXXX";
+    int fd = mkstemp(path);
+    FILE *f = (fd >= 0)? fdopen(fd, "w+") : NULL;
+    if (f == NULL) {
+        printf("could not spill the file index to '%s'\n", FIH_SPILL_DIR);
+        abort();
+    }
+    unlink(path);
+    return f;
 }
 
-int fih_get(const FileInfoHash *fih, const char *key, FatFileInfo *val)
+static
+void write_record(const FileInfoHash *fih, FILE *f,
+        const char *key, uint32_t keylen, const FatFileInfo *val)
 {
-    khash_t(fih) *h = fih->h;
-    khint_t it = kh_get(fih, h, key);
-    if (it != kh_end(h))
-    {
-        *val = kh_val(h, it);
-        return 1;
+    RunRecord r = {
+        keylen,
+        __builtin_popcountll(val->sized),
+        val->timestamp,
+        val->modified,
+        val->deleted
+    };
+    fwrite(&r, sizeof(r), 1, f);
+    for (uint32_t j = val->sizes; j != 0; j = fih->sizes[j].next) {
+        RunSize rs = { fih->sizes[j].size, fih->sizes[j].src };
+        fwrite(&rs, sizeof(rs), 1, f);
     }
-    return 0;
+    fwrite(key, 1, keylen, f);
+}
+
+/* Makes the written run f the newest one */
+static
+void add_run(FileInfoHash *fih, FILE *f)
+{
+    if (fflush(f) != 0 || ferror(f)) {
+        printf("could not spill the file index to '%s'\n", FIH_SPILL_DIR);
+        abort();
+    }
+    rewind(f);
+    fih->runs = realloc(fih->runs, (fih->nruns + 1)*sizeof(Run));
+    fih->runs[fih->nruns++] = (Run){ f, {0, 0, 0, 0, 0}, NULL, NULL, 0 };
+}
+
+/* Writes the table out as a sorted run and starts over with an empty one */
+static
+void spill(FileInfoHash *fih)
+{
+    fih->peak_bytes = MAX(fih->peak_bytes, current_memory(fih));
+    FILE *f = new_run();
+    qsort(fih->entries, fih->nentries, sizeof(Entry), by_key);
+    for (size_t i = 0; i < fih->nentries; i++) {
+        const Entry *e = &fih->entries[i];
+        write_record(fih, f, e->key, e->keylen, &e->val);
+    }
+    add_run(fih, f);
+    fih->nspilled += 1;
+    free_table(fih);
+    fih->nslots = 1024;
+    fih->slots = calloc(fih->nslots, sizeof(Slot));
+    fih->sizes_used = 1;
+    if (fih->nruns >= FIH_MAX_RUNS)
+        merge_runs(fih);
+}
+
+/* Reads the next record of the run in to its head, returns 0 at the end */
+static
+int read_head(Run *run)
+{
+    RunRecord *r = &run->head;
+    if (fread(r, sizeof(*r), 1, run->f) != 1)
+        return 0;
+    run->sizes = realloc(run->sizes, MAX(1, r->nsizes)*sizeof(RunSize));
+    if (r->keylen > run->key_alloc) {
+        run->key_alloc = MAX(r->keylen, 2*run->key_alloc);
+        run->key = realloc(run->key, run->key_alloc);
+    }
+    return fread(run->sizes, sizeof(RunSize), r->nsizes, run->f) == r->nsizes
+        && fread(run->key, 1, r->keylen, run->f) == r->keylen;
+}
+
+static
+int compare_heads(const Run *a, const Run *b)
+{
+    int c = memcmp(a->key, b->key, MIN(a->head.keylen, b->head.keylen));
+    if (c != 0)
+        return c;
+    return (a->head.keylen > b->head.keylen) - (a->head.keylen < b->head.keylen);
+}
+
+/* Smallest key first, and for the same key the older run first so newer
+ * sizes replace older ones */
+static
+int run_before(const FileInfoHash *fih, size_t a, size_t b)
+{
+    int c = compare_heads(&fih->runs[a], &fih->runs[b]);
+    return c < 0 || (c == 0 && a < b);
 }
 
+static
+void sift_down(FileInfoHash *fih, size_t i)
+{
+    size_t *h = fih->heap;
+    for (;;) {
+        size_t m = i, l = 2*i + 1, r = 2*i + 2;
+        if (l < fih->heap_size && run_before(fih, h[l], h[m]))
+            m = l;
+        if (r < fih->heap_size && run_before(fih, h[r], h[m]))
+            m = r;
+        if (m == i)
+            return;
+        size_t t = h[i]; h[i] = h[m]; h[m] = t;
+        i = m;
+    }
+}
+
+/* Moves the run at the top of the heap on to its next record */
+static
+void advance_top(FileInfoHash *fih)
+{
+    if (!read_head(&fih->runs[fih->heap[0]]))
+        fih->heap[0] = fih->heap[--fih->heap_size];
+    if (fih->heap_size > 0)
+        sift_down(fih, 0);
+}
+
+static
+void build_heap(FileInfoHash *fih)
+{
+    fih->heap = malloc(fih->nruns*sizeof(size_t));
+    fih->heap_size = 0;
+    for (size_t i = 0; i < fih->nruns; i++)
+        if (read_head(&fih->runs[i]))
+            fih->heap[fih->heap_size++] = i;
+    for (size_t i = fih->heap_size; i-- > 0;)
+        sift_down(fih, i);
+}
+
+static const char *next_merged(FileInfoHash *fih, size_t *keylen, FatFileInfo *val);
+
+/* Replaces every run with one that has their records combined. The table is
+ * empty, so its sizes can be used for the merge. */
+static
+void merge_runs(FileInfoHash *fih)
+{
+    FILE *f = new_run();
+    build_heap(fih);
+    const char *key;
+    size_t keylen;
+    FatFileInfo val;
+    while ((key = next_merged(fih, &keylen, &val)) != NULL)
+        write_record(fih, f, key, keylen, &val);
+    close_runs(fih);
+    add_run(fih, f);
+    fih->sizes_used = 1;
+}
+
+static
+void start_merge(FileInfoHash *fih)
+{
+    /* What is still in memory becomes the newest run */
+    if (fih->nentries > 0)
+        spill(fih);
+    free_table(fih);
+    build_heap(fih);
+    fih->merging = 1;
+}
+
+/* The next file from the runs, with the records for its key combined */
+static
+const char *next_merged(FileInfoHash *fih, size_t *keylen, FatFileInfo *val)
+{
+    if (fih->heap_size == 0)
+        return NULL;
+    const Run *top = &fih->runs[fih->heap[0]];
+    *keylen = top->head.keylen;
+    if (*keylen + 1 > fih->key_alloc) {
+        fih->key_alloc = MAX(*keylen + 1, 2*fih->key_alloc);
+        fih->key = realloc(fih->key, fih->key_alloc);
+    }
+    memcpy(fih->key, top->key, *keylen);
+    fih->key[*keylen] = '\0';
+
+    memset(val, 0, sizeof(FatFileInfo));
+    fih->sizes_used = 1;
+    while (fih->heap_size > 0) {
+        const Run *run = &fih->runs[fih->heap[0]];
+        if (run->head.keylen != *keylen || memcmp(run->key, fih->key, *keylen) != 0)
+            break;
+        val->timestamp = MAX(val->timestamp, run->head.timestamp);
+        val->modified |= run->head.modified;
+        val->deleted |= run->head.deleted;
+        for (uint32_t j = 0; j < run->head.nsizes; j++)
+            set_size(fih, val, run->sizes[j].src, run->sizes[j].size);
+        advance_top(fih);
+    }
+    return fih->key;
+}
+
+const char *fih_next(FileInfoHash *fih, size_t *keylen, FatFileInfo *val)
+{
+    if (fih->nruns > 0 && !fih->merging)
+        start_merge(fih);
+    if (fih->merging)
+        return next_merged(fih, keylen, val);
+    if (fih->next == 0) {
+        /* Nothing is looked up any more, so the slots can go */
+        free(fih->slots);
+        fih->slots = NULL;
+        fih->nslots = 0;
+        qsort(fih->entries, fih->nentries, sizeof(Entry), by_key);
+    }
+    if (fih->next == fih->nentries)
+        return NULL;
+    const Entry *e = &fih->entries[fih->next++];
+    *keylen = e->keylen;
+    *val = e->val;
+    return e->key;
+}
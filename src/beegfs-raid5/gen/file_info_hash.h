@@ -1,6 +1,7 @@
 #ifndef __FIH__
 #define __FIH__
 
+#include <stddef.h>
 #include <stdint.h>
 
 #include "../common/common.h"
@@ -9,13 +10,44 @@ typedef struct {
     int64_t timestamp;
     uint64_t modified;
     uint64_t deleted;
+    uint64_t sized;     /* <- Sources that reported the size of their chunk */
+    uint32_t sizes;     /* <- See fih_get_size */
 } FatFileInfo;
 
+/*
+ * The files an eater hears about in phase 1. Keys are interned in an arena
+ * and found through an open addressing table that keeps the hash the feeder
+ * computed, so a key is never hashed again.
+ *
+ * When the table grows past FIH_MEMORY_LIMIT it is sorted and written out to
+ * a run on disk, and a new table is started. fih_next then merges the runs,
+ * so memory stays bounded however many files there are.
+ */
 typedef struct FileInfoHash FileInfoHash;
 
 FileInfoHash* fih_init();
 void fih_term(FileInfoHash *fih);
-int fih_add_info(FileInfoHash *fih, char *key, int src, int64_t time, int rm);
-int fih_get(const FileInfoHash *fih, const char *key, FatFileInfo *val);
+/* key doesn't have to be terminated. size is NO_SIZE if the source didn't
+ * report it. Returns non-zero if the file was already in the table. */
+int fih_add_info(
+        FileInfoHash *fih,
+        const char *key,
+        size_t keylen,
+        uint32_t hash,
+        int src,
+        int64_t time,
+        int rm,
+        uint64_t size);
+/* Returns the terminated key of the next file and fills in val, NULL after
+ * the last one. Files come in key order, memcmp'd like the DB's keys.
+ * Nothing can be added once this has been called, and the key and the sizes
+ * of val are only valid until the next call. */
+const char *fih_next(FileInfoHash *fih, size_t *keylen, FatFileInfo *val);
+/* The last size src reported for the file, or NO_SIZE */
+uint64_t fih_get_size(const FileInfoHash *fih, const FatFileInfo *val, int src);
+/* The most bytes the table, the keys and the sizes took up at once */
+size_t fih_memory(const FileInfoHash *fih);
+/* The number of runs written to disk */
+size_t fih_runs(const FileInfoHash *fih);
 
 #endif
@@ -8,6 +8,7 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <time.h>
+#include <sys/statvfs.h>
 
 #include <mpi.h>
 
@@ -16,11 +17,18 @@
 #include "../common/progress_reporting.h"
 #include "../common/task_processing.h"
 #include "file_info_hash.h"
+#include "placement.h"
+#include "task_schedule.h"
 
 #define MAX_TARGETS MAX_STORAGE_TARGETS
 #define TARGET_BUFFER_SIZE (10*1024*1024)
 #define TARGET_SEND_THRESHOLD (1*1024*1024)
 
+/* DB entries are moved to new holders in slices of at most this many */
+#ifndef DB_MOVE_SLICE
+#define DB_MOVE_SLICE (1000*1000)
+#endif
+
 #define PROF_START(name) \
     struct timespec t_##name##_0; \
     clock_gettime(CLOCK_MONOTONIC, &t_##name##_0)
@@ -51,15 +59,6 @@ int sts_in_use(uint64_t locations)
     return __builtin_popcountll(locations & L_MASK);
 }
 
-static
-unsigned simple_hash(const char *p, int len)
-{
-    unsigned h = 5381;
-    for (int i = 0; i < len; i++)
-        h = h + (h << 5) + p[i];
-    return h;
-}
-
 static
 int eater_rank_from_st(int storage_target)
 {
@@ -74,43 +73,253 @@ int st_from_feeder_rank(int feeder)
 
 /*
  * Combine the two `locations` fields.
- * The P value is only copied over if it isn't present in `dst->locations`
+ * The P and Q values are only copied over if they aren't present in
+ * `dst->locations`
  */
 static void fill_in_missing_fields(FileInfo *dst, const FileInfo *src)
 {
     uint64_t old_P = GET_P(src->locations);
     dst->locations = (dst->locations | src->locations) & L_MASK;
-    if (TEST_BIT(dst->locations, old_P) == 0)
+    if (old_P != NO_P && TEST_BIT(dst->locations, old_P) == 0)
         dst->locations = WITH_P(dst->locations, old_P);
+    else
+        dst->locations = WITH_P(dst->locations, NO_P);
+    if (src->Q != NO_Q && TEST_BIT(dst->locations, src->Q) == 0
+            && src->Q != (uint64_t)GET_P(dst->locations))
+        dst->Q = src->Q;
 }
 
 /*
- * Selecting the P rank is done by hashing the path once and then iteratively
- * hashing the hash result until we can map it to a rank that is not already
- * mentioned in the list of locations.
- * Could be done smarter -- for one there is no guarantee this terminates.
+ * P goes to the target that placement.c picks among the ones not holding a
+ * chunk of the file. The hash of the path only breaks ties.
  */
 static
-void select_P(const char *path, FileInfo *fi, unsigned ntargets)
+void select_P(const char *path, FileInfo *fi, uint64_t size)
 {
-    if (sts_in_use(fi->locations) == (int)ntargets)
+    int P = placement_pick(fi->locations & L_MASK, size, simple_hash(path, strlen(path)));
+    if (P >= 0)
+        fi->locations = WITH_P(fi->locations, (uint64_t)P);
+}
+
+/*
+ * Q is picked the same way, among the targets that hold neither a chunk nor
+ * P. Files that use every target but one only get P.
+ */
+static
+void select_Q(const char *path, FileInfo *fi, uint64_t size, unsigned ntargets)
+{
+    if (GET_P(fi->locations) == NO_P
+            || sts_in_use(fi->locations) + 1 >= (int)ntargets)
         return;
-    unsigned H = simple_hash(path, strlen(path));
-choose_P_again:
-    H = H ^ simple_hash((const char *)&H, sizeof(H));
-    uint64_t P = H % ntargets;
-    if (TEST_BIT(fi->locations, P))
-        goto choose_P_again;
-    fi->locations = WITH_P(fi->locations, P);
+    uint64_t used = (fi->locations & L_MASK) | (1ULL << GET_P(fi->locations));
+    unsigned H = simple_hash(path, strlen(path)) + GET_P(fi->locations);
+    int Q = placement_pick(used, size, H);
+    fi->Q = (Q >= 0)? (uint64_t)Q : NO_Q;
 }
 
 typedef struct {
     int64_t timestamp;
     uint64_t path_len;
     uint64_t event_type;
+    uint64_t size;      /* <- NO_SIZE if the record didn't have it */
+    uint64_t hash;      /* <- simple_hash of the path */
     char path[];
 } packed_file_info;
 
+/*
+ * In phase 2 a file is only sent to the ranks that keep its DB entry, now or
+ * before, see db_holders. It goes as a RoutedTask followed by the chunk sizes
+ * and the terminated path, padded to 8 bytes. Only the ranks involved in the
+ * task run it, the others just update their DB.
+ */
+typedef struct {
+    uint64_t seq;       /* <- Position in the scheduled worklist */
+    uint64_t old_holders;   /* <- db_holders of the previous version, or 0 */
+    FileInfo fi;
+    uint32_t nsizes;    /* <- 0 if the sizes aren't all known */
+    uint32_t path_len;
+} RoutedTask;
+
+static
+size_t routed_task_size(uint32_t nsizes, uint32_t path_len)
+{
+    return (sizeof(RoutedTask) + nsizes*sizeof(uint64_t) + path_len + 1 + 7) & ~(size_t)7;
+}
+
+/*
+ * db_holders depends on the number of targets, so when targets are added the
+ * DB entries move to their new holders before phase 2. Every DB keeps the
+ * number of targets its entries were placed with in the meta entry
+ * "ntargets". An entry is sent on by the eater that coordinated it, as a
+ * MovedEntry followed by the terminated key, padded to 8 bytes.
+ */
+typedef struct {
+    FileInfo fi;
+    uint64_t keylen;
+} MovedEntry;
+
+static
+size_t moved_entry_size(size_t keylen)
+{
+    return (sizeof(MovedEntry) + keylen + 1 + 7) & ~(size_t)7;
+}
+
+/* The entries collect_entry read, and the last key of the previous slice */
+static struct {
+    uint8_t *entries;
+    size_t bytes;
+    size_t alloc;
+    size_t n;
+    size_t last;
+    char *from;
+    size_t fromlen;
+    size_t from_alloc;
+} slice;
+
+static
+int collect_entry(const char *key, size_t keylen, const FileInfo *fi)
+{
+    if (keylen == slice.fromlen && memcmp(key, slice.from, keylen) == 0)
+        return 0;
+    if (slice.n == DB_MOVE_SLICE)
+        return 1;
+    const size_t size = moved_entry_size(keylen);
+    if (slice.bytes + size > slice.alloc) {
+        slice.alloc = MAX(slice.bytes + size, 2*slice.alloc);
+        slice.entries = realloc(slice.entries, slice.alloc);
+    }
+    MovedEntry *m = (MovedEntry *)(slice.entries + slice.bytes);
+    *m = (MovedEntry){ *fi, keylen };
+    memcpy(m + 1, key, keylen + 1);
+    slice.last = slice.bytes;
+    slice.bytes += size;
+    slice.n += 1;
+    return 0;
+}
+
+/* Moves the entries placed with `placed_with` targets to their holders with
+ * ntargets. Every rank of comm calls it, my_st is -1 on the coordinator. */
+static
+void move_db_entries(PersistentDB *pdb, MPI_Comm comm, MPI_Datatype word,
+        int placed_with, int ntargets, int my_st, const int st2comm[])
+{
+    int comm_size;
+    MPI_Comm_size(comm, &comm_size);
+    uint8_t *out = NULL;
+    size_t out_alloc = 0;
+    uint8_t *in = NULL;
+    size_t in_alloc = 0;
+    slice.fromlen = 0;
+    int more = 1;
+    while (more)
+    {
+        slice.bytes = 0;
+        slice.n = 0;
+        if (my_st >= 0 && placed_with != ntargets)
+            pdb_iterate_from(pdb, slice.fromlen > 0? slice.from : "", slice.fromlen,
+                    collect_entry);
+
+        /* The first pass counts the words for each rank, the second fills
+         * them in */
+        int out_words[MAX_TARGETS + 1] = {0};
+        int out_displs[MAX_TARGETS + 1] = {0};
+        for (int pass = 0; pass < 2; pass++) {
+            size_t fill[MAX_TARGETS + 1] = {0};
+            if (pass == 1) {
+                size_t total = 0;
+                for (int r = 0; r < comm_size; r++) {
+                    out_displs[r] = total;
+                    fill[r] = 8*total;
+                    total += out_words[r];
+                }
+                if (8*total > out_alloc) {
+                    out_alloc = MAX(8*total, 2*out_alloc);
+                    out = realloc(out, out_alloc);
+                }
+            }
+            for (size_t off = 0; off < slice.bytes;) {
+                const MovedEntry *m = (const MovedEntry *)(slice.entries + off);
+                const char *key = (const char *)(m + 1);
+                const size_t size = moved_entry_size(m->keylen);
+                off += size;
+                if (simple_hash(key, m->keylen) % placed_with != (unsigned)my_st)
+                    continue;
+                const uint64_t to = db_holders(key, m->keylen, &m->fi, ntargets)
+                    & ~db_holders(key, m->keylen, &m->fi, placed_with);
+                for (int st = 0; st < ntargets; st++) {
+                    if (!TEST_BIT(to, st))
+                        continue;
+                    const int r = st2comm[st];
+                    if (pass == 0) {
+                        out_words[r] += size/8;
+                        continue;
+                    }
+                    memcpy(out + fill[r], m, size);
+                    fill[r] += size;
+                }
+            }
+        }
+        int in_words[MAX_TARGETS + 1] = {0};
+        int in_displs[MAX_TARGETS + 1] = {0};
+        MPI_Alltoall(out_words, 1, MPI_INT, in_words, 1, MPI_INT, comm);
+        size_t in_total = 0;
+        for (int r = 0; r < comm_size; r++) {
+            in_displs[r] = in_total;
+            in_total += in_words[r];
+        }
+        if (8*in_total > in_alloc) {
+            in_alloc = MAX(8*in_total, 2*in_alloc);
+            in = realloc(in, in_alloc);
+        }
+        MPI_Alltoallv(out, out_words, out_displs, word,
+                in, in_words, in_displs, word, comm);
+
+        if (my_st >= 0) {
+            PDBBatch *updates = pdb_batch_begin(pdb);
+            for (size_t off = 0; off < slice.bytes;) {
+                const MovedEntry *m = (const MovedEntry *)(slice.entries + off);
+                const char *key = (const char *)(m + 1);
+                off += moved_entry_size(m->keylen);
+                const uint64_t old = db_holders(key, m->keylen, &m->fi, placed_with);
+                const uint64_t now = db_holders(key, m->keylen, &m->fi, ntargets);
+                if (old == now)
+                    continue;
+                if (TEST_BIT(now, my_st))
+                    pdb_batch_put(updates, key, m->keylen, &m->fi, now, old);
+                else
+                    pdb_batch_del(updates, key, m->keylen, old);
+            }
+            for (size_t off = 0; off < 8*in_total;) {
+                const MovedEntry *m = (const MovedEntry *)(in + off);
+                const char *key = (const char *)(m + 1);
+                off += moved_entry_size(m->keylen);
+                pdb_batch_put(updates, key, m->keylen, &m->fi,
+                        db_holders(key, m->keylen, &m->fi, ntargets), 0);
+            }
+            pdb_batch_commit(updates);
+        }
+
+        /* The next slice starts after the last entry of this one. Entries
+         * received since then are seen again, which changes nothing. */
+        if (slice.n > 0) {
+            const MovedEntry *m = (const MovedEntry *)(slice.entries + slice.last);
+            if (m->keylen + 1 > slice.from_alloc) {
+                slice.from_alloc = MAX(m->keylen + 1, 2*slice.from_alloc);
+                slice.from = realloc(slice.from, slice.from_alloc);
+            }
+            memcpy(slice.from, m + 1, m->keylen + 1);
+            slice.fromlen = m->keylen;
+        }
+        int mine = (slice.n == DB_MOVE_SLICE);
+        MPI_Allreduce(&mine, &more, 1, MPI_INT, MPI_MAX, comm);
+    }
+    free(out);
+    free(in);
+    free(slice.entries);
+    free(slice.from);
+    memset(&slice, 0, sizeof(slice));
+}
+
 static ssize_t  dst_written[MAX_TARGETS] = {0};
 static ssize_t  dst_in_transit[MAX_TARGETS] = {0};
 static MPI_Request async_send_req[MAX_TARGETS] = {0};
@@ -159,7 +368,8 @@ void begin_async_send(int target)
 }
 
 static
-void push_to_target(int target, const char *path, int path_len, int64_t timestamp, uint8_t event_type)
+void push_to_target(int target, const char *path, int path_len, int64_t timestamp, uint8_t event_type,
+        uint64_t size, unsigned hash)
 {
     assert(0 <= target && target < MAX_TARGETS);
     assert(path != NULL);
@@ -178,7 +388,7 @@ void push_to_target(int target, const char *path, int path_len, int64_t timestam
         finish_prev_async_send(target);
     }
 
-    packed_file_info finfo = {timestamp, path_len, event_type};
+    packed_file_info finfo = {timestamp, path_len, event_type, size, hash};
     uint8_t *dst = dst_buffer[target] + written;
     memcpy(dst, &finfo, sizeof(packed_file_info));
     memcpy(dst + sizeof(packed_file_info), path, path_len);
@@ -222,27 +432,29 @@ void feed_targets_with(FILE *input_file, unsigned ntargets)
             int64_t timestamp_secs = ((int64_t *)bufp)[0];
             uint64_t len_of_path = ((uint64_t *)bufp)[1];
             uint64_t event_type = ((uint64_t *)bufp)[2];
-            if (3*sizeof(uint64_t) + len_of_path > buf_alive) {
-                buf_offset = buf_alive;
-                memmove(buf, bufp, buf_alive);
+            /* Size, inode and device follow in records from bp-find-all-chunks */
+            const int with_stat = (event_type & EVENT_WITH_STAT) != 0;
+            const size_t header = (with_stat? 6 : 3)*sizeof(uint64_t);
+            if (header + len_of_path > buf_alive)
                 break;
-            }
-            const char *path = bufp + 3*sizeof(uint64_t);
-            unsigned st = (simple_hash(path, len_of_path)) % ntargets;
+            uint64_t size = with_stat? ((uint64_t *)bufp)[3] : NO_SIZE;
+            const char *path = bufp + header;
+            unsigned hash = simple_hash(path, len_of_path);
             push_to_target(
-                    st,
+                    hash % ntargets,
                     path,
                     len_of_path,
                     timestamp_secs,
-                    event_type);
+                    event_type & ~EVENT_WITH_STAT,
+                    size,
+                    hash);
             counter += 1;
-            bufp += len_of_path + 3*sizeof(uint64_t);
-            buf_alive -= len_of_path + 3*sizeof(uint64_t);
-        }
-        if (3*sizeof(uint64_t) >= buf_alive) {
-            buf_offset = buf_alive;
-            memmove(buf, bufp, buf_alive);
+            bufp += len_of_path + header;
+            buf_alive -= len_of_path + header;
         }
+        /* A partial record is completed by the next read */
+        buf_offset = buf_alive;
+        memmove(buf, bufp, buf_alive);
     }
     send_remaining_data_to_targets();
     /* tell global-coordinator that we are done */
@@ -265,9 +477,16 @@ int main(int argc, char **argv)
 
     PROF_START(total);
 
-    MPI_Init(&argc, &argv);
+    /* Only the main thread makes MPI calls, see task_processing.c */
+    int mpi_thread_support;
+    MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &mpi_thread_support);
     MPI_Comm_rank(MPI_COMM_WORLD, &mpi_rank);
     MPI_Comm_size(MPI_COMM_WORLD, &mpi_world_size);
+    if (mpi_thread_support < MPI_THREAD_FUNNELED) {
+        if (mpi_rank == 0)
+            fprintf(stderr, "The MPI library does not support threads\n");
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
 
     int ntargets = (mpi_world_size - 1)/2;
 
@@ -284,10 +503,17 @@ int main(int argc, char **argv)
         last_run_fd = open(data_file, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
         read(last_run_fd, &last_run, sizeof(RunData));
     }
+    /* What the entries were placed with in DBs without the "ntargets" meta
+     * entry, see move_db_entries */
+    int prev_ntargets = last_run.ntargets;
+    MPI_Bcast(&prev_ntargets, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    if (prev_ntargets <= 0)
+        prev_ntargets = ntargets;
 
     /* Create mapping from storage targets to ranks, and vice versa */
     Target targetIDs[2*MAX_TARGETS] = {{0,0}};
     Target targetID = {0,0};
+    TargetCapacity capacity = {0, 1.0};
     if (mpi_rank != 0)
     {
         int store_fd = open(store_dir, O_DIRECTORY | O_RDONLY);
@@ -295,6 +521,17 @@ int main(int argc, char **argv)
         char targetID_s[20] = {0};
         read(target_ID_fd, targetID_s, sizeof(targetID_s));
         close(target_ID_fd);
+        /* The speed of the target relative to the others, 1 if not given */
+        int weight_fd = openat(store_fd, "parityWeight", O_RDONLY);
+        if (weight_fd >= 0) {
+            char weight_s[20] = {0};
+            read(weight_fd, weight_s, sizeof(weight_s) - 1);
+            capacity.weight = atof(weight_s);
+            close(weight_fd);
+        }
+        struct statvfs vfs;
+        if (fstatvfs(store_fd, &vfs) == 0)
+            capacity.free = (uint64_t)vfs.f_bavail * vfs.f_frsize;
         close(store_fd);
         targetID.id = atoi(targetID_s);
         targetID.rank = mpi_rank;
@@ -320,7 +557,7 @@ int main(int argc, char **argv)
                     last_run.targetIDs[j] = target;
                     break;
                 }
-            if (j + 1 >= last_run.ntargets)
+            if (j == last_run.ntargets)
                 last_run.targetIDs[k++] = target;
         }
         last_run.ntargets = ntargets;
@@ -335,10 +572,19 @@ int main(int argc, char **argv)
     MPI_Bcast(st2rank, sizeof(st2rank), MPI_BYTE, 0, MPI_COMM_WORLD);
     MPI_Bcast(rank2st, sizeof(rank2st), MPI_BYTE, 0, MPI_COMM_WORLD);
 
-    if (mpi_rank == 0) {
-        write(last_run_fd, &last_run, sizeof(RunData));
-        close(last_run_fd);
-    }
+    TargetCapacity rank_capacity[2*MAX_TARGETS+1];
+    MPI_Allgather(
+            &capacity, sizeof(TargetCapacity), MPI_BYTE,
+            rank_capacity, sizeof(TargetCapacity), MPI_BYTE,
+            MPI_COMM_WORLD);
+    TargetCapacity st_capacity[MAX_TARGETS];
+    for (int i = 0; i < ntargets; i++)
+        st_capacity[i] = rank_capacity[st2rank[i]];
+    placement_init(st_capacity, ntargets);
+
+    /* Rewritten with the placement statistics at the end */
+    if (mpi_rank == 0)
+        pwrite(last_run_fd, &last_run, sizeof(RunData), 0);
 
     PROF_END(init);
 
@@ -367,13 +613,15 @@ int main(int argc, char **argv)
 
     PROF_START(phase1);
 
-#ifndef MAX_WORKITEMS
-#define MAX_WORKITEMS (1ULL*1000*1000)
+/* Eaters hand out their worklists in slices of at most this many files */
+#ifndef WORKLIST_SLICE
+#define WORKLIST_SLICE (1000*1000)
+#endif
+/* Run the tasks of a worklist in the order of task_schedule.c */
+#ifndef SCHEDULE_TASKS
+#define SCHEDULE_TASKS 1
 #endif
     FileInfoHash *file_info_hash = NULL;
-    size_t name_bytes_written = 0;
-    const size_t name_bytes_limit = MAX_WORKITEMS*100;
-    char *flat_file_names = malloc(name_bytes_limit);
 
     /*
      * In phase 1 we have 3 kinds of processes:
@@ -442,19 +690,15 @@ int main(int argc, char **argv)
             while (i < actually_received) {
                 packed_file_info *pfi = (packed_file_info *)(recv_buffer+i);
                 i += sizeof(packed_file_info) + pfi->path_len;
-                if (name_bytes_written + pfi->path_len + 1 >= name_bytes_limit)
-                    continue;
                 /*printf("%d - received '%.*s' from %d\n", mpi_rank, (uint32_t)(pfi->path_len), pfi->path, src);*/
-                char *n = flat_file_names + name_bytes_written;
-                memmove(n, pfi->path, pfi->path_len);
-                n[pfi->path_len] = '\0';
-                name_bytes_written += pfi->path_len + 1;
-                if (fih_add_info(file_info_hash,
-                        n,
+                fih_add_info(file_info_hash,
+                        pfi->path,
+                        pfi->path_len,
+                        pfi->hash,
                         st_from_feeder_rank(src),
                         pfi->timestamp,
-                        (pfi->event_type == UNLINK_EVENT)))
-                    name_bytes_written -= pfi->path_len + 1;
+                        (pfi->event_type == UNLINK_EVENT),
+                        pfi->size);
             }
         }
     }
@@ -463,17 +707,55 @@ int main(int argc, char **argv)
         MPI_Finalize();
         return 0;
     }
+    /* Phase 2 messages must not reach an eater that is still receiving phase
+     * 1 data from MPI_ANY_SOURCE */
+    MPI_Barrier(comm);
 
     PROF_END(phase1);
 
+    uint64_t index_stats[2] = { 0, 0 };
+    if (file_info_hash != NULL) {
+        index_stats[0] = fih_memory(file_info_hash);
+        index_stats[1] = fih_runs(file_info_hash);
+    }
+    uint64_t max_index_stats[2] = { 0, 0 };
+    MPI_Reduce(index_stats, max_index_stats, 2, MPI_UINT64_T, MPI_MAX, 0, comm);
+
     PROF_START(load_db);
     PersistentDB *pdb = pdb_init();
+    uint32_t placed_with = prev_ntargets;
+    int knew_placement = 0;
+    if (mpi_rank != 0) {
+        knew_placement = pdb_get_meta(pdb, "ntargets", &placed_with, sizeof(placed_with));
+        pdb_index_init(pdb, placed_with);
+    }
     PROF_END(load_db);
 
     PROF_START(phase2);
 
-    FileInfo *worklist_info = malloc(MAX_WORKITEMS*sizeof(FileInfo));
-    char *worklist_keys = malloc(name_bytes_limit);
+    /* The slice of the worklist, only on the eater that owns it */
+    FileInfo *worklist_info = NULL;
+    size_t items_alloc = 0;
+    char *worklist_keys = NULL;
+    size_t keys_alloc = 0;
+    /* The chunk sizes of every item, in locations order, see TaskInfo */
+    uint64_t *worklist_sizes = NULL;
+    size_t sizes_alloc = 0;
+    /* Where the key and the sizes of every item start */
+    size_t *worklist_key_at = NULL;
+    size_t *worklist_sizes_at = NULL;
+    /* The targets that kept the previous version of every item */
+    uint64_t *worklist_old_holders = NULL;
+    SchedTask *worklist_order = NULL;
+    /* The RoutedTasks for every rank of comm, and the ones sent to us. They
+     * are counted in 8 byte words, so MPI's int counts go further. */
+    uint8_t *routed = NULL;
+    size_t routed_alloc = 0;
+    uint8_t *my_tasks = NULL;
+    size_t my_tasks_alloc = 0;
+    MPI_Datatype word;
+    MPI_Type_contiguous(8, MPI_BYTE, &word);
+    MPI_Type_commit(&word);
 
     int mpi_bcast_rank;
     MPI_Comm_rank(comm, &mpi_bcast_rank);
@@ -481,6 +763,22 @@ int main(int argc, char **argv)
     MPI_Comm_size(comm, &mpi_bcast_size);
     int my_st = rank2st[mpi_rank];
 
+    int st2comm[MAX_TARGETS];
+    MPI_Group comm_group;
+    MPI_Comm_group(comm, &comm_group);
+    MPI_Group_translate_ranks(everyone, ntargets, st2rank, comm_group, st2comm);
+    MPI_Group_free(&comm_group);
+
+    int moved = (mpi_rank != 0 && placed_with != (uint32_t)ntargets);
+    int any_moved;
+    MPI_Allreduce(&moved, &any_moved, 1, MPI_INT, MPI_MAX, comm);
+    if (any_moved)
+        move_db_entries(pdb, comm, word, placed_with, ntargets, my_st, st2comm);
+    if (mpi_rank != 0 && (moved || !knew_placement)) {
+        uint32_t n = ntargets;
+        pdb_set_meta(pdb, "ntargets", &n, sizeof(n));
+    }
+
     ProgressSender pr_sender;
     memset(&pr_sender, 0, sizeof(pr_sender));
     ProgressSample pr_sample = PROGRESS_SAMPLE_INIT;
@@ -488,96 +786,259 @@ int main(int argc, char **argv)
     memset(&hs, 0, sizeof(hs));
     hs.storage_target = my_st;
     hs.sample = &pr_sample;
+    hs.batch_tasks = 1;
+    hs.pdb = pdb;
 
     for (int i = 1; i < mpi_bcast_size; i++)
     {
-        size_t nitems = 0;
-        size_t path_bytes = 0;
-        if (mpi_bcast_rank == i)
+        /* The worklist of eater i, a slice at a time */
+        int more = 1;
+        while (more)
         {
-            /*
-             * Collect all file info entries in to a packed array that is ready for
-             * broadcasting.
-             * */
-            const char *s = flat_file_names;
-            while (s < flat_file_names + name_bytes_written && *s != '\0')
+            size_t nitems = 0;
+            size_t path_bytes = 0;
+            int routed_words[MAX_TARGETS + 1] = {0};
+            int routed_displs[MAX_TARGETS + 1] = {0};
+            int my_words = 0;
+            if (mpi_bcast_rank == i)
             {
-                size_t s_len = strlen(s);
-                FileInfo prev_fi;
+                /*
+                 * Collect all file info entries in to a packed array that is ready for
+                 * broadcasting.
+                 * */
+                if (items_alloc < WORKLIST_SLICE) {
+                    items_alloc = WORKLIST_SLICE;
+                    worklist_info = realloc(worklist_info, items_alloc*sizeof(FileInfo));
+                    worklist_key_at = realloc(worklist_key_at, items_alloc*sizeof(size_t));
+                    worklist_sizes_at = realloc(worklist_sizes_at, items_alloc*sizeof(size_t));
+                    worklist_old_holders = realloc(worklist_old_holders, items_alloc*sizeof(uint64_t));
+                    worklist_order = realloc(worklist_order, items_alloc*sizeof(SchedTask));
+                }
+                size_t nsizes = 0;
+                const char *s;
+                size_t s_len;
                 FatFileInfo new_fi;
-                FileInfo *fi = worklist_info + nitems;
-                fih_get(file_info_hash, s, &new_fi);
-                fi->timestamp = new_fi.timestamp;
-                fi->locations = WITH_P(new_fi.modified, NO_P);
-                int has_an_old_version = pdb_get(pdb, s, s_len, &prev_fi);
-                if (has_an_old_version)
-                    fill_in_missing_fields(fi, &prev_fi);
-                fi->locations &= ~new_fi.deleted;
-                if (GET_P(fi->locations) == NO_P)
-                    select_P(s, fi, (unsigned)ntargets);
-                s += s_len + 1;
-                nitems += 1;
+                /* The keys come sorted, so the previous versions are read in
+                 * one pass over the DB */
+                PDBCursor *prev_cursor = pdb_cursor_open(pdb);
+                while (nitems < WORKLIST_SLICE
+                        && (s = fih_next(file_info_hash, &s_len, &new_fi)) != NULL)
+                {
+                    const size_t j = nitems;
+                    FileInfo prev_fi;
+                    FileInfo *fi = worklist_info + j;
+                    fi->timestamp = new_fi.timestamp;
+                    fi->locations = WITH_P(new_fi.modified, NO_P);
+                    fi->Q = NO_Q;
+                    int has_an_old_version = pdb_cursor_get(prev_cursor, s, s_len, &prev_fi);
+                    worklist_old_holders[j] = 0;
+                    if (has_an_old_version) {
+                        fill_in_missing_fields(fi, &prev_fi);
+                        worklist_old_holders[j] = db_holders(s, s_len, &prev_fi, ntargets);
+                    }
+                    fi->locations &= ~new_fi.deleted;
+
+                    /* The sizes are only of use if every chunk reported its size,
+                     * otherwise the first one is NO_SIZE */
+                    const int nsrc = sts_in_use(fi->locations);
+                    if (nsizes + nsrc > sizes_alloc) {
+                        sizes_alloc = MAX(nsizes + nsrc, 2*sizes_alloc);
+                        worklist_sizes = realloc(worklist_sizes, sizes_alloc*sizeof(uint64_t));
+                    }
+                    uint64_t *sizes = worklist_sizes + nsizes;
+                    uint64_t max_cs = 0;
+                    for (int st = 0, k = 0; st < MAX_STORAGE_TARGETS; st++)
+                        if (TEST_BIT(fi->locations & L_MASK, st)) {
+                            sizes[k] = fih_get_size(file_info_hash, &new_fi, st);
+                            max_cs = MAX(max_cs, sizes[k]);
+                            k += 1;
+                        }
+                    if (nsrc > 0 && max_cs == NO_SIZE)
+                        sizes[0] = NO_SIZE;
+
+                    if (GET_P(fi->locations) == NO_P)
+                        fi->Q = NO_Q;
+                    /* Parity that stays where it is still counts for placement.
+                     * A file with no chunks left gets no new parity. */
+                    if (nsrc > 0) {
+                        if (GET_P(fi->locations) == NO_P)
+                            select_P(s, fi, max_cs);
+                        else
+                            placement_add(GET_P(fi->locations), max_cs);
+                        if (fi->Q == NO_Q)
+                            select_Q(s, fi, max_cs, (unsigned)ntargets);
+                        else
+                            placement_add(fi->Q, max_cs);
+                    }
+
+                    if (path_bytes + s_len + 1 > keys_alloc) {
+                        keys_alloc = MAX(path_bytes + s_len + 1, 2*keys_alloc);
+                        worklist_keys = realloc(worklist_keys, keys_alloc);
+                    }
+                    memcpy(worklist_keys + path_bytes, s, s_len + 1);
+                    worklist_key_at[j] = path_bytes;
+                    worklist_sizes_at[j] = nsizes;
+                    worklist_order[j] = (SchedTask){ involved_sts(fi), max_cs, 0, j };
+                    path_bytes += s_len + 1;
+                    nsizes += nsrc;
+                    nitems += 1;
+                }
+                pdb_cursor_close(prev_cursor);
+                more = (nitems == WORKLIST_SLICE);
+                if (!more) {
+                    fih_term(file_info_hash);
+                    file_info_hash = NULL;
+                }
+    #if SCHEDULE_TASKS
+                schedule_tasks(worklist_order, nitems);
+    #endif
+
+                /*
+                 * Route every file, in the scheduled order, to the ranks that
+                 * keep its DB entry now or did before. The first pass counts the
+                 * words for each rank, the second fills them in.
+                 * */
+                for (int pass = 0; pass < 2; pass++) {
+                    size_t fill[MAX_TARGETS + 1] = {0};
+                    if (pass == 1) {
+                        size_t total = 0;
+                        for (int r = 0; r < mpi_bcast_size; r++) {
+                            routed_displs[r] = total;
+                            fill[r] = 8*total;
+                            total += routed_words[r];
+                        }
+                        if (8*total > routed_alloc) {
+                            routed_alloc = MAX(8*total, 2*routed_alloc);
+                            routed = realloc(routed, routed_alloc);
+                        }
+                    }
+                    for (size_t o = 0; o < nitems; o++) {
+                        const size_t j = worklist_order[o].item;
+                        const FileInfo *fi = worklist_info + j;
+                        const char *key = worklist_keys + worklist_key_at[j];
+                        const uint64_t *sizes = worklist_sizes + worklist_sizes_at[j];
+                        const uint32_t key_len = strlen(key);
+                        const uint32_t nsrc = sts_in_use(fi->locations);
+                        const uint32_t known = (nsrc > 0 && sizes[0] != NO_SIZE)? nsrc : 0;
+                        const uint64_t involved = involved_sts(fi);
+                        const uint64_t sts = db_holders(key, key_len, fi, ntargets)
+                            | worklist_old_holders[j];
+                        for (int st = 0; st < ntargets; st++) {
+                            if (!TEST_BIT(sts, st))
+                                continue;
+                            /* The sizes are of no use to a rank without a task */
+                            const uint32_t n = TEST_BIT(involved, st)? known : 0;
+                            const size_t size = routed_task_size(n, key_len);
+                            const int r = st2comm[st];
+                            if (pass == 0) {
+                                routed_words[r] += size/8;
+                                continue;
+                            }
+                            RoutedTask *rt = (RoutedTask *)(routed + fill[r]);
+                            *rt = (RoutedTask){ o, worklist_old_holders[j], *fi, n, key_len };
+                            uint8_t *p = (uint8_t *)(rt + 1);
+                            memcpy(p, sizes, n*sizeof(uint64_t));
+                            memcpy(p + n*sizeof(uint64_t), key, key_len + 1);
+                            fill[r] += size;
+                        }
+                    }
+                }
             }
-            path_bytes = name_bytes_written;
-            memcpy(worklist_keys, flat_file_names, path_bytes);
-            fih_term(file_info_hash);
-            file_info_hash = NULL;
-        }
-        MPI_Bcast(&nitems, sizeof(nitems), MPI_BYTE, i, comm);
-        MPI_Bcast(worklist_info, sizeof(FileInfo)*nitems, MPI_BYTE, i, comm);
-        MPI_Bcast(&path_bytes, sizeof(path_bytes), MPI_BYTE, i, comm);
-        MPI_Bcast(worklist_keys, path_bytes, MPI_BYTE, i, comm);
-
-        if (nitems == 0)
-            continue;
-
-        if (mpi_rank == 0) {
-            printf("\n==== begin iteration with %zu files ====\n", nitems);
-            printf("st - total files   | data read     | data written  | disk I/O\n");
-            pr_receive_loop(mpi_bcast_size-1);
-            continue;
-        }
+            MPI_Bcast(&more, 1, MPI_INT, i, comm);
+            MPI_Bcast(&nitems, sizeof(nitems), MPI_BYTE, i, comm);
+            MPI_Scatter(routed_words, 1, MPI_INT, &my_words, 1, MPI_INT, i, comm);
+            if (8*(size_t)my_words > my_tasks_alloc) {
+                my_tasks_alloc = MAX(8*(size_t)my_words, 2*my_tasks_alloc);
+                my_tasks = realloc(my_tasks, my_tasks_alloc);
+            }
+            MPI_Scatterv(routed, routed_words, routed_displs, word,
+                    my_tasks, my_words, word, i, comm);
 
-        TaskInfo ti = { "", "         parity", 0, -1 };
-        size_t j = 0;
-        const char *s = worklist_keys;
-        while (j < nitems)
-        {
+            if (nitems == 0)
+                continue;
+
+            if (mpi_rank == 0) {
+                printf("\n==== begin iteration with %zu files ====\n", nitems);
+                pr_receive_loop(mpi_bcast_size-1, direct_writes());
+                continue;
+            }
+
+            /* Written while the tasks run, nothing reads these keys before
+             * the next slice */
+            PDBBatch *updates = pdb_batch_begin(pdb);
+            TaskInfo ti = { "", "         parity", 0, -1, -1, 0, 0, NULL };
+            size_t offset = 0;
+            while (offset < 8*(size_t)my_words)
+            {
+                struct timespec tv1;
+                clock_gettime(CLOCK_MONOTONIC, &tv1);
+                const RoutedTask *rt = (const RoutedTask *)(my_tasks + offset);
+                const uint64_t *sizes = (const uint64_t *)(rt + 1);
+                const char *path = (const char *)(sizes + rt->nsizes);
+                offset += routed_task_size(rt->nsizes, rt->path_len);
+                const uint64_t holders = (rt->fi.locations & L_MASK)?
+                    db_holders(path, rt->path_len, &rt->fi, ntargets) : 0;
+                if (TEST_BIT(holders, my_st))
+                    pdb_batch_put(updates, path, rt->path_len, &rt->fi, holders, rt->old_holders);
+                else
+                    pdb_batch_del(updates, path, rt->path_len, rt->old_holders);
+                if (!TEST_BIT(involved_sts(&rt->fi), my_st))
+                    continue;
+                ti.chunk_sizes = (rt->nsizes > 0)? sizes : NULL;
+                hs.task_seq = rt->seq;
+                int report = process_task(&hs, path, &rt->fi, ti);
+                struct timespec tv2;
+                clock_gettime(CLOCK_MONOTONIC, &tv2);
+                double dt = (tv2.tv_sec - tv1.tv_sec) * 1.0
+                    + (tv2.tv_nsec - tv1.tv_nsec) * 1e-9;
+                if (report) {
+                    pr_sample.dt += dt;
+                    pr_sample.nfiles += 1;
+                }
+                if (pr_sample.dt >= 1.0) {
+                    pr_add_tmp_to_total(&pr_sample);
+                    pr_report_progress(&pr_sender, pr_sample);
+                    pr_clear_tmp(&pr_sample);
+                }
+            }
             struct timespec tv1;
             clock_gettime(CLOCK_MONOTONIC, &tv1);
-            size_t s_len = strlen(s);
-            int report = process_task(&hs, s, worklist_info + j, ti);
-            if (worklist_info[j].locations & L_MASK)
-                pdb_set(pdb, s, s_len, worklist_info + j);
-            else
-                pdb_del(pdb, s, s_len);
-            s += s_len + 1;
-            j += 1;
+            process_task_flush(&hs);
+            pdb_batch_commit(updates);
             struct timespec tv2;
             clock_gettime(CLOCK_MONOTONIC, &tv2);
-            double dt = (tv2.tv_sec - tv1.tv_sec) * 1.0
+            pr_sample.dt += (tv2.tv_sec - tv1.tv_sec) * 1.0
                 + (tv2.tv_nsec - tv1.tv_nsec) * 1e-9;
-            if (report) {
-                pr_sample.dt += dt;
-                pr_sample.nfiles += 1;
-            }
-            if (pr_sample.dt >= 1.0) {
-                pr_add_tmp_to_total(&pr_sample);
-                pr_report_progress(&pr_sender, pr_sample);
-                pr_clear_tmp(&pr_sample);
-            }
+            pr_add_tmp_to_total(&pr_sample);
+            pr_report_progress(&pr_sender, pr_sample);
+            pr_clear_tmp(&pr_sample);
+            pr_report_done(&pr_sender);
         }
-        pr_add_tmp_to_total(&pr_sample);
-        pr_report_progress(&pr_sender, pr_sample);
-        pr_clear_tmp(&pr_sample);
-        pr_report_done(&pr_sender);
     }
 
     pdb_term(pdb);
     pdb = NULL;
-    free(flat_file_names);
     free(worklist_info);
     free(worklist_keys);
+    free(worklist_sizes);
+    free(routed);
+    free(my_tasks);
+    free(worklist_key_at);
+    free(worklist_sizes_at);
+    free(worklist_old_holders);
+    free(worklist_order);
+    MPI_Type_free(&word);
+
+    /* Each eater placed the parity of its own files */
+    uint64_t placed_files[MAX_STORAGE_TARGETS];
+    uint64_t placed_bytes[MAX_STORAGE_TARGETS];
+    placement_stats(placed_files, placed_bytes);
+    MPI_Reduce(placed_files, last_run.placed_files, MAX_STORAGE_TARGETS, MPI_UINT64_T, MPI_SUM, 0, comm);
+    MPI_Reduce(placed_bytes, last_run.placed_bytes, MAX_STORAGE_TARGETS, MPI_UINT64_T, MPI_SUM, 0, comm);
+    if (mpi_rank == 0) {
+        pwrite(last_run_fd, &last_run, sizeof(RunData), 0);
+        close(last_run_fd);
+    }
 
     PROF_END(phase2);
     PROF_END(total);
@@ -586,6 +1047,8 @@ int main(int argc, char **argv)
         printf("Overall timings: \n");
         printf("init    | %9.2f ms\n", 1e3*PROF_VAL(init));
         printf("phase1  | %9.2f ms\n", 1e3*PROF_VAL(phase1));
+        printf("index   | %9.2f MiB, %" PRIu64 " runs on disk (most on one eater)\n",
+                max_index_stats[0]/(1024.0*1024.0), max_index_stats[1]);
         printf("load_db | %9.2f ms\n", 1e3*PROF_VAL(load_db));
         printf("phase2  | %9.2f ms\n", 1e3*PROF_VAL(phase2));
         printf("total   | %9.2f ms\n", 1e3*PROF_VAL(total));
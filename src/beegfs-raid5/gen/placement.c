@@ -0,0 +1,79 @@
+#include <math.h>
+#include <string.h>
+
+#include "placement.h"
+
+/* Assumed size of a parity block when phase 1 didn't find it */
+#ifndef PLACEMENT_UNKNOWN_SIZE
+#define PLACEMENT_UNKNOWN_SIZE (1024*1024)
+#endif
+
+static int ntargets;
+static TargetCapacity caps[MAX_STORAGE_TARGETS];
+static uint64_t placed_files[MAX_STORAGE_TARGETS];
+static uint64_t placed_bytes[MAX_STORAGE_TARGETS];
+
+void placement_init(const TargetCapacity *c, int n)
+{
+    ntargets = n;
+    memcpy(caps, c, n*sizeof(TargetCapacity));
+    memset(placed_files, 0, sizeof(placed_files));
+    memset(placed_bytes, 0, sizeof(placed_bytes));
+}
+
+static
+uint64_t block_size(uint64_t size)
+{
+    return size == NO_SIZE? PLACEMENT_UNKNOWN_SIZE : size;
+}
+
+/*
+ * The fraction of the free space of the target that parity placed this run
+ * would take up with the block added, scaled down for faster targets. Targets
+ * without free space or weight are only picked when nothing else is left.
+ */
+static
+double score(int st, uint64_t size)
+{
+    const TargetCapacity *c = &caps[st];
+    if (c->free == 0 || c->weight <= 0)
+        return INFINITY;
+    return (placed_bytes[st] + size) / (c->weight * c->free);
+}
+
+/*
+ * Looks at each target at most once, starting from `hash`. This is a linear
+ * scan rather than O(1): there are at most MAX_STORAGE_TARGETS, and the best
+ * one depends on the size of the block and on which targets are used.
+ */
+int placement_pick(uint64_t used, uint64_t size, unsigned hash)
+{
+    size = block_size(size);
+    int best = -1;
+    double best_score = INFINITY;
+    for (int i = 0; i < ntargets; i++) {
+        int st = (hash + i) % ntargets;
+        if (TEST_BIT(used, st))
+            continue;
+        double s = score(st, size);
+        if (best < 0 || s < best_score) {
+            best = st;
+            best_score = s;
+        }
+    }
+    if (best >= 0)
+        placement_add(best, size);
+    return best;
+}
+
+void placement_add(int st, uint64_t size)
+{
+    placed_files[st] += 1;
+    placed_bytes[st] += block_size(size);
+}
+
+void placement_stats(uint64_t files[MAX_STORAGE_TARGETS], uint64_t bytes[MAX_STORAGE_TARGETS])
+{
+    memcpy(files, placed_files, sizeof(placed_files));
+    memcpy(bytes, placed_bytes, sizeof(placed_bytes));
+}
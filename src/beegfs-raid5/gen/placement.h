@@ -0,0 +1,26 @@
+#ifndef __PLACEMENT__
+#define __PLACEMENT__
+
+#include <stdint.h>
+
+#include "../common/common.h"
+
+typedef struct {
+    uint64_t free;      /* <- Bytes available on the target */
+    double weight;      /* <- Relative speed, 0 to only use it as a last resort */
+} TargetCapacity;
+
+void placement_init(const TargetCapacity *caps, int ntargets);
+
+/* Picks the target for a parity block of `size` bytes (NO_SIZE if unknown)
+ * among those not in `used`, and counts the block there. `hash` breaks ties.
+ * Returns -1 if every target is used. */
+int placement_pick(uint64_t used, uint64_t size, unsigned hash);
+
+/* Counts a block that stays where it was placed by an earlier run */
+void placement_add(int st, uint64_t size);
+
+/* The files and bytes counted on each target so far */
+void placement_stats(uint64_t files[MAX_STORAGE_TARGETS], uint64_t bytes[MAX_STORAGE_TARGETS]);
+
+#endif
@@ -0,0 +1,63 @@
+#include <stdlib.h>
+
+#include "task_schedule.h"
+
+/* The cost of a task, on top of its size, in bytes */
+#ifndef SCHED_TASK_COST
+#define SCHED_TASK_COST (256*1024)
+#endif
+
+/* Assumed size of a task when phase 1 didn't find it */
+#ifndef SCHED_UNKNOWN_SIZE
+#define SCHED_UNKNOWN_SIZE (1024*1024)
+#endif
+
+static
+uint64_t task_cost(const SchedTask *t)
+{
+    return SCHED_TASK_COST + (t->size == NO_SIZE? SCHED_UNKNOWN_SIZE : t->size);
+}
+
+/* Largest first, ties in worklist order */
+static
+int by_cost(const void *a, const void *b)
+{
+    const SchedTask *x = a, *y = b;
+    uint64_t cx = task_cost(x), cy = task_cost(y);
+    if (cx != cy)
+        return cx > cy? -1 : 1;
+    return (x->item > y->item) - (x->item < y->item);
+}
+
+static
+int by_start(const void *a, const void *b)
+{
+    const SchedTask *x = a, *y = b;
+    if (x->start != y->start)
+        return x->start < y->start? -1 : 1;
+    return (x->item > y->item) - (x->item < y->item);
+}
+
+/*
+ * Greedy list scheduling: taking the largest tasks first, each task starts
+ * when the last of its targets is done with the tasks placed before it. Tasks
+ * that overlap in time then never share a target, and every group of tasks
+ * with the same start is a round of pairwise disjoint target sets.
+ *
+ * The ranks don't wait for rounds, they just run their tasks in this order.
+ */
+void schedule_tasks(SchedTask *tasks, size_t ntasks)
+{
+    uint64_t free_at[MAX_STORAGE_TARGETS] = {0};
+    qsort(tasks, ntasks, sizeof(SchedTask), by_cost);
+    for (size_t i = 0; i < ntasks; i++) {
+        SchedTask *t = tasks + i;
+        uint64_t start = 0;
+        for (uint64_t sts = t->sts; sts != 0; sts &= sts - 1)
+            start = MAX(start, free_at[__builtin_ctzll(sts)]);
+        t->start = start;
+        for (uint64_t sts = t->sts; sts != 0; sts &= sts - 1)
+            free_at[__builtin_ctzll(sts)] = start + task_cost(t);
+    }
+    qsort(tasks, ntasks, sizeof(SchedTask), by_start);
+}
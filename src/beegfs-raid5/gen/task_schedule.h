@@ -0,0 +1,21 @@
+#ifndef __TASK_SCHEDULE__
+#define __TASK_SCHEDULE__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "../common/common.h"
+
+typedef struct {
+    uint64_t sts;       /* <- Every target involved in the task */
+    uint64_t size;      /* <- Of the parity, NO_SIZE if unknown */
+    uint64_t start;     /* <- Set by schedule_tasks */
+    size_t item;        /* <- Position in the worklist */
+} SchedTask;
+
+/* Puts the tasks in the order they should be run in. Tasks next to each
+ * other mostly have disjoint targets, so the ranks can run them at the same
+ * time. */
+void schedule_tasks(SchedTask *tasks, size_t ntasks);
+
+#endif
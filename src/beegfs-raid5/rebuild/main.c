@@ -26,8 +26,9 @@
     ((t_##name##_1.tv_sec - t_##name##_0.tv_sec) * 1.0 \
     + (t_##name##_1.tv_nsec - t_##name##_0.tv_nsec) * 1e-9)
 
-static int rebuild_target;
-static int helper;
+static int lost_targets[2] = { -1, -1 };
+static int nlost;
+static int ntargets;
 static int mpi_rank;
 static int mpi_world_size;
 int st2rank[MAX_STORAGE_TARGETS];
@@ -37,7 +38,108 @@ static ProgressSender pr_sender;
 static ProgressSample pr_sample = PROGRESS_SAMPLE_INIT;
 static HostState hs;
 
+static
+int is_lost(int st)
+{
+    return st >= 0 && (st == lost_targets[0] || st == lost_targets[1]);
+}
+
+/*
+ * The lost targets lost their DB too. Every other target that keeps the entry
+ * of a file has it, see db_holders, and the first one of them sends it on to
+ * the lost targets that kept it. Each target sends a ForwardedFile followed by
+ * the terminated key, padded to 8 bytes, for every such file in key order.
+ */
+typedef struct {
+    FileInfo fi;
+    uint64_t keylen;
+} ForwardedFile;
+
+static uint8_t *forward[2];
+static size_t forward_bytes[2];
+static size_t forward_alloc[2];
+
+static
+size_t forwarded_size(size_t keylen)
+{
+    return (sizeof(ForwardedFile) + keylen + 1 + 7) & ~(size_t)7;
+}
+
+/* The first target that kept the entry of the file and is still there */
+static
+int first_holder(const char *key, size_t keylen, const FileInfo *fi)
+{
+    const uint64_t holders = db_holders(key, keylen, fi, ntargets);
+    int st = 0;
+    while (st < ntargets && (!TEST_BIT(holders, st) || is_lost(st)))
+        st += 1;
+    return st;
+}
+
+int collect_file(const char *key, size_t keylen, const FileInfo *fi)
+{
+    if (first_holder(key, keylen, fi) != rank2st[mpi_rank])
+        return 0;
+    const uint64_t holders = db_holders(key, keylen, fi, ntargets);
+    for (int i = 0; i < nlost; i++) {
+        if (!TEST_BIT(holders, lost_targets[i]))
+            continue;
+        const size_t size = forwarded_size(keylen);
+        if (forward_bytes[i] + size > forward_alloc[i]) {
+            forward_alloc[i] = MAX(forward_bytes[i] + size, 2*forward_alloc[i]);
+            forward[i] = realloc(forward[i], forward_alloc[i]);
+        }
+        ForwardedFile *ff = (ForwardedFile *)(forward[i] + forward_bytes[i]);
+        memset(ff, 0, size);
+        ff->fi = *fi;
+        ff->keylen = keylen;
+        memcpy(ff + 1, key, keylen);
+        forward_bytes[i] += size;
+    }
+    return 0;
+}
+
+/* MPI counts are ints, so large buffers are sent in parts */
+static
+void send_bytes(const void *buf, uint64_t bytes, int dst)
+{
+    const size_t part = 1 << 30;
+    MPI_Send(&bytes, sizeof(bytes), MPI_BYTE, dst, 0, MPI_COMM_WORLD);
+    for (size_t offset = 0; offset < bytes; offset += part)
+        MPI_Send((const uint8_t *)buf + offset, MIN(part, bytes - offset), MPI_BYTE, dst, 0, MPI_COMM_WORLD);
+}
 
+static
+uint8_t *recv_bytes(uint8_t *buf, uint64_t *bytes, int src)
+{
+    const size_t part = 1 << 30;
+    MPI_Recv(bytes, sizeof(*bytes), MPI_BYTE, src, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+    buf = realloc(buf, *bytes);
+    for (size_t offset = 0; offset < *bytes; offset += part)
+        MPI_Recv(buf + offset, MIN(part, *bytes - offset), MPI_BYTE, src, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+    return buf;
+}
+
+static
+int by_key(const void *a, const void *b)
+{
+    const ForwardedFile *x = *(const ForwardedFile **)a;
+    const ForwardedFile *y = *(const ForwardedFile **)b;
+    int c = memcmp(x + 1, y + 1, MIN(x->keylen, y->keylen));
+    if (c != 0)
+        return c;
+    return (x->keylen > y->keylen) - (x->keylen < y->keylen);
+}
+
+/*
+ * A file is rebuilt in up to two tasks. First the lost chunks are
+ * reconstructed by the (first) lost target, using P, Q or both:
+ *  - one lost chunk, P alive: XOR of the other chunks and P
+ *  - one lost chunk, P lost:  solved from the other chunks and Q
+ *  - two lost chunks:         solved from the other chunks, P and Q. The
+ *                             second chunk is sent on to its target.
+ * Then, if P or Q was lost, both are generated again from the chunks.
+ */
 int do_file(const char *key, size_t keylen, const FileInfo *fi)
 {
     struct timespec tv1;
@@ -45,47 +147,53 @@ int do_file(const char *key, size_t keylen, const FileInfo *fi)
 
     int my_st = rank2st[mpi_rank];
     int P = GET_P(fi->locations);
-    if (P == NO_P
-            || P == rebuild_target
-            || TEST_BIT(fi->locations, rebuild_target) == 0)
+    int Q = (fi->Q == NO_Q)? -1 : (int)fi->Q;
+    uint64_t L = fi->locations & L_MASK;
+    uint64_t lost_data = 0;
+    for (int i = 0; i < nlost; i++)
+        if (TEST_BIT(L, lost_targets[i]))
+            lost_data |= 1ULL << lost_targets[i];
+    int lost_P = is_lost(P);
+    int lost_Q = is_lost(Q);
+    if (P == NO_P || (lost_data == 0 && !lost_P && !lost_Q))
         return 0;
 
     hs.storage_target = my_st;
     hs.sample = &pr_sample;
 
-    if (helper == my_st) {
-        /* Send fi, key to rebuild_target so it knows whats up */
-        MPI_Ssend((void*)fi, sizeof(FileInfo), MPI_BYTE, st2rank[rebuild_target], 0, MPI_COMM_WORLD);
-        MPI_Ssend((void*)key, keylen, MPI_BYTE, st2rank[rebuild_target], 0, MPI_COMM_WORLD);
-    }
-    /* The rank that holds the P block needs read from parity in stead of
-     * chunks, and the rebuild target has to write to chunks rather than
-     * parity. If the rebuild target had the original P block, we don't want to
-     * switch - we just want to recalculate it. */
-    const char *load_pat = "         chunks";
-    const char *save_pat = "         parity";
-    if ((P != rebuild_target) && (P == my_st || rebuild_target == my_st)) {
-        const char *tmp = load_pat;
-        load_pat = save_pat;
-        save_pat = tmp;
+    const char *chunks_pat = "         chunks";
+    const char *parity_pat = "         parity";
+    int report = 0;
+    if (lost_data != 0) {
+        int a = __builtin_ctzll(lost_data);
+        uint64_t rest = lost_data & ~(1ULL << a);
+        int b = rest? __builtin_ctzll(rest) : -1;
+        uint64_t inputs = L & ~lost_data;
+        if (b < 0 && !lost_P)
+            inputs |= 1ULL << P;
+        else if (b < 0 && Q >= 0 && !lost_Q)
+            inputs |= 1ULL << Q;
+        else if (b >= 0 && !lost_P && Q >= 0 && !lost_Q)
+            inputs |= (1ULL << P) | (1ULL << Q);
+        else {
+            /* The lost targets may not have been sent the file */
+            if (my_st == first_holder(key, keylen, fi))
+                printf("Unrecoverable chunk: '%s'\n", key);
+            return 0;
+        }
+        /* The ranks that hold the parity blocks read from parity in stead of
+         * chunks, and the lost targets write to chunks rather than parity. */
+        FileInfo mod_fi = *fi;
+        mod_fi.locations = WITH_P(inputs, (uint64_t)a);
+        mod_fi.Q = (b < 0)? NO_Q : (uint64_t)b;
+        const char *load_pat = (my_st == P || my_st == Q)? parity_pat : chunks_pat;
+        TaskInfo ti = { load_pat, chunks_pat, 1, P, (int)fi->Q, L, 0, NULL };
+        report |= process_task(&hs, key, &mod_fi, ti);
     }
-    FileInfo mod_fi = *fi;
-    if (P != rebuild_target) {
-        mod_fi.locations |= (1 << P);
-        mod_fi.locations &= ~(1 << rebuild_target);
-        mod_fi.locations = WITH_P(mod_fi.locations, (uint64_t)rebuild_target);
+    if (lost_P || lost_Q) {
+        TaskInfo ti = { chunks_pat, parity_pat, 0, -1, -1, 0, 0, NULL };
+        report |= process_task(&hs, key, fi, ti);
     }
-    TaskInfo ti = { load_pat, save_pat, (P != rebuild_target), P };
-    int report = process_task(&hs, key, &mod_fi, ti);
-#if 0
-#define FIRST_8_BITS(x)     ((x) & 0x80 ? 1 : 0), ((x) & 0x40 ? 1 : 0), \
-      ((x) & 0x20 ? 1 : 0), ((x) & 0x10 ? 1 : 0), ((x) & 0x08 ? 1 : 0), \
-      ((x) & 0x04 ? 1 : 0), ((x) & 0x02 ? 1 : 0), ((x) & 0x01 ? 1 : 0) 
-    int locs = mod_fi.locations & 0xFF;
-    int cP = GET_P(mod_fi.locations);
-    if (rank2st[mpi_rank] == rebuild_target)
-    printf("process_task(%d, '%s', %d%d%d%d%d%d%d%d, op=%d, np=%d, '%s', '%s')\n", my_st, key, FIRST_8_BITS(locs), P, cP, load_pat, save_pat);
-#endif
 
     struct timespec tv2;
     clock_gettime(CLOCK_MONOTONIC, &tv2);
@@ -105,30 +213,41 @@ int do_file(const char *key, size_t keylen, const FileInfo *fi)
 
 int main(int argc, char **argv)
 {
-    if (argc != 4)
+    if (argc != 4 && argc != 5)
     {
-        fputs("We need 3 arguments\n", stdout);
+        fputs("We need 3 or 4 arguments\n", stdout);
         return 1;
     }
 
-    MPI_Init(&argc, &argv);
+    /* Only the main thread makes MPI calls, see task_processing.c */
+    int mpi_thread_support;
+    MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &mpi_thread_support);
     MPI_Comm_rank(MPI_COMM_WORLD, &mpi_rank);
     MPI_Comm_size(MPI_COMM_WORLD, &mpi_world_size);
+    if (mpi_thread_support < MPI_THREAD_FUNNELED) {
+        if (mpi_rank == 0)
+            fprintf(stderr, "The MPI library does not support threads\n");
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
 
-    rebuild_target = atoi(argv[1]);
+    /* The second lost target is optional, it needs Q parity */
+    lost_targets[0] = atoi(argv[1]);
     const char *store_dir = argv[2];
     const char *data_file = argv[3];
+    if (argc == 5)
+        lost_targets[1] = atoi(argv[4]);
+    nlost = (argc == 5)? 2 : 1;
 
-    int ntargets = mpi_world_size - 1;
+    ntargets = mpi_world_size - 1;
     if (ntargets > MAX_STORAGE_TARGETS)
         return 1;
 
-    if (rebuild_target < 0 || rebuild_target > ntargets)
+    for (int i = 0; i < nlost; i++)
+        if (lost_targets[i] < 0 || lost_targets[i] >= ntargets)
+            return 1;
+    if (lost_targets[0] == lost_targets[1])
         return 1;
-    helper = 1;
-    while (helper == rebuild_target)
-        helper += 1;
-    if (helper == rebuild_target)
+    if (nlost >= ntargets)
         return 1;
 
     PROF_START(total);
@@ -198,53 +317,89 @@ int main(int argc, char **argv)
     PROF_END(init);
 
     if (mpi_rank == 0)
-        printf("%d(rank=%d), %d(rank=%d)\n", rebuild_target, st2rank[rebuild_target], helper, st2rank[helper]);
+    {
+        for (int i = 0; i < nlost; i++)
+            printf("%d(rank=%d)%s", lost_targets[i], st2rank[lost_targets[i]],
+                    (i + 1 < nlost)? ", " : "\n");
+    }
 
     PROF_START(main_work);
 
     memset(&pr_sender, 0, sizeof(pr_sender));
 
-    if (mpi_rank != 0 && rank2st[mpi_rank] != rebuild_target)
+    if (mpi_rank != 0 && !is_lost(rank2st[mpi_rank]))
     {
         PersistentDB *pdb = pdb_init();
-        pdb_iterate(pdb, do_file);
+        hs.pdb = pdb;
+        pdb_index_init(pdb, ntargets);
+        /* Only the files a lost target kept, and so only the files it is
+         * involved in, are of any use */
+        uint64_t lost_sts = 0;
+        for (int i = 0; i < nlost; i++)
+            lost_sts |= 1ULL << lost_targets[i];
+        pdb_iterate_targets(pdb, lost_sts, collect_file);
+        for (int i = 0; i < nlost; i++) {
+            send_bytes(forward[i], forward_bytes[i], st2rank[lost_targets[i]]);
+            free(forward[i]);
+        }
+        pdb_iterate_targets(pdb, lost_sts, do_file);
+        process_task_flush(&hs);
         pdb_term(pdb);
 
-        if (rank2st[mpi_rank] == helper) {
-            int dummy;
-            MPI_Ssend((void*)&dummy, sizeof(dummy), MPI_BYTE, st2rank[rebuild_target], 0, MPI_COMM_WORLD);
-        }
         pr_add_tmp_to_total(&pr_sample);
         pr_report_progress(&pr_sender, pr_sample);
         pr_report_done(&pr_sender);
     }
-    else if (rank2st[mpi_rank] == rebuild_target)
+    else if (mpi_rank != 0)
     {
-        int helper_rank = st2rank[helper];
-        MPI_Status stat;
-        int count;
-        FileInfo fi;
-        MPI_Recv(&fi, sizeof(FileInfo), MPI_BYTE, helper_rank, 0, MPI_COMM_WORLD, &stat);
-        MPI_Get_count(&stat, MPI_BYTE, &count);
-        while (count == sizeof(FileInfo)) {
-            char key[200];
-            MPI_Recv(key, sizeof(key), MPI_BYTE, helper_rank, 0, MPI_COMM_WORLD, &stat);
-            int keylen;
-            MPI_Get_count(&stat, MPI_BYTE, &keylen);
-            key[keylen] = '\0';
-            do_file(key, keylen, &fi);
-
-            MPI_Recv(&fi, sizeof(FileInfo), MPI_BYTE, helper_rank, 0, MPI_COMM_WORLD, &stat);
-            MPI_Get_count(&stat, MPI_BYTE, &count);
+        /* The files from every other target, merged in to key order so the
+         * tasks come in the same order as on the ranks that walk their DB */
+        uint8_t *received[MAX_STORAGE_TARGETS] = {NULL};
+        uint64_t received_bytes[MAX_STORAGE_TARGETS] = {0};
+        ForwardedFile **files = NULL;
+        size_t nfiles = 0;
+        size_t files_alloc = 0;
+        for (int st = 0; st < ntargets; st++) {
+            if (is_lost(st))
+                continue;
+            received[st] = recv_bytes(NULL, &received_bytes[st], st2rank[st]);
+            for (size_t offset = 0; offset < received_bytes[st];) {
+                ForwardedFile *ff = (ForwardedFile *)(received[st] + offset);
+                offset += forwarded_size(ff->keylen);
+                if (nfiles == files_alloc) {
+                    files_alloc = MAX(1024, 2*files_alloc);
+                    files = realloc(files, files_alloc*sizeof(ForwardedFile *));
+                }
+                files[nfiles++] = ff;
+            }
         }
+        qsort(files, nfiles, sizeof(ForwardedFile *), by_key);
+
+        /* Our DB gets back the entries it kept */
+        PersistentDB *pdb = pdb_init();
+        pdb_index_init(pdb, ntargets);
+        PDBBatch *restored = pdb_batch_begin(pdb);
+        for (size_t j = 0; j < nfiles; j++) {
+            const ForwardedFile *ff = files[j];
+            if (j > 0 && by_key(&files[j - 1], &files[j]) == 0)
+                continue;
+            const char *key = (const char *)(ff + 1);
+            pdb_batch_put(restored, key, ff->keylen, &ff->fi,
+                    db_holders(key, ff->keylen, &ff->fi, ntargets), 0);
+            do_file(key, ff->keylen, &ff->fi);
+        }
+        pdb_batch_commit(restored);
+        pdb_term(pdb);
+        free(files);
+        for (int st = 0; st < ntargets; st++)
+            free(received[st]);
         pr_add_tmp_to_total(&pr_sample);
         pr_report_progress(&pr_sender, pr_sample);
         pr_report_done(&pr_sender);
     }
     else if (mpi_rank == 0)
     {
-        printf("st - total files   | data read     | data written  | disk I/O\n");
-        pr_receive_loop(ntargets-1);
+        pr_receive_loop(ntargets-1, direct_writes());
     }
 
     PROF_END(main_work);
@@ -262,7 +417,7 @@ int main(int argc, char **argv)
     for (size_t i = 0; i < hs.corrupt_count; i++)
     {
         printf("Potentially corrupt chunk: '%s'\n", iter);
-        iter += strlen(iter);
+        iter += strlen(iter) + 1;
     }
 
     MPI_Finalize();
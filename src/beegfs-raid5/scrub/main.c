@@ -0,0 +1,206 @@
+#include <assert.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include <mpi.h>
+
+#include "../common/common.h"
+#include "../common/progress_reporting.h"
+#include "../common/task_processing.h"
+#include "../common/persistent_db.h"
+
+#define PROF_START(name) \
+    struct timespec t_##name##_0; \
+    clock_gettime(CLOCK_MONOTONIC, &t_##name##_0)
+#define PROF_END(name) \
+    struct timespec t_##name##_1; \
+    clock_gettime(CLOCK_MONOTONIC, &t_##name##_1)
+#define PROF_VAL(name) \
+    ((t_##name##_1.tv_sec - t_##name##_0.tv_sec) * 1.0 \
+    + (t_##name##_1.tv_nsec - t_##name##_0.tv_nsec) * 1e-9)
+
+static int mpi_rank;
+static int mpi_world_size;
+int st2rank[MAX_STORAGE_TARGETS];
+int rank2st[MAX_STORAGE_TARGETS+1];
+
+static ProgressSender pr_sender;
+static ProgressSample pr_sample = PROGRESS_SAMPLE_INIT;
+static HostState hs;
+
+/*
+ * Every target walks its database, which holds every file it is involved in,
+ * so all ranks see the files of a task in the same order. The P target of a
+ * file computes P and Q from the chunks like a normal run, but compares them
+ * with the stored parity and its checksums in stead of writing anything.
+ */
+int do_file(const char *key, size_t keylen, const FileInfo *fi)
+{
+    (void)keylen;
+    struct timespec tv1;
+    clock_gettime(CLOCK_MONOTONIC, &tv1);
+
+    hs.storage_target = rank2st[mpi_rank];
+    hs.sample = &pr_sample;
+
+    TaskInfo ti = { "         chunks", "         parity", 0, -1, -1, 0, 1, NULL };
+    int report = process_task(&hs, key, fi, ti);
+
+    struct timespec tv2;
+    clock_gettime(CLOCK_MONOTONIC, &tv2);
+    double dt = (tv2.tv_sec - tv1.tv_sec) * 1.0
+        + (tv2.tv_nsec - tv1.tv_nsec) * 1e-9;
+    if (report) {
+        pr_sample.dt += dt;
+        pr_sample.nfiles += 1;
+    }
+    if (pr_sample.dt >= 1.0) {
+        pr_add_tmp_to_total(&pr_sample);
+        pr_report_progress(&pr_sender, pr_sample);
+        pr_clear_tmp(&pr_sample);
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc != 3 && argc != 4)
+    {
+        fputs("We need 2 or 3 arguments\n", stdout);
+        return 1;
+    }
+
+    /* Only the main thread makes MPI calls, see task_processing.c */
+    int mpi_thread_support;
+    MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &mpi_thread_support);
+    MPI_Comm_rank(MPI_COMM_WORLD, &mpi_rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &mpi_world_size);
+    if (mpi_thread_support < MPI_THREAD_FUNNELED) {
+        if (mpi_rank == 0)
+            fprintf(stderr, "The MPI library does not support threads\n");
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+
+    const char *store_dir = argv[1];
+    const char *data_file = argv[2];
+    /* Optional ceiling on the read bandwidth of each target, in MiB/s */
+    if (argc == 4)
+        hs.read_limit = atof(argv[3]) * 1024 * 1024;
+
+    int ntargets = mpi_world_size - 1;
+    if (ntargets > MAX_STORAGE_TARGETS)
+        return 1;
+
+    PROF_START(total);
+    PROF_START(init);
+
+    int last_run_fd = -1;
+    RunData last_run;
+    memset(&last_run, 0, sizeof(RunData));
+    if (mpi_rank == 0) {
+        last_run_fd = open(data_file, O_RDONLY);
+        read(last_run_fd, &last_run, sizeof(RunData));
+        close(last_run_fd);
+    }
+
+    /* Create mapping from storage targets to ranks, and vice versa */
+    Target targetIDs[MAX_STORAGE_TARGETS] = {{0,0}};
+    Target targetID = {0,0};
+    if (mpi_rank != 0)
+    {
+        int store_fd = open(store_dir, O_DIRECTORY | O_RDONLY);
+        int target_ID_fd = openat(store_fd, "targetNumID", O_RDONLY);
+        char targetID_s[20] = {0};
+        read(target_ID_fd, targetID_s, sizeof(targetID_s));
+        close(target_ID_fd);
+        close(store_fd);
+        targetID.id = atoi(targetID_s);
+        targetID.rank = mpi_rank;
+    }
+    MPI_Gather(
+            &targetID, sizeof(Target), MPI_BYTE,
+            targetIDs, sizeof(Target), MPI_BYTE,
+            0,
+            MPI_COMM_WORLD);
+    if (mpi_rank == 0) {
+        if (last_run.ntargets != ntargets) {
+            /* ERROR - new number of targets */
+            assert(0);
+        }
+        for (int i = 0; i < ntargets; i++)
+            targetIDs[i] = targetIDs[i+1];
+        for (int i = 0; i < ntargets; i++)
+            last_run.targetIDs[i].rank = -1;
+        for (int i = 0; i < ntargets; i++) {
+            Target target = targetIDs[i];
+            int found = 0;
+            for (int j = 0; j < ntargets; j++)
+                if (last_run.targetIDs[j].id == target.id) {
+                    last_run.targetIDs[j] = target;
+                    found = 1;
+                }
+            if (!found) {
+                /* ERROR - new target introduced */
+                printf(" > %d, %d\n", target.id, target.rank);
+                assert(0);
+            }
+        }
+        rank2st[0] = -1;
+        for (int i = 0; i < ntargets; i++)
+        {
+            st2rank[i] = last_run.targetIDs[i].rank;
+            rank2st[st2rank[i]] = i;
+        }
+    }
+    MPI_Bcast(st2rank, sizeof(st2rank), MPI_BYTE, 0, MPI_COMM_WORLD);
+    MPI_Bcast(rank2st, sizeof(rank2st), MPI_BYTE, 0, MPI_COMM_WORLD);
+
+    PROF_END(init);
+
+    PROF_START(main_work);
+
+    memset(&pr_sender, 0, sizeof(pr_sender));
+
+    if (mpi_rank != 0)
+    {
+        PersistentDB *pdb = pdb_init();
+        hs.pdb = pdb;
+        pdb_iterate(pdb, do_file);
+        pdb_term(pdb);
+
+        pr_add_tmp_to_total(&pr_sample);
+        pr_report_progress(&pr_sender, pr_sample);
+        pr_report_done(&pr_sender);
+    }
+    else
+    {
+        pr_receive_loop(ntargets, 0);
+    }
+
+    PROF_END(main_work);
+    PROF_END(total);
+
+    if (mpi_rank == 0) {
+        printf("Overall timings: \n");
+        printf("init       | %9.2f ms\n", 1e3*PROF_VAL(init));
+        printf("main_work  | %9.2f ms\n", 1e3*PROF_VAL(main_work));
+        printf("total      | %9.2f ms\n", 1e3*PROF_VAL(total));
+    }
+
+    MPI_Barrier(MPI_COMM_WORLD);
+    char *iter = hs.corrupt;
+    for (size_t i = 0; i < hs.corrupt_count; i++)
+    {
+        printf("Parity mismatch: '%s'\n", iter);
+        iter += strlen(iter) + 1;
+    }
+
+    MPI_Finalize();
+}
@@ -10,6 +10,9 @@
 
 #define MODIFY_EVENT 0
 #define UNLINK_EVENT 1
+/* Set in the event type of records that are followed by size, inode and
+ * device of the chunk */
+#define EVENT_WITH_STAT 0x100
 
 char buffer[64*1024] = {0};
 int buffer_written = 0;
@@ -19,7 +22,8 @@ int visitor(const char *fpath, const struct stat *sb, int typeflag)
     if (typeflag != FTW_F)
         return 0;
     size_t len = strlen(fpath);
-    size_t fields[3] = {sb->st_mtime, len, MODIFY_EVENT};
+    size_t fields[6] = {sb->st_mtime, len, MODIFY_EVENT | EVENT_WITH_STAT,
+        sb->st_size, sb->st_ino, sb->st_dev};
     if (sizeof(fields) + len + buffer_written >= sizeof(buffer)) {
         write(1, buffer, buffer_written);
         buffer_written = 0;